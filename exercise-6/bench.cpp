@@ -0,0 +1,410 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <filesystem>
+#include <sys/resource.h>
+
+#include "vfs.h"
+#include "trace.h"
+
+#define DEFAULT_SEED 2137
+#define CORPUS_SHARE 0.4
+#define OPEN_REPEATS 5
+#define LS_REPEATS 10
+
+struct CorpusFile {
+    std::string name;
+    size_t size;
+};
+
+// Latencies of every call of one operation, in seconds, the bytes it moved and the page faults it took
+struct OperationResult {
+    std::string name;
+    std::vector<double> latencies = {};
+    size_t bytes = 0;
+    size_t faults = 0;
+};
+
+struct ScenarioResult {
+    std::string corpus;
+    size_t imageSize;
+    bool tailPacking;
+    std::string sync;
+    // How the files are read back: through calls, or out of a plain, populated or huge page mapping
+    std::string access;
+    size_t files;
+    size_t bytes;
+    // Blocks the copied corpus took, INode chunks and fragment blocks included
+    size_t blocksUsed;
+    // fsync and fdatasync calls the operations took
+    size_t syncs;
+    std::vector<OperationResult> operations;
+};
+
+// Minor and major page faults of the process so far
+size_t countFaults() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt + usage.ru_majflt;
+}
+
+class Stopwatch {
+    private:
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    public:
+        double elapsed() const {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+};
+
+size_t parseSize(const std::string& text) {
+    size_t multiplier = 1;
+    char suffix = text.empty() ? ' ' : text.back();
+    if (suffix == 'K' || suffix == 'k') {
+        multiplier = 1024;
+    } else if (suffix == 'M' || suffix == 'm') {
+        multiplier = 1024 * 1024;
+    } else if (suffix == 'G' || suffix == 'g') {
+        multiplier = 1024 * 1024 * 1024;
+    }
+    return std::stoul(multiplier == 1 ? text : text.substr(0, text.size() - 1)) * multiplier;
+}
+
+std::vector<std::string> splitList(const std::string& text) {
+    std::vector<std::string> items;
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t end = text.find(',', start);
+        end = end == std::string::npos ? text.size() : end;
+        if (end > start) {
+            items.push_back(text.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    return items;
+}
+
+// Draws file sizes of a corpus until the byte budget or the INode amount runs out:
+// "tiny" 32 B - 1 KB, "small" 64 B - 4 KB, "mixed" log-uniform 256 B - 1 MB, "large" 4 - 16 MB
+std::vector<CorpusFile> planCorpus(const std::string& corpus, size_t budget, size_t maxFiles, std::mt19937_64& generator) {
+    std::vector<CorpusFile> files;
+    std::uniform_int_distribution<size_t> tinySize(32, 1024);
+    std::uniform_int_distribution<size_t> smallSize(64, 4096);
+    std::uniform_real_distribution<double> mixedExponent(8.0, 20.0);
+    std::uniform_int_distribution<size_t> largeSize(4 * 1024 * 1024, 16 * 1024 * 1024);
+
+    size_t total = 0;
+    while (files.size() < maxFiles) {
+        size_t size;
+        if (corpus == "tiny") {
+            size = tinySize(generator);
+        } else if (corpus == "small") {
+            size = smallSize(generator);
+        } else if (corpus == "mixed") {
+            size = size_t(std::exp2(mixedExponent(generator)));
+        } else {
+            size = largeSize(generator);
+        }
+        // Charged in whole blocks, so the corpus fits an image without tail packing too
+        size_t charged = (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        if (total + charged > budget) {
+            break;
+        }
+        total += charged;
+        files.push_back({corpus + "_" + std::to_string(files.size()) + ".bin", size});
+    }
+    return files;
+}
+
+void writeCorpus(const std::filesystem::path& directory, const std::vector<CorpusFile>& files, std::mt19937_64& generator) {
+    std::filesystem::create_directories(directory);
+    std::vector<uint64_t> buffer;
+    for (const CorpusFile& file : files) {
+        buffer.resize((file.size + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+        for (uint64_t& word : buffer) {
+            word = generator();
+        }
+        std::ofstream output(directory / file.name, std::ios::binary | std::ios::trunc);
+        output.write(reinterpret_cast<char*>(buffer.data()), file.size);
+    }
+}
+
+SyncMode parseSyncMode(const std::string& text) {
+    return text == "batch" ? SyncMode::Batch : text == "data" ? SyncMode::Data : text == "full" ? SyncMode::Full : SyncMode::None;
+}
+
+// Opens the image again the way the files are read back
+VfsError reopen(Volume& volume, const std::filesystem::path& image, const std::string& access) {
+    if (access == "pread") {
+        return volume.open(image);
+    }
+    MapOptions options;
+    options.populate = access == "populate" || access == "huge";
+    options.hugePages = access == "huge";
+    return volume.openMapped(image, options);
+}
+
+ScenarioResult runScenario(const std::string& corpus, size_t imageSize, bool tailPacking, const std::string& sync,
+    const std::string& access, const std::filesystem::path& workDirectory, uint64_t seed) {
+    ScenarioResult result{corpus, imageSize, tailPacking, sync, access, 0, 0, 0, 0, {}};
+    std::filesystem::path image = workDirectory / "bench.img";
+    std::filesystem::path corpusDirectory = workDirectory / "corpus";
+    std::filesystem::path outputDirectory = workDirectory / "output";
+    std::filesystem::remove_all(corpusDirectory);
+    std::filesystem::remove_all(outputDirectory);
+    std::filesystem::create_directories(outputDirectory);
+    std::filesystem::remove(image);
+
+    OperationResult create{"CREATE"};
+    Stopwatch createTimer;
+    if (Volume::create(image, imageSize, tailPacking) != VfsError::None) {
+        std::cerr << "CANNOT CREATE BENCHMARK IMAGE OF " << imageSize << " BYTES" << std::endl;
+        return result;
+    }
+    create.latencies.push_back(createTimer.elapsed());
+    create.bytes = imageSize;
+    result.operations.push_back(create);
+
+    OperationResult open{"OPEN"};
+    Volume volume;
+    volume.setSyncMode(parseSyncMode(sync));
+    for (size_t i = 0; i < OPEN_REPEATS; i++) {
+        Stopwatch timer;
+        volume.open(image);
+        open.latencies.push_back(timer.elapsed());
+    }
+
+    VolumeStatistics statistics;
+    volume.getStatistics(statistics);
+    std::mt19937_64 generator(seed ^ std::hash<std::string>{}(corpus) ^ imageSize);
+    // INodes are only limited by the chunks the free blocks can hold
+    size_t maxFiles = statistics.freeINodeAmount + statistics.freeBlockAmount / INODE_CHUNK_BLOCKS * INODES_PER_CHUNK;
+    std::vector<CorpusFile> files = planCorpus(corpus, size_t(statistics.freeBlockAmount * BLOCK_SIZE * CORPUS_SHARE), maxFiles, generator);
+    writeCorpus(corpusDirectory, files, generator);
+    result.files = files.size();
+    for (const CorpusFile& file : files) {
+        result.bytes += file.size;
+    }
+
+    OperationResult copyTo{"COPYTO"};
+    for (const CorpusFile& file : files) {
+        Stopwatch timer;
+        volume.copyFileIn(corpusDirectory / file.name, file.name);
+        copyTo.latencies.push_back(timer.elapsed());
+        copyTo.bytes += file.size;
+    }
+    result.blocksUsed = statistics.freeBlockAmount - volume.getAmountOfFreeDataBlocks();
+
+    // Everything up to RM only reads, so a mapped volume takes it over
+    volume.close();
+    OperationResult reopened{"REOPEN"};
+    size_t faults = countFaults();
+    Stopwatch reopenTimer;
+    if (reopen(volume, image, access) != VfsError::None) {
+        std::cerr << "CANNOT OPEN BENCHMARK IMAGE FOR " << access << " ACCESS" << std::endl;
+        return result;
+    }
+    reopened.latencies.push_back(reopenTimer.elapsed());
+    reopened.faults = countFaults() - faults;
+
+    OperationResult list{"LS"};
+    faults = countFaults();
+    std::vector<FileInfo> listing;
+    for (size_t i = 0; i < LS_REPEATS; i++) {
+        Stopwatch timer;
+        volume.listFiles(listing);
+        list.latencies.push_back(timer.elapsed());
+    }
+    list.faults = countFaults() - faults;
+
+    OperationResult openFile{"OPENFILE"};
+    FileHandle handle;
+    faults = countFaults();
+    for (const CorpusFile& file : files) {
+        Stopwatch timer;
+        volume.openFile(file.name, handle);
+        openFile.latencies.push_back(timer.elapsed());
+        volume.closeFile(handle);
+    }
+    openFile.faults = countFaults() - faults;
+
+    // Whole files read into memory, the cost of the volume without the host files COPYFROM creates
+    OperationResult read{"READ"};
+    std::vector<std::byte> buffer;
+    faults = countFaults();
+    for (const CorpusFile& file : files) {
+        Stopwatch timer;
+        size_t bytesRead = 0;
+        if (volume.openFile(file.name, handle) == VfsError::None) {
+            buffer.resize(handle.size);
+            volume.read(handle, 0, buffer, bytesRead);
+        }
+        volume.closeFile(handle);
+        read.latencies.push_back(timer.elapsed());
+        read.bytes += bytesRead;
+    }
+    read.faults = countFaults() - faults;
+
+    OperationResult copyFrom{"COPYFROM"};
+    faults = countFaults();
+    for (const CorpusFile& file : files) {
+        Stopwatch timer;
+        volume.copyFileOut(file.name, outputDirectory / file.name);
+        copyFrom.latencies.push_back(timer.elapsed());
+        copyFrom.bytes += file.size;
+    }
+    copyFrom.faults = countFaults() - faults;
+
+    volume.close();
+    volume.open(image);
+    OperationResult remove{"RM"};
+    for (const CorpusFile& file : files) {
+        Stopwatch timer;
+        volume.removeFile(file.name);
+        remove.latencies.push_back(timer.elapsed());
+    }
+
+    IoStatistics ioStatistics;
+    volume.getIoStatistics(ioStatistics);
+    result.syncs = ioStatistics.syncs;
+    volume.close();
+    result.operations.insert(result.operations.end(), {open, copyTo, reopened, list, openFile, read, copyFrom, remove});
+
+    std::filesystem::remove_all(corpusDirectory);
+    std::filesystem::remove_all(outputDirectory);
+    std::filesystem::remove(image);
+    return result;
+}
+
+void writeJson(std::ostream& output, const std::string& label, uint64_t seed, const std::vector<ScenarioResult>& results) {
+    output << "{\n";
+    output << "  \"label\": \"" << label << "\",\n";
+    output << "  \"seed\": " << seed << ",\n";
+    output << "  \"block_size\": " << BLOCK_SIZE << ",\n";
+    output << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const ScenarioResult& result = results[i];
+        output << "    {\n";
+        output << "      \"corpus\": \"" << result.corpus << "\",\n";
+        output << "      \"image_size\": " << result.imageSize << ",\n";
+        output << "      \"packing\": " << (result.tailPacking ? "true" : "false") << ",\n";
+        output << "      \"sync\": \"" << result.sync << "\",\n";
+        output << "      \"syncs\": " << result.syncs << ",\n";
+        output << "      \"access\": \"" << result.access << "\",\n";
+        output << "      \"files\": " << result.files << ",\n";
+        output << "      \"bytes\": " << result.bytes << ",\n";
+        output << "      \"blocks_used\": " << result.blocksUsed << ",\n";
+        // Share of the used blocks holding file data
+        output << "      \"density\": " << (result.blocksUsed == 0 ? 0.0 : double(result.bytes) / (result.blocksUsed * BLOCK_SIZE)) << ",\n";
+        output << "      \"operations\": {\n";
+        for (size_t j = 0; j < result.operations.size(); j++) {
+            const OperationResult& operation = result.operations[j];
+            double seconds = 0.0;
+            for (double latency : operation.latencies) {
+                seconds += latency;
+            }
+            output << "        \"" << operation.name << "\": {"
+                << "\"count\": " << operation.latencies.size()
+                << ", \"seconds\": " << seconds
+                << ", \"ops_per_second\": " << (seconds > 0 ? operation.latencies.size() / seconds : 0.0)
+                << ", \"mb_per_second\": " << (seconds > 0 ? operation.bytes / seconds / (1024 * 1024) : 0.0)
+                << ", \"p50_us\": " << percentile(operation.latencies, 0.50) * 1e6
+                << ", \"p99_us\": " << percentile(operation.latencies, 0.99) * 1e6
+                << ", \"faults\": " << operation.faults
+                << "}" << (j + 1 < result.operations.size() ? "," : "") << "\n";
+        }
+        output << "      }\n";
+        output << "    }" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    output << "  ]\n";
+    output << "}" << std::endl;
+}
+
+void printHelp() {
+    std::cout << "USAGE:" << std::endl;
+    std::cout << "bench [OPTIONS]" << std::endl;
+    std::cout << "--sizes <SIZE,...> - IMAGE SIZES, K/M/G SUFFIXES ALLOWED (DEFAULT 16M,64M,256M)" << std::endl;
+    std::cout << "--corpus <NAME,...> - CORPORA: tiny, small, mixed, large (DEFAULT small, mixed, large)" << std::endl;
+    std::cout << "--packing <off|on,...> - RUN ON IMAGES WITHOUT OR WITH TAIL PACKING (DEFAULT off)" << std::endl;
+    std::cout << "--sync <none|batch|data|full,...> - SYNC MODES OF THE VOLUME, SEE main --sync (DEFAULT none)" << std::endl;
+    std::cout << "--access <pread|plain|populate|huge,...> - READ THE FILES BACK THROUGH CALLS OR OUT OF A READ-ONLY MAPPING,"
+        " SEE main --map (DEFAULT pread)" << std::endl;
+    std::cout << "--seed <N> - SEED OF THE GENERATED CORPORA" << std::endl;
+    std::cout << "--dir <PATH> - WORKING DIRECTORY (DEFAULT bench_work)" << std::endl;
+    std::cout << "--label <TEXT> - LABEL STORED IN THE RESULTS, E.G. A COMMIT" << std::endl;
+    std::cout << "--output <FILE> - WRITE JSON RESULTS TO FILE INSTEAD OF STDOUT" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> sizes = {"16M", "64M", "256M"};
+    std::vector<std::string> corpora = {"small", "mixed", "large"};
+    std::vector<std::string> packings = {"off"};
+    std::vector<std::string> syncs = {"none"};
+    std::vector<std::string> accesses = {"pread"};
+    uint64_t seed = DEFAULT_SEED;
+    std::filesystem::path workDirectory = "bench_work";
+    std::string label;
+    std::string outputPath;
+
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        if (i + 1 >= argc) {
+            printHelp();
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (option == "--sizes") {
+            sizes = splitList(value);
+        } else if (option == "--corpus") {
+            corpora = splitList(value);
+        } else if (option == "--packing") {
+            packings = splitList(value);
+        } else if (option == "--sync") {
+            syncs = splitList(value);
+        } else if (option == "--access") {
+            accesses = splitList(value);
+        } else if (option == "--seed") {
+            seed = std::stoull(value);
+        } else if (option == "--dir") {
+            workDirectory = value;
+        } else if (option == "--label") {
+            label = value;
+        } else if (option == "--output") {
+            outputPath = value;
+        } else {
+            printHelp();
+            return 1;
+        }
+    }
+
+    std::filesystem::create_directories(workDirectory);
+    std::vector<ScenarioResult> results;
+    for (const std::string& corpus : corpora) {
+        for (const std::string& size : sizes) {
+            for (const std::string& packing : packings) {
+                for (const std::string& sync : syncs) {
+                    for (const std::string& access : accesses) {
+                        std::cerr << "RUNNING " << corpus << " CORPUS ON " << size << " IMAGE, PACKING " << packing
+                            << ", SYNC " << sync << ", ACCESS " << access << std::endl;
+                        results.push_back(runScenario(corpus, parseSize(size), packing == "on", sync, access, workDirectory, seed));
+                    }
+                }
+            }
+        }
+    }
+    std::filesystem::remove_all(workDirectory);
+
+    if (outputPath.empty()) {
+        writeJson(std::cout, label, seed, results);
+    } else {
+        std::ofstream output(outputPath);
+        writeJson(output, label, seed, results);
+    }
+    return 0;
+}
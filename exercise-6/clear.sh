@@ -3,4 +3,5 @@
 rm jarek.jpg
 rm wedkarz.txt
 rm tekst.txt
-rm vader.jpg
\ No newline at end of file
+rm vader.jpg
+rm -rf downloaded
@@ -1,511 +1,866 @@
 #include <iostream>
-#include <fstream>
-#include <cstring>
 #include <string>
 #include <vector>
 #include <algorithm>
 #include <filesystem>
+#include <chrono>
+#include <charconv>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
 
-#define MAGIC_NUMBER 2137
-#define FILE_NAME_SIZE 512
-#define BLOCK_SIZE 1024
-#define MIN_FILE_SYSTEM_SIZE 1048576
-#define I_NODES_AMOUNT_DIVIDER 4096 / 2
-#define MAP_NEW_LINE 80
-
-struct INode {
-    char fileName[FILE_NAME_SIZE] = {};
-    size_t fileSize = 0;
-    size_t firstBlock = 0;
-};
-
-struct DataBlock {
-    char data[BLOCK_SIZE] = {};
-    size_t nextBlock = 0;
-};
-
-struct SuperBlock {
-    size_t magicNumber;
-    size_t fileSystemSize;
-    size_t iNodeAmount;
-    size_t blockAmount;
-    size_t iNodeStart;
-    size_t blockStart;
-};
+#include "vfs.h"
+#include "trace.h"
+#include "server.h"
 
-class VirtualFileSystem {
-    private:
-        SuperBlock superBlock;
-        std::vector<INode> iNodes;
-        std::vector<DataBlock> dataBlocks;
-        std::fstream discFile;
-
-        void initializeSuperBlock(size_t systemSize) {
-            superBlock.magicNumber = MAGIC_NUMBER;
-            superBlock.fileSystemSize = systemSize;
-            superBlock.iNodeAmount = superBlock.fileSystemSize / I_NODES_AMOUNT_DIVIDER;
-            superBlock.blockAmount = (superBlock.fileSystemSize - sizeof(SuperBlock) - superBlock.iNodeAmount * sizeof(INode)) / sizeof(DataBlock);
-            superBlock.iNodeStart = sizeof(SuperBlock);
-            superBlock.blockStart = superBlock.iNodeStart + superBlock.iNodeAmount * sizeof(INode);
-        }
-
-        void writeSuperBlock() {
-            discFile.seekp(0, std::ios::beg);
-            discFile.write(reinterpret_cast<char*>(&superBlock), sizeof(SuperBlock));
-        }
+#define MAP_NEW_LINE 80
 
-        void writeINode(size_t index, INode& iNode) {
-            size_t offset = superBlock.iNodeStart + index * sizeof(INode);
-            discFile.seekp(offset, std::ios::beg);
-            discFile.write(reinterpret_cast<char*>(&iNode), sizeof(INode));
-            iNodes.push_back(iNode);
-        }
+// Files are copied under their own name, into the root of the system or the current directory of the host
+// unless --into names another directory, the same way IMPORT names the files of a directory
+std::string copiedFileName(const std::string& path, const std::string& directory) {
+    std::filesystem::path name = std::filesystem::path(path).filename();
+    return directory.empty() ? name.string() : (std::filesystem::path(directory) / name).generic_string();
+}
 
-        void writeIdNodes() {
-            for (size_t i = 0; i < superBlock.iNodeAmount; ++i) {
-                INode iNode;
-                writeINode(i, iNode);
-            }
-        }
+// Reads a count given on the command line, anything but a whole decimal number is refused
+bool parseCount(const std::string& text, size_t& value) {
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    return !text.empty() && error == std::errc() && end == text.data() + text.size();
+}
 
-        void writeDataBlock(size_t index, DataBlock& dataBlock) {
-            size_t offset = superBlock.blockStart + index * sizeof(DataBlock);
-            discFile.seekp(offset, std::ios::beg);
-            discFile.write(reinterpret_cast<char*>(&dataBlock), sizeof(DataBlock));
-            dataBlocks.push_back(dataBlock);
-        }
+bool fileExists(const std::string& name) {
+    return std::filesystem::exists(name);
+}
 
-        void writeDataBlocks() {
-            for (size_t i = 0; i < superBlock.blockAmount; ++i) {
-                DataBlock dataBlock;
-                writeDataBlock(i, dataBlock);
-            }
-        }
+// Opens the volume or reports why it cannot be opened
+bool openSystem(Volume& volume, const std::string& systemName, const MapOptions* mapping) {
+    VfsError error = mapping ? volume.openMapped(systemName, *mapping) : volume.open(systemName);
+    if (error == VfsError::NotFound) {
+        std::cout << "SYSTEM " << systemName << " NOT FOUND" << std::endl;
+    } else if (error != VfsError::None) {
+        std::cout << describeError(error) << std::endl;
+    }
+    return error == VfsError::None;
+}
 
-        void loadSuperBlock() {
-            discFile.seekg(0, std::ios::beg);
-            discFile.read(reinterpret_cast<char*>(&superBlock), sizeof(SuperBlock));
+void createSystem(size_t size, const std::string& name, bool tailPacking, const std::vector<std::string>& members) {
+    VfsError error = Volume::create(name, size, tailPacking, members);
+    if (error == VfsError::AlreadyExists) {
+        std::cout << "SYSTEM " << name << " ALREADY EXISTS" << std::endl;
+    } else if (error != VfsError::None) {
+        std::cout << "SYSTEM " << name << " CANNOT BE CREATED" << std::endl;
+        std::cout << describeError(error) << std::endl;
+    } else {
+        std::cout << "SYSTEM " << name << " HAS BEEN CREATED" << std::endl;
+    }
+}
 
-            if (superBlock.magicNumber != MAGIC_NUMBER) {
-            throw std::runtime_error("INVALID MAGIC NUMBER, SYSTEM CORRUPTED");
-            }
-        }
+void deleteSystem(const std::string& name) {
+    VfsError error = Volume::destroy(name);
+    if (error == VfsError::NotFound) {
+        std::cout << "SYSTEM " << name << " NOT FOUND" << std::endl;
+    } else if (error != VfsError::None) {
+        std::cout << "ERROR DURING DELETING SYSTEM HAS OCCURED" << std::endl;
+    } else {
+        std::cout << "SYSTEM " << name << " HAS BEEN DELETED" << std::endl;
+    }
+}
 
-        void loadINodes() {
-            for (size_t i = 0; i < superBlock.iNodeAmount; ++i) {
-                INode iNode;
-                size_t offset = superBlock.iNodeStart + i * sizeof(INode);
-                discFile.seekg(offset, std::ios::beg);
-                discFile.read(reinterpret_cast<char*>(&iNode), sizeof(INode));
-                iNodes.push_back(iNode);
-            }
-        }
+void reportFileDeleted(VfsError error, const std::string& fileName) {
+    if (error == VfsError::NotFound) {
+        std::cout << "FILE " << fileName << " NOT FOUND" << std::endl;
+    } else if (error != VfsError::None) {
+        std::cout << describeError(error) << std::endl;
+    } else {
+        std::cout << "FILE " << fileName << " HAS BEEN DELETED" << std::endl;
+    }
+}
 
-        void loadDataBlock() {
-            for (size_t i = 0; i < superBlock.blockAmount; ++i) {
-                DataBlock dataBlock;
-                size_t offset = superBlock.blockStart + i * sizeof(DataBlock);
-                discFile.seekg(offset, std::ios::beg);
-                discFile.read(reinterpret_cast<char*>(&dataBlock), sizeof(DataBlock));
-                dataBlocks.push_back(dataBlock);
-            }
-        }
+void reportCopiedToSystem(VfsError error, const std::string& systemName, const std::string& fileName) {
+    if (error == VfsError::None) {
+        std::cout << "FILE '" << fileName << "' HAS BEEN SUCCESSFULLY COPIED TO SYSTEM '" << systemName << "'." << std::endl;
+        return;
+    }
 
-        void loadSystem(const std::string& name) {
+    std::cout << "CANNOT COPY FILE " << fileName << " TO SYSTEM " << systemName << std::endl;
+    if (error == VfsError::AlreadyExists) {
+        std::cout << "FILE " << fileName << " ALREADY EXISTS" << std::endl;
+    } else {
+        std::cout << describeError(error) << std::endl;
+    }
+}
 
-            if (!fileExists(name)) {
-                throw std::runtime_error("SYSTEM " + name + " NOT FOUND");
-            }
+void reportCopiedFromSystem(VfsError error, const std::string& systemName, const std::string& fileName) {
+    if (error == VfsError::None) {
+        std::cout << "FILE '" << fileName << "' HAS BEEN SUCCESSFULLY COPIED FROM SYSTEM '" << systemName << std::endl;
+        return;
+    }
 
-            discFile.open(name, std::ios::in | std::ios::out | std::ios::binary);
-            loadSuperBlock();
-            loadINodes();
-            loadDataBlock();
-            discFile.close();
-        }
+    std::cout << "CANNOT COPY FILE '" << fileName << "' FROM SYSTEM '" << systemName << "'" << std::endl;
+    if (error == VfsError::NotFound) {
+        std::cout << "FILE " << fileName << " NOT FOUND" << std::endl;
+    } else {
+        std::cout << describeError(error) << std::endl;
+    }
+}
 
-        bool fileExists(const std::string& name) {
-            std::ifstream file(name);
-            return file.good();
-        }
+void reportUpdated(VfsError error, const std::string& systemName, const std::string& fileName, size_t bytesWritten) {
+    if (error == VfsError::None) {
+        std::cout << "FILE '" << fileName << "' HAS BEEN UPDATED IN SYSTEM '" << systemName << "', " << bytesWritten << " BYTES WRITTEN" << std::endl;
+        return;
+    }
 
-        std::string extractFileName(const std::string& filePath) {
-            return std::filesystem::path(filePath).filename().string();
-        }
+    std::cout << "CANNOT UPDATE FILE " << fileName << " IN SYSTEM " << systemName << std::endl;
+    if (error == VfsError::NotFound) {
+        std::cout << "FILE " << fileName << " NOT FOUND" << std::endl;
+    } else {
+        std::cout << describeError(error) << std::endl;
+    }
+}
 
-        bool isINodeFree(int index) {
-            return iNodes[index].fileSize == 0 && iNodes[index].firstBlock == 0;
+// Files of subdirectories are named with their path relative to the imported directory
+void importDirectory(Volume& volume, const std::string& systemName, const std::string& directory, ImportOrder order) {
+    std::vector<ImportEntry> entries;
+    std::error_code error;
+    for (auto it = std::filesystem::recursive_directory_iterator(directory, error); !error && it != std::filesystem::recursive_directory_iterator(); it.increment(error)) {
+        if (it->is_regular_file()) {
+            entries.push_back({it->path().string(), std::filesystem::relative(it->path(), directory).generic_string()});
         }
+    }
+    if (error) {
+        std::cout << "CANNOT READ DIRECTORY " << directory << std::endl;
+        return;
+    }
 
-        bool isDataBlockFree(int index) {
-            return std::all_of(std::begin(dataBlocks[index].data), std::end(dataBlocks[index].data), [](char c) { return c == '\0'; });
+    VfsError result = volume.importFiles(entries, order);
+    size_t imported = 0;
+    size_t bytes = 0;
+    for (const ImportEntry& entry : entries) {
+        if (entry.error != VfsError::None) {
+            std::cout << "CANNOT IMPORT FILE " << entry.name << std::endl;
+            std::cout << (entry.error == VfsError::AlreadyExists ? "FILE " + entry.name + " ALREADY EXISTS" : describeError(entry.error)) << std::endl;
+        } else if (result == VfsError::None) {
+            imported++;
+            bytes += entry.size;
         }
+    }
+    if (result != VfsError::None) {
+        std::cout << "CANNOT IMPORT DIRECTORY " << directory << " TO SYSTEM " << systemName << std::endl;
+        std::cout << describeError(result) << std::endl;
+    } else {
+        std::cout << imported << " FILES, " << bytes << " BYTES HAVE BEEN IMPORTED TO SYSTEM '" << systemName << "'" << std::endl;
+    }
+}
 
-        int getFirstFreeINodeIndex() {
-            for (int i = 0; i < iNodes.size(); i++) {
-                if (isINodeFree(i)) {
-                    return i;
-                }
-            }
-            return -1;
-        }
+// The archive goes to standard output when no path is given, messages then go to standard error
+void exportSystem(Volume& volume, const std::string& systemName, const std::string& archivePath) {
+    bool toOutput = archivePath.empty() || archivePath == "-";
+    int archiveFile = toOutput ? STDOUT_FILENO : ::open(archivePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    std::ostream& messages = toOutput ? std::cerr : std::cout;
+    if (archiveFile < 0) {
+        messages << "CANNOT CREATE ARCHIVE " << archivePath << std::endl;
+        return;
+    }
 
-        int getFirstFreeDataBlockIndex() {
-            for (int i = 0; i < dataBlocks.size(); i++) {
-                if (isDataBlockFree(i)) {
-                    return i;
-                }
-            }
-            
-            return -1;
-        }
+    size_t filesExported;
+    VfsError error = volume.exportArchive(archiveFile, filesExported);
+    if (!toOutput) {
+        ::close(archiveFile);
+    }
+    if (error != VfsError::None) {
+        messages << "CANNOT EXPORT SYSTEM " << systemName << std::endl;
+        messages << describeError(error) << std::endl;
+    } else if (!toOutput) {
+        messages << filesExported << " FILES HAVE BEEN EXPORTED FROM SYSTEM '" << systemName << "' TO '" << archivePath << "'" << std::endl;
+    }
+}
 
-        int getNextFreeDataBlockIndex(int index) {
-            for (int i = index + 1; i < dataBlocks.size(); i++) {
-                if (isDataBlockFree(i)) {
-                    return i;
-                }
-            }
-            return -1;
-        }
+void reportCloned(VfsError error, const std::string& source, const std::string& name) {
+    if (error == VfsError::None) {
+        std::cout << "FILE '" << source << "' HAS BEEN CLONED AS '" << name << "'" << std::endl;
+        return;
+    }
 
-        int getAmountOfFreeDataBlocks() {
-            int freeDataBlocks = 0;
-            for (int i = 0; i < dataBlocks.size(); i++) {
-                if (isDataBlockFree(i)) {
-                    freeDataBlocks++;
-                }
-            }
-            return freeDataBlocks;
-        }
+    std::cout << "CANNOT CLONE FILE " << source << std::endl;
+    if (error == VfsError::NotFound) {
+        std::cout << "FILE " << source << " NOT FOUND" << std::endl;
+    } else if (error == VfsError::AlreadyExists) {
+        std::cout << "FILE " << name << " ALREADY EXISTS" << std::endl;
+    } else {
+        std::cout << describeError(error) << std::endl;
+    }
+}
 
-        int getINodeIndex(const std::string& fileName) {
-            for (int i = 0; i < iNodes.size(); i++) {
-                if (std::strcmp(iNodes[i].fileName, fileName.c_str()) == 0) {
-                    return i;
-                }
-            }
-            
-            return -1;
-        }
+void reportDirectory(VfsError error, const std::string& command, const std::string& path) {
+    if (error == VfsError::None) {
+        std::cout << "DIRECTORY " << path << (command == "MKDIR" ? " HAS BEEN CREATED" : " HAS BEEN DELETED") << std::endl;
+        return;
+    }
 
-        int calculateDataBlockIndexFromOffset(size_t blockOffset) {
-            return (blockOffset - superBlock.blockStart) / sizeof(DataBlock);
-        }
+    std::cout << (command == "MKDIR" ? "CANNOT CREATE DIRECTORY " : "CANNOT DELETE DIRECTORY ") << path << std::endl;
+    if (error == VfsError::NotFound) {
+        std::cout << "DIRECTORY " << path << " NOT FOUND" << std::endl;
+    } else if (error == VfsError::AlreadyExists) {
+        std::cout << "FILE " << path << " ALREADY EXISTS" << std::endl;
+    } else {
+        std::cout << describeError(error) << std::endl;
+    }
+}
 
-        size_t calculateDataBlockOffsetFromIndex(int blockIndex) {
-            return superBlock.blockStart + blockIndex * sizeof(DataBlock);
-        }
+void reportSnapshot(VfsError error, const std::string& command, const std::string& name) {
+    if (error == VfsError::NotFound) {
+        std::cout << "SNAPSHOT " << name << " NOT FOUND" << std::endl;
+    } else if (error == VfsError::AlreadyExists) {
+        std::cout << "SNAPSHOT " << name << " ALREADY EXISTS" << std::endl;
+    } else if (error != VfsError::None) {
+        std::cout << describeError(error) << std::endl;
+    } else if (command == "SNAPSHOT") {
+        std::cout << "SNAPSHOT " << name << " HAS BEEN CREATED" << std::endl;
+    } else if (command == "ROLLBACK") {
+        std::cout << "SYSTEM HAS BEEN ROLLED BACK TO SNAPSHOT " << name << std::endl;
+    } else {
+        std::cout << "SNAPSHOT " << name << " HAS BEEN DELETED" << std::endl;
+    }
+}
 
-    public:
-        VirtualFileSystem() = default;
+void showSnapshots(const std::vector<SnapshotInfo>& snapshots) {
+    for (const SnapshotInfo& snapshot : snapshots) {
+        std::cout << snapshot.name << ": " << snapshot.files << " FILES" << std::endl;
+    }
+}
 
-        void createSystem(size_t size, const std::string& name) {
+void reportReorganized(VfsError error, const ReorganizeReport& report, const std::string& systemName) {
+    if (error != VfsError::None) {
+        std::cout << "CANNOT REORGANIZE SYSTEM " << systemName << std::endl;
+        std::cout << describeError(error) << std::endl;
+        return;
+    }
+    std::cout << report.hotFiles << " FILES HAVE BEEN OPENED, " << report.filesMoved << " MOVED WITH "
+        << report.blocksMoved << " BLOCKS, " << report.filesSkipped << " SKIPPED, " << report.coldFilesMoved
+        << " OTHER FILES MOVED AWAY WITH " << report.coldBlocksMoved << " BLOCKS" << std::endl;
+}
 
-            if (fileExists(name)) {
-                std::cout << "SYSTEM " << name << " ALREADY EXISTS" << std::endl;
-                return;
-            }
+void reportChecked(VfsError error, const CheckReport& report, const std::string& systemName, bool repair) {
+    if (error != VfsError::None) {
+        std::cout << "CANNOT CHECK SYSTEM " << systemName << std::endl;
+        std::cout << describeError(error) << std::endl;
+        return;
+    }
+    std::cout << "FILES CHECKED: " << report.files << std::endl;
+    std::cout << "BLOCKS IN USE: " << report.blocksInUse << std::endl;
+    std::cout << "CROSS-LINKED BLOCKS: " << report.crossLinkedBlocks << std::endl;
+    std::cout << "CHAINS WITH CYCLES: " << report.cycles << std::endl;
+    std::cout << "ORPHAN BLOCKS: " << report.orphanBlocks << std::endl;
+    std::cout << "BLOCKS IN USE MARKED FREE: " << report.unmarkedBlocks << std::endl;
+    std::cout << "SIZE MISMATCHES: " << report.sizeMismatches << std::endl;
+    std::cout << "OVERLAPPING TAILS: " << report.overlappingTails << std::endl;
+    std::cout << "SHARE COUNT MISMATCHES: " << report.shareCountMismatches << std::endl;
+    std::cout << "COUNTER MISMATCHES: " << report.counterMismatches << std::endl;
+    // Bitmaps and counters are rebuilt from the files, damaged files themselves are left to the user
+    size_t allocationErrors = report.crossLinkedBlocks + report.orphanBlocks + report.unmarkedBlocks
+        + report.shareCountMismatches + report.counterMismatches;
+    size_t fileErrors = report.cycles + report.sizeMismatches + report.overlappingTails;
+    if (allocationErrors == 0 && fileErrors == 0) {
+        std::cout << "SYSTEM " << systemName << " IS CLEAN" << std::endl;
+    } else if (allocationErrors > 0 && repair) {
+        std::cout << "BITMAPS AND COUNTERS OF SYSTEM " << systemName << " HAVE BEEN REBUILT IN " << report.groupsRepaired << " GROUPS" << std::endl;
+    } else if (allocationErrors > 0) {
+        std::cout << "BITMAPS AND COUNTERS OF SYSTEM " << systemName << " ARE WRONG, FSCK --repair REBUILDS THEM" << std::endl;
+    }
+    if (fileErrors > 0) {
+        std::cout << "FILES OF SYSTEM " << systemName << " ARE DAMAGED, REMOVE AND COPY THEM AGAIN" << std::endl;
+    }
+}
 
-            if (size < MIN_FILE_SYSTEM_SIZE) {
-                std::cout << "SYSTEM " << name << " CANNOT BE CREATED" << std::endl;
-                std::cout << "FILE SYSTEM SIZE TOO SMALL" << std::endl;
-                return;
-            }
+// Directories end with '/'
+void showFiles(const std::vector<FileInfo>& files) {
+    for (const FileInfo& file : files) {
+        std::cout << file.name << (file.directory ? "/" : "") << std::endl;
+    }
+}
 
-            discFile.open(name, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
-            initializeSuperBlock(size);
-            writeSuperBlock();
-            writeIdNodes();
-            writeDataBlocks();
-            discFile.close();
+// Prints cells as runs of equal characters, '*' used, '0' free and '+' partially used
+void showRunLengthMap(const std::vector<size_t>& usage, size_t scale, size_t amount) {
+    auto cellAt = [&](size_t i) {
+        size_t cellSize = std::min(scale, amount - i * scale);
+        return usage[i] == 0 ? '0' : (usage[i] == cellSize ? '*' : '+');
+    };
 
-            std::cout << "SYSTEM " << name << " HAS BEEN CREATED" << std::endl;
+    std::string line;
+    for (size_t i = 0; i < usage.size();) {
+        char cell = cellAt(i);
+        size_t runLength = 1;
+        while (i + runLength < usage.size() && cellAt(i + runLength) == cell) {
+            runLength++;
         }
 
-        void deleteFile(const std::string& systemName, const std::string& fileName) {
-            loadSystem(systemName);
-            
-            // Getting the index of the file from INode in memory
-            int fileIndexInteger = getINodeIndex(fileName);
-
-            // Checking if the file exists on the system
-            if (fileIndexInteger == -1) {
-                std::cout << "FILE " << fileName << " NOT FOUND" << std::endl;
-                return;
-            }
-
-            size_t fileIndex = size_t(fileIndexInteger);
-
-            // Getting the first and current block offset from INode in memory
-            size_t currentBlockOffset = iNodes[fileIndex].firstBlock;
-            discFile.open(systemName, std::ios::in | std::ios::out | std::ios::binary);
-            while (currentBlockOffset != 0) {
-                // Calculating the index of the current block in memory
-                int currentBlockIndex = calculateDataBlockIndexFromOffset(currentBlockOffset);
-                // Getting the next block offset from the current block in memory
-                size_t nextBlockOffset = dataBlocks[currentBlockIndex].nextBlock;
-                // Clearning data block in memory and file
-                dataBlocks[currentBlockIndex] = DataBlock();
-                discFile.seekp(currentBlockOffset, std::ios::beg);
-                discFile.write(reinterpret_cast<char*>(&dataBlocks[currentBlockIndex]), sizeof(DataBlock));
-                currentBlockOffset = nextBlockOffset;
-            }
-
-            // Clearing INode in memory and file
-            iNodes[fileIndex] = INode();
-            discFile.seekp(superBlock.iNodeStart + fileIndex * sizeof(INode), std::ios::beg);
-            discFile.write(reinterpret_cast<char*>(&iNodes[fileIndex]), sizeof(INode));
-            discFile.close();
+        std::string run = std::string(1, cell) + "x" + std::to_string(runLength) + " ";
+        if (line.size() + run.size() > MAP_NEW_LINE) {
+            std::cout << line << '\n';
+            line.clear();
+        }
+        line += run;
+        i += runLength;
+    }
+    std::cout << line << std::endl;
+}
 
-            std::cout << "FILE " << fileName << " HAS BEEN DELETED" << std::endl;
+void showMap(const std::vector<size_t>& usage) {
+    std::string map;
+    for (size_t i = 0; i < usage.size(); i++) {
+        if (i % MAP_NEW_LINE == 0 && i != 0) {
+            map += '\n';
         }
+        map += usage[i] == 0 ? '0' : '*';
+    }
+    std::cout << map << std::endl;
+}
 
-        void copyFileToSystem(const std::string& systemName, std::string name) {
-            // Checking if the file exists outside the system
-            if (!fileExists(name)) {
-                std::cout << "CANNOT COPY FILE " << name << " TO SYSTEM " << systemName << std::endl;
-                std::cout << "FILE " << name << " NOT FOUND" << std::endl;
-                return;
-            }
-            
-            loadSystem(systemName);
+void showMemoryMap(Volume& volume, size_t scale) {
+    std::vector<size_t> usedINodes;
+    std::vector<size_t> usedBlocks;
+    volume.getINodeUsage(scale, usedINodes);
+    volume.getBlockUsage(scale, usedBlocks);
+
+    if (scale > 1) {
+        std::cout << "------INODES------ (" << scale << " PER CELL)" << std::endl;
+        showRunLengthMap(usedINodes, scale, volume.getINodeAmount());
+        std::cout << "----DATA BLOCKS---- (" << scale << " PER CELL)" << std::endl;
+        showRunLengthMap(usedBlocks, scale, volume.getBlockAmount());
+        return;
+    }
 
-            // Checking if the file already exists in the system
-            if (getINodeIndex(extractFileName(name)) != -1) {
-                std::cout << "CANNOT COPY FILE " << extractFileName(name) << " TO SYSTEM " << systemName << std::endl;
-                std::cout << "FILE " << extractFileName(name) << " ALREADY EXISTS" << std::endl;
-                return;
-            }
-            
-            // Getting the size of the file
-            std::ifstream file(name, std::ios::binary | std::ios::ate);
-
-            size_t fileSize = file.tellg();
-            file.seekg(0, std::ios::beg);
-
-            int freeINodeIndex = getFirstFreeINodeIndex();
-            
-            // Checking if free INode exists
-            if (freeINodeIndex == -1) {
-                std::cout << "CANNOT COPY FILE " << extractFileName(name) << " TO SYSTEM " << systemName << std::endl;
-                std::cout << "NO FREE INODES" << std::endl;
-                return;
-            }
+    std::cout << "------INODES------" << std::endl;
+    showMap(usedINodes);
+    std::cout << "----DATA BLOCKS----" << std::endl;
+    showMap(usedBlocks);
+}
 
-            // Checking if there is enough space for the file
-            if (fileSize > getAmountOfFreeDataBlocks() * sizeof(DataBlock)) {
-                std::cout << "CANNOT COPY FILE " << extractFileName(name) << " TO SYSTEM " << systemName << std::endl;
-                std::cout << "NOT ENOUGH SPACE" << std::endl;
-                return;
-            }
+void showStatistics(Volume& volume) {
+    VolumeStatistics statistics;
+    volume.getStatistics(statistics);
 
-            discFile.open(systemName, std::ios::in | std::ios::out | std::ios::binary);
-            
-            // Creating new INode in memory and file
-            INode iNode;
-            strncpy(iNode.fileName, extractFileName(name).c_str(), sizeof(iNode.fileName) - 1);
-            iNode.fileName[sizeof(iNode.fileName) - 1] = '\0';
-            iNode.fileSize = fileSize;
-            int freeDataBlockIndex = getFirstFreeDataBlockIndex();
-            iNode.firstBlock = calculateDataBlockOffsetFromIndex(freeDataBlockIndex);
-
-            discFile.seekp(superBlock.iNodeStart + freeINodeIndex * sizeof(INode), std::ios::beg);
-            discFile.write(reinterpret_cast<char*>(&iNode), sizeof(INode));
-
-            // Writing the file to memory and file
-            size_t remainingSize = fileSize;
-            size_t currentBlockOffset = iNode.firstBlock;
-            while (remainingSize > 0) {
-                DataBlock dataBlock;
-                size_t sizeToRead = std::min(remainingSize, sizeof(dataBlock.data));
-                int currentBlockIndex = calculateDataBlockIndexFromOffset(currentBlockOffset);
-
-                file.read(dataBlock.data, sizeToRead);
-                remainingSize -= sizeToRead;
-
-                // Find the next free data block
-                int nextBlockIndex = (remainingSize > 0) ? getNextFreeDataBlockIndex(currentBlockIndex) : 0;
-                dataBlock.nextBlock = (nextBlockIndex != -1) ? calculateDataBlockOffsetFromIndex(nextBlockIndex) : 0;
-                
-                // Write the data block to the file
-                discFile.seekp(currentBlockOffset, std::ios::beg);
-                discFile.write(reinterpret_cast<char*>(&dataBlock), sizeof(DataBlock));
-
-                dataBlocks[currentBlockIndex] = dataBlock;
-
-                currentBlockOffset = dataBlock.nextBlock;
-            }
+    std::cout << "GROUPS: " << statistics.groupAmount << std::endl;
+    if (statistics.memberAmount > 1) {
+        std::cout << "MEMBER FILES: " << statistics.memberAmount << ", STRIPED IN UNITS OF " << STRIPE_UNIT_SIZE << " BYTES" << std::endl;
+    }
+    std::cout << "INODES: " << statistics.iNodeAmount << " TOTAL IN " << statistics.iNodeChunkAmount << " CHUNKS, "
+        << statistics.iNodeAmount - statistics.freeINodeAmount << " USED, "
+        << statistics.freeINodeAmount << " FREE" << std::endl;
+    std::cout << "DATA BLOCKS: " << statistics.blockAmount << " TOTAL, "
+        << statistics.blockAmount - statistics.freeBlockAmount << " USED, " << statistics.freeBlockAmount << " FREE" << std::endl;
+    std::cout << "LARGEST FREE EXTENT: " << statistics.largestFreeExtent << " BLOCKS" << std::endl;
+    std::cout << "FREE EXTENTS: " << statistics.freeExtents << std::endl;
+    std::cout << "SHARED DATA BLOCKS: " << statistics.sharedBlockAmount << std::endl;
+    std::cout << "SNAPSHOTS: " << statistics.snapshotAmount << std::endl;
+    std::cout << "DIRECTORIES: " << statistics.directoryAmount << ", " << statistics.directoryBlockAmount << " BLOCKS" << std::endl;
+    if (statistics.tailPacking) {
+        std::cout << "FRAGMENT BLOCKS: " << statistics.fragmentBlockAmount << ", "
+            << statistics.fragmentBytesTaken << " OF " << statistics.fragmentBlockAmount * BLOCK_SIZE << " BYTES TAKEN BY TAILS" << std::endl;
+    }
+    for (size_t i = 0; i < statistics.freeExtentHistogram.size(); i++) {
+        if (statistics.freeExtentHistogram[i] != 0) {
+            std::cout << "  " << (size_t(1) << i) << "-" << (size_t(1) << (i + 1)) - 1 << " BLOCKS: " << statistics.freeExtentHistogram[i] << std::endl;
+        }
+    }
 
-            file.close();
-            discFile.close();
+    // A file in one run has one fragment
+    std::vector<FileInfo> files;
+    volume.listFiles(files, true);
+    size_t fragmentedFiles = 0;
+    size_t fragments = 0;
+    std::cout << "FILES:" << std::endl;
+    for (FileInfo& file : files) {
+        std::cout << "  " << file.name << ": " << (file.size + BLOCK_SIZE - 1) / BLOCK_SIZE
+            << " BLOCKS, " << file.fragments << " FRAGMENTS" << std::endl;
+        fragments += file.fragments;
+        fragmentedFiles += file.fragments > 1 ? 1 : 0;
+    }
 
-            std::cout << "FILE '" << extractFileName(name) << "' HAS BEEN SUCCESSFULLY COPIED TO SYSTEM '" << systemName << "'." << std::endl;
-        }
+    std::cout << "FRAGMENTED FILES: " << fragmentedFiles << " OF " << files.size() << std::endl;
+    std::cout << "FRAGMENTS PER FILE: " << (files.empty() ? 0.0 : double(fragments) / files.size()) << std::endl;
+    // 0 when all free space is one run, close to 1 when it is scattered in single blocks
+    std::cout << "FRAGMENTATION INDEX: "
+        << (statistics.freeBlockAmount == 0 ? 0.0 : 1.0 - double(statistics.largestFreeExtent) / statistics.freeBlockAmount) << std::endl;
+}
 
-        void copyFileFromSystem(const std::string& systemName, const std::string& fileName) {
-            loadSystem(systemName);
+enum class StatsMode {
+    None,
+    Text,
+    Json
+};
 
-            // Checking if the file exists in the system
-            int fileIndex = getINodeIndex(fileName);
+// Prints the I/O counters of the command, commands without an open volume only report the total time
+void printIoStatistics(const Volume* volume, StatsMode mode, const std::string& command, double totalSeconds) {
+    IoStatistics statistics = {};
+    if (volume != nullptr) {
+        volume->getIoStatistics(statistics);
+    }
 
-            if (fileIndex == -1) {
-                std::cout << "CANNOT COPY FILE '" << fileName << "' FROM SYSTEM '" << systemName << "'" << std::endl;
-                std::cout << "FILE " << fileName << " NOT FOUND" << std::endl;
-                return;
-            }
+    if (mode == StatsMode::Json) {
+        std::cout << "{\"command\": \"" << command << "\", \"enabled\": " << (statistics.enabled ? "true" : "false")
+            << ", \"total_ms\": " << totalSeconds * 1e3
+            << ", \"bytes_read\": " << statistics.bytesRead
+            << ", \"bytes_written\": " << statistics.bytesWritten
+            << ", \"seeks\": " << statistics.seeks
+            << ", \"syscalls\": " << statistics.syscalls
+            << ", \"blocks_scanned\": " << statistics.blocksScanned
+            << ", \"syncs\": " << statistics.syncs
+            << ", \"phases_ms\": {";
+        for (size_t i = 0; i < PHASE_AMOUNT; i++) {
+            std::cout << (i == 0 ? "" : ", ") << "\"" << describePhase(VfsPhase(i)) << "\": " << statistics.phaseNanoseconds[i] / 1e6;
+        }
+        std::cout << "}}" << std::endl;
+        return;
+    }
 
-            // Getting the file size and the first block offset from INode in memory
-           INode fileINode = iNodes[fileIndex];
-           size_t fileSize = fileINode.fileSize;
-           size_t currentBlockOffset = fileINode.firstBlock;
+    std::cout << "------STATS------" << std::endl;
+    if (!statistics.enabled) {
+        std::cout << "COUNTERS COMPILED OUT" << std::endl;
+    }
+    std::cout << "TOTAL TIME: " << totalSeconds * 1e3 << " MS" << std::endl;
+    std::cout << "BYTES READ: " << statistics.bytesRead << std::endl;
+    std::cout << "BYTES WRITTEN: " << statistics.bytesWritten << std::endl;
+    std::cout << "SEEKS: " << statistics.seeks << std::endl;
+    std::cout << "SYSCALLS: " << statistics.syscalls << std::endl;
+    std::cout << "BLOCKS SCANNED: " << statistics.blocksScanned << std::endl;
+    std::cout << "SYNCS: " << statistics.syncs << std::endl;
+    for (size_t i = 0; i < PHASE_AMOUNT; i++) {
+        std::cout << describePhase(VfsPhase(i)) << " TIME: " << statistics.phaseNanoseconds[i] / 1e6 << " MS" << std::endl;
+    }
+}
 
-           std::ofstream file(fileName, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+// Runs the trace on a new image, removed afterwards, and prints throughput and latency percentiles of every operation
+void replaySystem(const std::string& systemName, const std::string& tracePath, bool paced) {
+    // Checking if the system already exists, the replay never overwrites an image
+    if (fileExists(systemName)) {
+        std::cout << "SYSTEM " << systemName << " ALREADY EXISTS" << std::endl;
+        return;
+    }
 
-           discFile.open(systemName, std::ios::in | std::ios::out | std::ios::binary);
+    ReplayReport report;
+    VfsError error = replayTrace(tracePath, systemName, paced, report);
+    if (error == VfsError::NotFound) {
+        std::cout << "TRACE " << tracePath << " NOT FOUND" << std::endl;
+        return;
+    } else if (error != VfsError::None) {
+        std::cout << "CANNOT REPLAY TRACE " << tracePath << ": " << describeError(error) << std::endl;
+        return;
+    }
 
-            // Writing the file from memory to the file
-           while (fileSize > 0) {
-                int currentBlockIndex = calculateDataBlockIndexFromOffset(currentBlockOffset);
+    std::cout << "REPLAYED " << report.operations << " OPERATIONS ON A " << report.imageSize << " BYTES SYSTEM IN "
+        << report.seconds << " S" << (paced ? " AT THE ORIGINAL PACING" : "") << std::endl;
+    std::cout << "THROUGHPUT: " << (report.seconds > 0 ? report.operations / report.seconds : 0.0) << " OPS/S, "
+        << (report.seconds > 0 ? report.bytes / report.seconds / (1024 * 1024) : 0.0) << " MB/S" << std::endl;
+    if (report.preparedFiles > 0) {
+        std::cout << "FILES CREATED BEFORE THE REPLAY: " << report.preparedFiles << std::endl;
+    }
+    std::cout << "OPERATION COUNT ERRORS P50_US P95_US P99_US MAX_US RECORDED_P50_US RECORDED_P99_US" << std::endl;
+    for (size_t i = 0; i < TRACE_OPERATION_AMOUNT; i++) {
+        const ReplayOperation& operation = report.perOperation[i];
+        if (operation.latencies.empty()) {
+            continue;
+        }
+        std::cout << describeTraceOperation(TraceOperation(i)) << " " << operation.latencies.size() << " " << operation.errors
+            << " " << percentile(operation.latencies, 0.50) * 1e6
+            << " " << percentile(operation.latencies, 0.95) * 1e6
+            << " " << percentile(operation.latencies, 0.99) * 1e6
+            << " " << percentile(operation.latencies, 1.0) * 1e6
+            << " " << percentile(operation.recordedLatencies, 0.50) * 1e6
+            << " " << percentile(operation.recordedLatencies, 0.99) * 1e6 << std::endl;
+    }
+}
 
-                DataBlock dataBlock = dataBlocks[currentBlockIndex];
+VfsServer* activeServer = nullptr;
 
-                size_t sizeToWrite = std::min(fileSize, sizeof(dataBlock.data));
-                file.write(dataBlock.data, sizeToWrite);
+void stopServer(int) {
+    if (activeServer != nullptr) {
+        activeServer->stop();
+    }
+}
 
-                fileSize -= sizeToWrite;
-                currentBlockOffset = dataBlock.nextBlock;
-           }
+// Keeps the image open and serves clients until SIGINT or SIGTERM
+void serveSystem(Volume& volume, const std::string& systemName, const std::string& socketPath) {
+    VfsServer server(volume, systemName);
+    activeServer = &server;
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+
+    std::cout << "SERVING SYSTEM " << systemName << " ON SOCKET " << socketPath << std::endl;
+    VfsError error = server.run(socketPath);
+    activeServer = nullptr;
+    if (error != VfsError::None) {
+        std::cout << "CANNOT LISTEN ON SOCKET " << socketPath << std::endl;
+    } else {
+        std::cout << "SERVER STOPPED" << std::endl;
+    }
+}
 
-            file.close();
-            discFile.close();
+// Sends file commands to the server owning the system, keeping up to SERVER_PIPELINE_DEPTH requests in flight
+void runOnServer(const std::string& socketPath, const std::string& systemName, const std::string& command, const std::vector<std::string>& names,
+    const std::string& directory) {
+    VfsClient client;
+    VfsError error = client.connect(socketPath, systemName);
+    if (error == VfsError::NotFound) {
+        std::cout << "SERVER ON SOCKET " << socketPath << " DOES NOT SERVE SYSTEM " << systemName << std::endl;
+        return;
+    } else if (error != VfsError::None) {
+        std::cout << "CANNOT CONNECT TO SERVER ON SOCKET " << socketPath << std::endl;
+        return;
+    }
 
-            std::cout << "FILE '" << fileName << "' HAS BEEN SUCCESSFULLY COPIED FROM SYSTEM '" << systemName << std::endl;
-        }   
+    VfsError result;
+    if (command == "LS") {
+        std::vector<FileInfo> files;
+        if (client.sendList() == VfsError::None && client.receive(result, &files) == VfsError::None) {
+            showFiles(files);
+        } else {
+            std::cout << "CONNECTION TO SERVER LOST" << std::endl;
+        }
+        return;
+    }
 
-        void deleteSystem(const std::string& name) {
-            loadSystem(name);
-            
-            if (remove(name.c_str()) != 0) {
-                std::cout << "ERROR DURING DELETING SYSTEM HAS OCCURED" << std::endl;
+    size_t sent = 0;
+    for (size_t received = 0; received < names.size(); received++) {
+        while (sent < names.size() && sent - received < SERVER_PIPELINE_DEPTH) {
+            if (command == "COPYTO") {
+                error = client.sendCopyIn(names[sent], copiedFileName(names[sent], directory));
+            } else if (command == "COPYFROM") {
+                error = client.sendCopyOut(names[sent], copiedFileName(names[sent], directory));
             } else {
-                std::cout << "SYSTEM " << name << " HAS BEEN DELETED" << std::endl;
+                error = client.sendRemove(names[sent]);
             }
+            if (error != VfsError::None) {
+                std::cout << describeError(error) << std::endl;
+                return;
+            }
+            sent++;
         }
 
-        void showFiles(const std::string& systemName) {
-            loadSystem(systemName);
-            for (size_t i = 0; i < iNodes.size(); i++) {
-                if (!isINodeFree(i)) {
-                    std::cout << iNodes[i].fileName << std::endl;
-                }
-            }
+        if (client.receive(result) != VfsError::None) {
+            std::cout << "CONNECTION TO SERVER LOST" << std::endl;
+            return;
         }
-        
-        void showMemoryMap(const std::string& systemName) {
-            loadSystem(systemName);
-            std::cout << "------INODES------" << std::endl;
-            for (size_t i = 0; i < iNodes.size(); i++) {
-                if (i % MAP_NEW_LINE == 0 && i != 0) {
-                    std::cout << std::endl;
-                }
-                std::cout << (isINodeFree(i) ? '0' : '*');
-            }
-            std::cout << std::endl;
-
-            std::cout << "----DATA BLOCKS----" << std::endl;
-            for (size_t i = 0; i < dataBlocks.size(); i++) {
-                if (i % MAP_NEW_LINE == 0 && i != 0) {
-                    std::cout << std::endl;
-                }
-                std::cout << (isDataBlockFree(i) ? '0' : '*');
-            }
-            std::cout << std::endl;
+        if (command == "COPYTO") {
+            reportCopiedToSystem(result, systemName, copiedFileName(names[received], directory));
+        } else if (command == "COPYFROM") {
+            reportCopiedFromSystem(result, systemName, names[received]);
+        } else {
+            reportFileDeleted(result, names[received]);
         }
-};
+    }
+}
 
 void printHelp() {
     std::cout << "USAGE:" << std::endl;
-    std::cout << "<FILE_SYSTEM_NAME> <COMMAND> <COMMAND_ARGS>" << std::endl;
+    std::cout << "<FILE_SYSTEM_NAME> <COMMAND> <COMMAND_ARGS> [--stats[=text|json]] [--trace <TRACE FILE>] [--socket <SOCKET>] [--threads <N>] [--sync=none|batch|data|full]"
+        " [--map[=plain|populate|huge]]" << std::endl;
     std::cout << "AVAILABLE COMMANDS: " << std::endl;
-    std::cout << "CREATE <SIZE> - CREATE A NEW FILE SYSTEM" << std::endl;
+    std::cout << "CREATE <SIZE> [--pack] [--stripe <MEMBER FILE>...] - CREATE A NEW FILE SYSTEM, PACKING TAILS OF FILES INTO SHARED FRAGMENT BLOCKS"
+        " OR STRIPING IT OVER MORE IMAGE FILES" << std::endl;
     std::cout << "DELETE - DELETE FILE SYSTEM" << std::endl;
-    std::cout << "COPYTO <FILE PATH> - COPY FILE TO FILE SYSTEM" << std::endl;
-    std::cout << "COPYFROM <FILE NAME> - COPY FILE FROM FILE SYSTEM" << std::endl;
-    std::cout << "RM <FILE NAME> - DELETE FILE FROM FILE SYSTEM" << std::endl;
-    std::cout << "LS - SHOW FILES IN FILE SYSTEM" << std::endl;
-    std::cout << "MAP - SHOW MEMORY MAP" << std::endl;
+    std::cout << "COPYTO <FILE PATH>... [--into <DIRECTORY>] - COPY FILES TO FILE SYSTEM UNDER THEIR OWN NAMES, INTO A DIRECTORY OF IT" << std::endl;
+    std::cout << "COPYFROM <FILE NAME>... [--into <DIRECTORY>] - COPY FILES FROM FILE SYSTEM UNDER THEIR OWN NAMES, INTO A HOST DIRECTORY" << std::endl;
+    std::cout << "RM <FILE NAME>... - DELETE FILES FROM FILE SYSTEM" << std::endl;
+    std::cout << "IMPORT <DIRECTORY> [--by-name] - COPY ALL FILES OF A DIRECTORY TREE TO FILE SYSTEM IN ONE RUN, ORDERED BY SIZE OR NAME" << std::endl;
+    std::cout << "EXPORT [<TAR FILE>] - WRITE ALL FILES AS A TAR ARCHIVE, TO STANDARD OUTPUT WITHOUT A PATH" << std::endl;
+    std::cout << "UPDATE <FILE PATH>... [--into <DIRECTORY>] - REWRITE ONLY THE CHANGED BLOCKS OF FILES ALREADY IN FILE SYSTEM" << std::endl;
+    std::cout << "LS [<DIRECTORY>] - SHOW ALL FILES IN FILE SYSTEM, OR THE ENTRIES OF A DIRECTORY IN NAME ORDER (/ FOR THE ROOT)" << std::endl;
+    std::cout << "MKDIR <DIRECTORY>... - CREATE DIRECTORIES, WITH THE ONES MISSING ON THEIR PATHS" << std::endl;
+    std::cout << "RMDIR <DIRECTORY>... - DELETE EMPTY DIRECTORIES" << std::endl;
+    std::cout << "MAP [--scale <N>] - SHOW MEMORY MAP, N BLOCKS PER CELL" << std::endl;
+    std::cout << "STATS - SHOW USAGE AND FRAGMENTATION STATISTICS" << std::endl;
+    std::cout << "CLONE <FILE NAME> <NEW FILE NAME> - COPY A FILE SHARING ITS BLOCKS UNTIL EITHER IS WRITTEN" << std::endl;
+    std::cout << "SNAPSHOT <NAME> - SAVE THE FILES OF THE SYSTEM WITHOUT COPYING THEIR DATA" << std::endl;
+    std::cout << "ROLLBACK <NAME> - REPLACE THE FILES OF THE SYSTEM WITH THE ONES OF A SNAPSHOT" << std::endl;
+    std::cout << "RMSNAPSHOT <NAME> - DELETE A SNAPSHOT" << std::endl;
+    std::cout << "SNAPSHOTS - SHOW SNAPSHOTS" << std::endl;
+    std::cout << "REORGANIZE [<FILES>] - MOVE THE FILES OPENED MOST OFTEN, ALL OR THE N HOTTEST, TOGETHER TO THE START OF THE DATA REGION" << std::endl;
+    std::cout << "FSCK [--repair] - CHECK THE BLOCKS OF ALL FILES AGAINST THE BITMAPS AND COUNTERS, REBUILDING THEM FROM THE FILES" << std::endl;
+    std::cout << "SERVE <SOCKET> - KEEP THE FILE SYSTEM OPEN AND SERVE COMMANDS SENT WITH --socket" << std::endl;
+    std::cout << "REPLAY <TRACE FILE> [--paced] - RUN A TRACE ON A TEMPORARY FILE SYSTEM, AS FAST AS POSSIBLE OR AT THE RECORDED PACING" << std::endl;
+    std::cout << "AVAILABLE OPTIONS: " << std::endl;
+    std::cout << "--stats[=text|json] - PRINT I/O COUNTERS AND PHASE TIMES AFTER THE COMMAND" << std::endl;
+    std::cout << "--trace <TRACE FILE> - APPEND THE OPERATIONS OF THE COMMAND TO A TRACE FILE" << std::endl;
+    std::cout << "--socket <SOCKET> - SEND COPYTO, COPYFROM, RM AND LS TO THE SERVER OF THE FILE SYSTEM" << std::endl;
+    std::cout << "--threads <N> - COPY FILES TO AND FROM THE SYSTEM WITH N THREADS, AT LEAST ONE PER MEMBER FILE (DEFAULT 1),"
+        " AND CHECK IT WITH N THREADS WHEN MORE THAN THE CORES" << std::endl;
+    std::cout << "--sync=none|batch|data|full - MAKE CHANGES DURABLE NEVER, EVERY " << SYNC_BATCH_INTERVAL_MS << " MS, BEFORE EVERY COMMAND RETURNS,"
+        " OR THE SAME WITH FILE DATA SYNCED BEFORE THE METADATA POINTING AT IT (DEFAULT none)" << std::endl;
+    std::cout << "--map[=plain|populate|huge] - OPEN THE SYSTEM READ-ONLY THROUGH A MAPPING, FAULTING IN THE PARTS IN USE UP FRONT"
+        " AND WITH HUGE PAGES TOO (DEFAULT plain)" << std::endl;
 }
 
 int main(int argc, char* argv[]) {
 
-    if (argc < 3) {
+    // Taking the global options out, what is left are the system name, the command and its arguments
+    StatsMode statsMode = StatsMode::None;
+    std::string tracePath;
+    std::string socketPath;
+    size_t copyThreads = 1;
+    SyncMode syncMode = SyncMode::None;
+    bool mapped = false;
+    MapOptions mapOptions;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--stats" || arg == "--stats=text") {
+            statsMode = StatsMode::Text;
+        } else if (arg == "--stats=json") {
+            statsMode = StatsMode::Json;
+        } else if (arg == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (arg == "--socket" && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else if (arg == "--threads" && i + 1 < argc) {
+            if (!parseCount(argv[++i], copyThreads)) {
+                printHelp();
+                return 0;
+            }
+            copyThreads = std::max<size_t>(1, copyThreads);
+        } else if (arg == "--sync=none" || arg == "--sync=batch" || arg == "--sync=data" || arg == "--sync=full") {
+            syncMode = arg == "--sync=batch" ? SyncMode::Batch : arg == "--sync=data" ? SyncMode::Data
+                : arg == "--sync=full" ? SyncMode::Full : SyncMode::None;
+        } else if (arg == "--map" || arg == "--map=plain" || arg == "--map=populate" || arg == "--map=huge") {
+            mapped = true;
+            mapOptions.populate = arg == "--map=populate" || arg == "--map=huge";
+            mapOptions.hugePages = arg == "--map=huge";
+        } else {
+            args.push_back(arg);
+        }
+    }
+
+    if (args.size() < 2) {
         printHelp();
         return 0;
     }
 
-    std::string command = argv[2];
-
-    VirtualFileSystem fileSystem;
-
-    if (command == "CREATE") {
-        
-        if (argc != 4) {
+    std::string systemName = args[0];
+    std::string command = args[1];
+    auto commandStart = std::chrono::steady_clock::now();
+    auto elapsed = [&]() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - commandStart).count();
+    };
+
+    if (command == "CREATE" || command == "DELETE" || command == "REPLAY") {
+
+        // Member files of a striped system follow --stripe
+        bool tailPacking = args.size() >= 4 && args[3] == "--pack";
+        size_t stripeAt = tailPacking ? 4 : 3;
+        bool striped = args.size() > stripeAt + 1 && args[stripeAt] == "--stripe";
+        bool validSystemArguments = command == "CREATE" ? args.size() == stripeAt || striped
+            : command == "DELETE" ? args.size() == 2
+            : args.size() == 3 || (args.size() == 4 && args[3] == "--paced");
+        if (!validSystemArguments) {
             printHelp();
             return 0;
         }
-        size_t size = std::stoul(argv[3]);
-        fileSystem.createSystem(size, argv[1]);
+        if (command == "CREATE") {
+            std::vector<std::string> members(args.begin() + std::min(args.size(), stripeAt + 1), args.end());
+            createSystem(std::stoul(args[2]), systemName, tailPacking, members);
+        } else if (command == "DELETE") {
+            deleteSystem(systemName);
+        } else {
+            replaySystem(systemName, args[2], args.size() == 4);
+        }
+        if (statsMode != StatsMode::None) {
+            printIoStatistics(nullptr, statsMode, command, elapsed());
+        }
+        return 0;
 
-    } else if (command == "DELETE") {
+    }
 
-        fileSystem.deleteSystem(argv[1]);
+    // Copies name the directory they go into on the other side after --into
+    std::string intoDirectory;
+    auto into = std::find(args.begin(), args.end(), "--into");
+    bool copying = command == "COPYTO" || command == "COPYFROM" || command == "UPDATE";
+    if (copying && into != args.end() && into + 1 != args.end()) {
+        intoDirectory = *(into + 1);
+        args.erase(into, into + 2);
+    }
 
-    } else if (command == "COPYTO") {
+    bool validArguments = (command == "COPYTO" || command == "COPYFROM" || command == "RM" || command == "UPDATE"
+            || command == "MKDIR" || command == "RMDIR") ? args.size() >= 3
+        : (command == "STATS" || command == "SNAPSHOTS") ? args.size() == 2
+        : command == "LS" ? (args.size() == 2 || args.size() == 3)
+        : (command == "SERVE" || command == "SNAPSHOT" || command == "ROLLBACK" || command == "RMSNAPSHOT") ? args.size() == 3
+        : command == "CLONE" ? args.size() == 4
+        : (command == "EXPORT" || command == "REORGANIZE") ? (args.size() == 2 || args.size() == 3)
+        : command == "FSCK" ? (args.size() == 2 || (args.size() == 3 && args[2] == "--repair"))
+        : command == "IMPORT" ? (args.size() == 3 || (args.size() == 4 && args[3] == "--by-name"))
+        : command == "MAP" ? (args.size() == 2 || (args.size() == 4 && args[2] == "--scale"))
+        : false;
+    if (!validArguments) {
+        printHelp();
+        return 0;
+    }
+    size_t hottestFiles = 0;
+    if (command == "REORGANIZE" && args.size() == 3 && !parseCount(args[2], hottestFiles)) {
+        printHelp();
+        return 0;
+    }
+    size_t mapScale = 1;
+    if (command == "MAP" && args.size() == 4 && !parseCount(args[3], mapScale)) {
+        printHelp();
+        return 0;
+    }
 
-        if (argc != 4) {
-            printHelp();
-            return 0;
+    // Checking if the files exist outside the system before touching the system
+    std::vector<std::string> names;
+    bool hostFiles = command == "COPYTO" || command == "UPDATE";
+    for (size_t i = 2; i < args.size() && (hostFiles || command == "COPYFROM" || command == "RM" || command == "MKDIR" || command == "RMDIR"); i++) {
+        if (hostFiles && !fileExists(args[i])) {
+            std::cout << (command == "COPYTO" ? "CANNOT COPY FILE " : "CANNOT UPDATE FILE ") << args[i]
+                << (command == "COPYTO" ? " TO SYSTEM " : " IN SYSTEM ") << systemName << std::endl;
+            std::cout << "FILE " << args[i] << " NOT FOUND" << std::endl;
+            continue;
+        }
+        names.push_back(args[i]);
+    }
+    if (hostFiles && names.empty()) {
+        return 0;
+    }
+    // The host directory is made before any copy starts, so a bad one stops the command at once
+    std::error_code directoryError;
+    if (command == "COPYFROM" && !intoDirectory.empty()) {
+        std::filesystem::create_directories(intoDirectory, directoryError);
+        if (directoryError) {
+            std::cout << "CANNOT CREATE DIRECTORY " << intoDirectory << ": " << directoryError.message() << std::endl;
+            return 1;
+        }
+    }
+
+    bool served = command == "COPYTO" || command == "COPYFROM" || command == "RM" || (command == "LS" && args.size() == 2);
+    if (!socketPath.empty() && served) {
+        runOnServer(socketPath, systemName, command, names, intoDirectory);
+        if (statsMode != StatsMode::None) {
+            printIoStatistics(nullptr, statsMode, command, elapsed());
+        }
+        return 0;
+    }
+
+    Volume volume;
+    volume.setCopyThreads(copyThreads);
+    volume.setSyncMode(syncMode);
+    if (!tracePath.empty() && volume.startTrace(tracePath) != VfsError::None) {
+        std::cout << "CANNOT OPEN TRACE FILE " << tracePath << std::endl;
+        return 1;
+    }
+    if (!openSystem(volume, systemName, mapped ? &mapOptions : nullptr)) {
+        return 1;
+    }
+
+    if (command == "COPYTO") {
+
+        for (const std::string& name : names) {
+            std::string fileName = copiedFileName(name, intoDirectory);
+            reportCopiedToSystem(volume.copyFileIn(name, fileName), systemName, fileName);
         }
-        fileSystem.copyFileToSystem(argv[1], argv[3]);
 
     } else if (command == "COPYFROM") {
 
-        if (argc != 4) {
-            printHelp();
-            return 0;
+        for (const std::string& fileName : names) {
+            reportCopiedFromSystem(volume.copyFileOut(fileName, copiedFileName(fileName, intoDirectory)), systemName, fileName);
         }
-        fileSystem.copyFileFromSystem(argv[1], argv[3]);
 
     } else if (command == "RM") {
 
-        if (argc != 4) {
-            printHelp();
-            return 0;
+        for (const std::string& fileName : names) {
+            reportFileDeleted(volume.removeFile(fileName), fileName);
+        }
+
+    } else if (command == "IMPORT") {
+
+        importDirectory(volume, systemName, args[2], args.size() == 4 ? ImportOrder::Name : ImportOrder::Size);
+
+    } else if (command == "EXPORT") {
+
+        exportSystem(volume, systemName, args.size() == 3 ? args[2] : "");
+
+    } else if (command == "UPDATE") {
+
+        for (const std::string& name : names) {
+            std::string fileName = copiedFileName(name, intoDirectory);
+            size_t bytesWritten;
+            VfsError error = volume.updateFile(name, fileName, bytesWritten);
+            reportUpdated(error, systemName, fileName, bytesWritten);
+        }
+
+    } else if (command == "LS" && args.size() == 3) {
+
+        std::vector<FileInfo> entries;
+        VfsError error = volume.listDirectory(args[2], entries);
+        if (error == VfsError::NotFound) {
+            std::cout << "DIRECTORY " << args[2] << " NOT FOUND" << std::endl;
+        } else if (error != VfsError::None) {
+            std::cout << describeError(error) << std::endl;
+        } else {
+            showFiles(entries);
         }
-        fileSystem.deleteFile(argv[1], argv[3]);
 
     } else if (command == "LS") {
 
-        if (argc != 3) {
-            printHelp();
-            return 0;
+        std::vector<FileInfo> files;
+        volume.listFiles(files);
+        showFiles(files);
+
+    } else if (command == "MKDIR" || command == "RMDIR") {
+
+        for (const std::string& path : names) {
+            reportDirectory(command == "MKDIR" ? volume.createDirectory(path) : volume.removeDirectory(path), command, path);
         }
-        fileSystem.showFiles(argv[1]);
 
     } else if (command == "MAP") {
 
-        if (argc != 3) {
-            printHelp();
-            return 0;
-        }
-        fileSystem.showMemoryMap(argv[1]);
+        showMemoryMap(volume, std::max<size_t>(1, mapScale));
+
+    } else if (command == "STATS") {
+
+        showStatistics(volume);
+
+    } else if (command == "CLONE") {
+
+        reportCloned(volume.cloneFile(args[2], args[3]), args[2], args[3]);
+
+    } else if (command == "SNAPSHOT") {
+
+        reportSnapshot(volume.createSnapshot(args[2]), command, args[2]);
+
+    } else if (command == "ROLLBACK") {
+
+        reportSnapshot(volume.rollbackSnapshot(args[2]), command, args[2]);
+
+    } else if (command == "RMSNAPSHOT") {
+
+        reportSnapshot(volume.removeSnapshot(args[2]), command, args[2]);
+
+    } else if (command == "SNAPSHOTS") {
+
+        std::vector<SnapshotInfo> snapshots;
+        volume.listSnapshots(snapshots);
+        showSnapshots(snapshots);
+
+    } else if (command == "REORGANIZE") {
+
+        ReorganizeReport report;
+        VfsError error = volume.reorganize(hottestFiles, report);
+        reportReorganized(error, report, systemName);
+
+    } else if (command == "FSCK") {
+
+        CheckReport report;
+        bool repair = args.size() == 3;
+        reportChecked(volume.check(repair, report), report, systemName, repair);
+
+    } else if (command == "SERVE") {
+
+        serveSystem(volume, systemName, args[2]);
 
-    } else {
-        printHelp();
+    }
+
+    if (statsMode != StatsMode::None) {
+        printIoStatistics(&volume, statsMode, command, elapsed());
     }
     
     return 0;
 }
-
-
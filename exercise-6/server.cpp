@@ -0,0 +1,364 @@
+#include "server.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static bool sendAll(int socketFile, const void* buffer, size_t size) {
+    const char* source = static_cast<const char*>(buffer);
+    while (size > 0) {
+        ssize_t result = send(socketFile, source, size, MSG_NOSIGNAL);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return false;
+        }
+        source += result;
+        size -= result;
+    }
+    return true;
+}
+
+static bool receiveAll(int socketFile, void* buffer, size_t size) {
+    char* destination = static_cast<char*>(buffer);
+    while (size > 0) {
+        ssize_t result = recv(socketFile, destination, size, 0);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return false;
+        }
+        destination += result;
+        size -= result;
+    }
+    return true;
+}
+
+static bool fillAddress(const std::string& socketPath, sockaddr_un& address) {
+    address = {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        return false;
+    }
+    memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+    return true;
+}
+
+// Reads one request and the host file passed along with it, -1 when there is none
+static bool receiveRequest(int socketFile, ServerRequest& request, std::string& name, int& hostFile) {
+    hostFile = -1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    iovec vector = {&request, sizeof(request)};
+    msghdr message = {};
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t result;
+    do {
+        result = recvmsg(socketFile, &message, MSG_CMSG_CLOEXEC);
+    } while (result < 0 && errno == EINTR);
+    if (result <= 0) {
+        return false;
+    }
+
+    for (cmsghdr* header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            memcpy(&hostFile, CMSG_DATA(header), sizeof(hostFile));
+        }
+    }
+
+    bool received = receiveAll(socketFile, reinterpret_cast<char*>(&request) + result, sizeof(request) - result);
+    if (received && request.nameLength < FILE_NAME_SIZE) {
+        name.resize(request.nameLength);
+        received = receiveAll(socketFile, name.data(), name.size());
+    } else {
+        received = false;
+    }
+    if (!received && hostFile >= 0) {
+        ::close(hostFile);
+        hostFile = -1;
+    }
+    return received;
+}
+
+void VfsServer::serveConnection(Connection& connection) {
+    ServerRequest request;
+    std::string name;
+    std::vector<char> payload;
+    std::vector<FileInfo> files;
+    bool attached = false;
+
+    int hostFile;
+    while (!stopping && receiveRequest(connection.socketFile, request, name, hostFile)) {
+        VfsError error = VfsError::None;
+        payload.clear();
+
+        // Every other request waits until the client named the image it expects
+        if (request.command == SERVER_ATTACH) {
+            std::error_code errorCode;
+            attached = std::filesystem::equivalent(name, imagePath, errorCode);
+            error = attached ? VfsError::None : VfsError::NotFound;
+        } else if (!attached) {
+            error = VfsError::InvalidHandle;
+        } else if (request.command == SERVER_COPY_IN || request.command == SERVER_COPY_OUT) {
+            if (hostFile < 0) {
+                error = VfsError::HostIoError;
+            } else if (request.command == SERVER_COPY_IN) {
+                error = volume.copyFileIn(hostFile, name);
+            } else {
+                error = volume.copyFileOut(name, hostFile);
+            }
+        } else if (request.command == SERVER_REMOVE) {
+            error = volume.removeFile(name);
+        } else if (request.command == SERVER_LIST) {
+            volume.listFiles(files);
+            for (const FileInfo& file : files) {
+                uint64_t size = file.size;
+                uint32_t nameLength = file.name.size();
+                payload.insert(payload.end(), reinterpret_cast<char*>(&size), reinterpret_cast<char*>(&size) + sizeof(size));
+                payload.insert(payload.end(), reinterpret_cast<char*>(&nameLength), reinterpret_cast<char*>(&nameLength) + sizeof(nameLength));
+                payload.insert(payload.end(), file.name.begin(), file.name.end());
+            }
+        } else {
+            error = VfsError::InvalidHandle;
+        }
+
+        if (hostFile >= 0) {
+            ::close(hostFile);
+        }
+
+        ServerResponse response = {int32_t(error), uint32_t(payload.size())};
+        if (!sendAll(connection.socketFile, &response, sizeof(response)) || !sendAll(connection.socketFile, payload.data(), payload.size())) {
+            break;
+        }
+    }
+
+    connection.finished = true;
+}
+
+// Joins the workers of closed connections, or of all of them once the server stops
+void VfsServer::reapConnections(bool all) {
+    std::lock_guard<std::mutex> guard(connectionsLock);
+    for (auto it = connections.begin(); it != connections.end();) {
+        if (all) {
+            shutdown(it->socketFile, SHUT_RDWR);
+        } else if (!it->finished) {
+            it++;
+            continue;
+        }
+        it->worker.join();
+        ::close(it->socketFile);
+        it = connections.erase(it);
+    }
+}
+
+VfsError VfsServer::run(const std::string& socketPath) {
+    sockaddr_un address;
+    if (!fillAddress(socketPath, address)) {
+        return VfsError::HostIoError;
+    }
+
+    int listenFile = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFile < 0) {
+        return VfsError::HostIoError;
+    }
+    unlink(socketPath.c_str());
+    if (bind(listenFile, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listenFile, SERVER_BACKLOG) != 0) {
+        ::close(listenFile);
+        return VfsError::HostIoError;
+    }
+
+    pollfd waiting = {listenFile, POLLIN, 0};
+    while (!stopping) {
+        reapConnections(false);
+        if (poll(&waiting, 1, SERVER_POLL_MILLISECONDS) <= 0) {
+            continue;
+        }
+
+        int socketFile = accept4(listenFile, nullptr, nullptr, SOCK_CLOEXEC);
+        if (socketFile < 0) {
+            continue;
+        }
+        std::lock_guard<std::mutex> guard(connectionsLock);
+        Connection& connection = connections.emplace_back();
+        connection.socketFile = socketFile;
+        connection.worker = std::thread(&VfsServer::serveConnection, this, std::ref(connection));
+    }
+
+    reapConnections(true);
+    ::close(listenFile);
+    unlink(socketPath.c_str());
+    return VfsError::None;
+}
+
+void VfsServer::stop() {
+    stopping = true;
+}
+
+VfsClient::~VfsClient() {
+    close();
+}
+
+VfsError VfsClient::sendRequest(ServerCommand command, std::string_view name, int hostFile) {
+    ServerRequest request = {command, uint32_t(name.size())};
+    iovec vectors[2] = {{&request, sizeof(request)}, {const_cast<char*>(name.data()), name.size()}};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr message = {};
+    message.msg_iov = vectors;
+    message.msg_iovlen = 2;
+    if (hostFile >= 0) {
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(header), &hostFile, sizeof(hostFile));
+    }
+
+    ssize_t result;
+    do {
+        result = sendmsg(socketFile, &message, MSG_NOSIGNAL);
+    } while (result < 0 && errno == EINTR);
+    if (result < 0) {
+        return VfsError::IoError;
+    }
+
+    // The host file went with the first byte, only the rest of the bytes may be left
+    size_t sent = result;
+    if (sent < sizeof(request)) {
+        if (!sendAll(socketFile, reinterpret_cast<char*>(&request) + sent, sizeof(request) - sent)) {
+            return VfsError::IoError;
+        }
+        sent = sizeof(request);
+    }
+    if (!sendAll(socketFile, name.data() + (sent - sizeof(request)), name.size() - (sent - sizeof(request)))) {
+        return VfsError::IoError;
+    }
+    pendingRequests.push_back({command, ""});
+    return VfsError::None;
+}
+
+VfsError VfsClient::connect(const std::string& socketPath, const std::string& imagePath) {
+    close();
+    sockaddr_un address;
+    if (!fillAddress(socketPath, address)) {
+        return VfsError::IoError;
+    }
+
+    socketFile = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socketFile < 0) {
+        return VfsError::IoError;
+    }
+    if (::connect(socketFile, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        close();
+        return VfsError::IoError;
+    }
+
+    // The server may run in another directory, so the image is named by its absolute path
+    VfsError result;
+    VfsError error = sendRequest(SERVER_ATTACH, std::filesystem::absolute(imagePath).string(), -1);
+    if (error == VfsError::None) {
+        error = receive(result);
+    }
+    if (error == VfsError::None) {
+        error = result;
+    }
+    if (error != VfsError::None) {
+        close();
+    }
+    return error;
+}
+
+void VfsClient::close() {
+    if (socketFile >= 0) {
+        ::close(socketFile);
+        socketFile = -1;
+    }
+    pendingRequests.clear();
+}
+
+VfsError VfsClient::sendCopyIn(const std::string& hostPath, std::string_view name) {
+    int hostFile = ::open(hostPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (hostFile < 0) {
+        return VfsError::HostIoError;
+    }
+    VfsError error = sendRequest(SERVER_COPY_IN, name, hostFile);
+    ::close(hostFile);
+    return error;
+}
+
+VfsError VfsClient::sendCopyOut(std::string_view name, const std::string& hostPath) {
+    // Not truncating here, the server cuts the file to size once it found the file to copy
+    bool existed = access(hostPath.c_str(), F_OK) == 0;
+    int hostFile = ::open(hostPath.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (hostFile < 0) {
+        return VfsError::HostIoError;
+    }
+    VfsError error = sendRequest(SERVER_COPY_OUT, name, hostFile);
+    ::close(hostFile);
+    if (error == VfsError::None && !existed) {
+        pendingRequests.back().createdHostFile = hostPath;
+    } else if (error != VfsError::None && !existed) {
+        unlink(hostPath.c_str());
+    }
+    return error;
+}
+
+VfsError VfsClient::sendRemove(std::string_view name) {
+    return sendRequest(SERVER_REMOVE, name, -1);
+}
+
+VfsError VfsClient::sendList() {
+    return sendRequest(SERVER_LIST, {}, -1);
+}
+
+VfsError VfsClient::receive(VfsError& result, std::vector<FileInfo>* files) {
+    if (pendingRequests.empty()) {
+        return VfsError::InvalidHandle;
+    }
+    PendingRequest pending = std::move(pendingRequests.front());
+    pendingRequests.pop_front();
+
+    ServerResponse response;
+    if (!receiveAll(socketFile, &response, sizeof(response))) {
+        return VfsError::IoError;
+    }
+    std::vector<char> payload(response.payloadLength);
+    if (!receiveAll(socketFile, payload.data(), payload.size())) {
+        return VfsError::IoError;
+    }
+    result = VfsError(response.error);
+
+    if (result != VfsError::None && !pending.createdHostFile.empty()) {
+        unlink(pending.createdHostFile.c_str());
+    }
+
+    if (files != nullptr) {
+        files->clear();
+        size_t position = 0;
+        while (position + sizeof(uint64_t) + sizeof(uint32_t) <= payload.size()) {
+            uint64_t size;
+            uint32_t nameLength;
+            memcpy(&size, payload.data() + position, sizeof(size));
+            memcpy(&nameLength, payload.data() + position + sizeof(size), sizeof(nameLength));
+            position += sizeof(size) + sizeof(nameLength);
+            if (position + nameLength > payload.size()) {
+                return VfsError::Corrupted;
+            }
+            files->push_back({std::string(payload.data() + position, nameLength), size, 0});
+            position += nameLength;
+        }
+    }
+    return VfsError::None;
+}
@@ -0,0 +1,103 @@
+#ifndef __server_h
+#define __server_h
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "vfs.h"
+
+#define SERVER_BACKLOG 64
+#define SERVER_POLL_MILLISECONDS 200
+// Requests a client sends before it waits for the oldest response
+#define SERVER_PIPELINE_DEPTH 64
+
+enum ServerCommand : uint32_t {
+    SERVER_ATTACH,
+    SERVER_COPY_IN,
+    SERVER_COPY_OUT,
+    SERVER_REMOVE,
+    SERVER_LIST
+};
+
+// Followed by `nameLength` bytes of the name. COPY_IN and COPY_OUT pass the host file
+// opened by the client along with it, so file data never goes through the socket.
+struct ServerRequest {
+    uint32_t command;
+    uint32_t nameLength;
+};
+
+// Followed by `payloadLength` bytes, LIST sends a size, a name length and a name for every file
+struct ServerResponse {
+    int32_t error;
+    uint32_t payloadLength;
+};
+
+// Serves one open volume to clients of a Unix socket, a thread for every connection.
+// Requests of a connection are answered in order, so clients may pipeline them.
+class VfsServer {
+    private:
+        struct Connection {
+            int socketFile;
+            std::thread worker;
+            std::atomic<bool> finished = false;
+        };
+
+        Volume& volume;
+        std::string imagePath;
+        std::atomic<bool> stopping = false;
+        std::mutex connectionsLock;
+        std::list<Connection> connections;
+
+        void serveConnection(Connection& connection);
+        void reapConnections(bool all);
+
+    public:
+        VfsServer(Volume& p_volume, const std::string& p_imagePath) : volume(p_volume), imagePath(p_imagePath) {}
+
+        // Blocks until stop() is called, the socket file is replaced and removed at the end
+        VfsError run(const std::string& socketPath);
+        // Only sets a flag, so it may be called from a signal handler
+        void stop();
+};
+
+// Client side of the server protocol. send*() calls queue a request and receive() takes
+// the response of the oldest request still waiting.
+class VfsClient {
+    private:
+        struct PendingRequest {
+            ServerCommand command;
+            // Host file created by a COPY_OUT, empty when it existed before
+            std::string createdHostFile;
+        };
+
+        int socketFile = -1;
+        std::list<PendingRequest> pendingRequests;
+
+        VfsError sendRequest(ServerCommand command, std::string_view name, int hostFile);
+
+    public:
+        VfsClient() = default;
+        ~VfsClient();
+        VfsClient(const VfsClient&) = delete;
+        VfsClient& operator=(const VfsClient&) = delete;
+
+        // Fails with IoError when nobody listens on `socketPath` and with NotFound when the server there
+        // does not serve the image at `imagePath`
+        VfsError connect(const std::string& socketPath, const std::string& imagePath);
+        void close();
+
+        VfsError sendCopyIn(const std::string& hostPath, std::string_view name);
+        // A host file created for a failed copy is removed again by receive()
+        VfsError sendCopyOut(std::string_view name, const std::string& hostPath);
+        VfsError sendRemove(std::string_view name);
+        VfsError sendList();
+        VfsError receive(VfsError& result, std::vector<FileInfo>* files = nullptr);
+};
+
+#endif
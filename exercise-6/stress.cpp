@@ -0,0 +1,350 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <thread>
+#include <atomic>
+
+#include "vfs.h"
+#include "trace.h"
+
+#define DEFAULT_LARGE_SIZE "5T"
+#define DEFAULT_SMALL_SIZE "64M"
+#define PROBE_FILE_SIZE (16 * 1024)
+#define PROBE_REPEATS 200
+// Blocks left free by the fill, the probes and a file past the fill go there
+#define FILL_RESERVE_BLOCKS (4 * BLOCKS_PER_GROUP)
+#define DEFAULT_THREADS 4
+// Files every thread of the concurrent run writes, every other one is removed right away
+#define CONCURRENT_FILES 48
+
+class Stopwatch {
+    private:
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    public:
+        double elapsed() const {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+};
+
+size_t parseSize(const std::string& text) {
+    size_t multiplier = 1;
+    char suffix = text.empty() ? ' ' : text.back();
+    if (suffix == 'K' || suffix == 'k') {
+        multiplier = size_t(1) << 10;
+    } else if (suffix == 'M' || suffix == 'm') {
+        multiplier = size_t(1) << 20;
+    } else if (suffix == 'G' || suffix == 'g') {
+        multiplier = size_t(1) << 30;
+    } else if (suffix == 'T' || suffix == 't') {
+        multiplier = size_t(1) << 40;
+    }
+    return std::stoul(multiplier == 1 ? text : text.substr(0, text.size() - 1)) * multiplier;
+}
+
+bool fail(const std::string& step, VfsError error) {
+    std::cerr << step << " FAILED: " << describeError(error) << std::endl;
+    return false;
+}
+
+// Writes a file with a pattern depending on `seed`, reads it back and compares
+bool writeAndVerify(Volume& volume, const std::string& name, size_t size, size_t seed) {
+    std::vector<std::byte> data(size);
+    for (size_t i = 0; i < size; i++) {
+        data[i] = std::byte((i * 131 + seed) % 251);
+    }
+    FileHandle handle;
+    size_t done;
+    VfsError error = volume.createFile(name, size, handle);
+    if (error == VfsError::None) {
+        error = volume.write(handle, 0, data, done);
+    }
+    volume.closeFile(handle);
+    if (error != VfsError::None) {
+        return fail("WRITING " + name, error);
+    }
+
+    std::vector<std::byte> readBack(size);
+    error = volume.openFile(name, handle);
+    if (error == VfsError::None) {
+        error = volume.read(handle, 0, readBack, done);
+    }
+    volume.closeFile(handle);
+    if (error != VfsError::None) {
+        return fail("READING " + name, error);
+    }
+    if (memcmp(data.data(), readBack.data(), size) != 0) {
+        std::cerr << "DATA OF " << name << " DIFFERS" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Mean microseconds of creating, writing, reading back and removing a small file
+double probe(Volume& volume) {
+    Stopwatch stopwatch;
+    for (size_t i = 0; i < PROBE_REPEATS; i++) {
+        std::string name = "probe" + std::to_string(i);
+        if (!writeAndVerify(volume, name, PROBE_FILE_SIZE, i)) {
+            return -1;
+        }
+        VfsError error = volume.removeFile(name);
+        if (error != VfsError::None) {
+            fail("REMOVING " + name, error);
+            return -1;
+        }
+    }
+    return stopwatch.elapsed() * 1e6 / PROBE_REPEATS;
+}
+
+void printTime(const std::string& step, double seconds) {
+    std::cout << "  " << step << ": " << seconds << " S" << std::endl;
+}
+
+// Creates, opens and probes a sparse image. A large one is then filled up to a few groups,
+// probed again, reopened and emptied, checking the free space stays consistent.
+bool runImage(const std::filesystem::path& path, size_t size, bool fill, double& probeMicroseconds) {
+    std::cout << "IMAGE OF " << size << " BYTES" << std::endl;
+    Volume::destroy(path.string());
+    Stopwatch createStopwatch;
+    VfsError error = Volume::create(path.string(), size);
+    if (error != VfsError::None) {
+        return fail("CREATING", error);
+    }
+    printTime("CREATE", createStopwatch.elapsed());
+
+    Volume volume;
+    Stopwatch openStopwatch;
+    error = volume.open(path.string());
+    if (error != VfsError::None) {
+        return fail("OPENING", error);
+    }
+    printTime("OPEN", openStopwatch.elapsed());
+    std::cout << "  DATA BLOCKS: " << volume.getBlockAmount() << std::endl;
+
+    probeMicroseconds = probe(volume);
+    if (probeMicroseconds < 0) {
+        return false;
+    }
+    std::cout << "  SMALL FILE ROUND TRIP: " << probeMicroseconds << " US" << std::endl;
+    if (!fill) {
+        return true;
+    }
+
+    // One file takes everything but the reserve, the chain holds a record for every run instead of every block
+    size_t freeBlocks = volume.getAmountOfFreeDataBlocks();
+    VolumeStatistics before;
+    volume.getStatistics(before);
+    size_t fillBlocks = freeBlocks > FILL_RESERVE_BLOCKS ? freeBlocks - FILL_RESERVE_BLOCKS : 0;
+    FileHandle handle;
+    Stopwatch fillStopwatch;
+    error = volume.createFile("fill", fillBlocks * BLOCK_SIZE, handle);
+    volume.closeFile(handle);
+    if (error != VfsError::None) {
+        return fail("FILLING", error);
+    }
+    printTime("FILL " + std::to_string(fillBlocks) + " BLOCKS", fillStopwatch.elapsed());
+
+    std::vector<FileInfo> files;
+    volume.listFiles(files, true);
+    std::cout << "  FILL RUNS: " << (files.empty() ? 0 : files.front().fragments) << std::endl;
+
+    double fullProbe = probe(volume);
+    if (fullProbe < 0) {
+        return false;
+    }
+    std::cout << "  SMALL FILE ROUND TRIP WHEN FULL: " << fullProbe << " US" << std::endl;
+
+    // Only the reserve is left, so this file goes into the blocks the fill did not take
+    if (!writeAndVerify(volume, "last", PROBE_FILE_SIZE, 7)) {
+        return false;
+    }
+    std::cout << "  FILE IN THE RESERVE VERIFIED" << std::endl;
+
+    volume.close();
+    Stopwatch reopenStopwatch;
+    error = volume.open(path.string());
+    if (error != VfsError::None) {
+        return fail("REOPENING", error);
+    }
+    printTime("REOPEN WHEN FULL", reopenStopwatch.elapsed());
+
+    Stopwatch removeStopwatch;
+    error = volume.removeFile("fill");
+    if (error == VfsError::None) {
+        error = volume.removeFile("last");
+    }
+    if (error != VfsError::None) {
+        return fail("REMOVING", error);
+    }
+    printTime("REMOVE", removeStopwatch.elapsed());
+
+    VolumeStatistics statistics;
+    volume.getStatistics(statistics);
+    // Chunks of INodes stay taken, so the free blocks are compared with the ones before the fill.
+    // The root directory stays too, its index keeps the nodes it grew to.
+    size_t expectedFree = freeBlocks + before.directoryBlockAmount - statistics.directoryBlockAmount;
+    size_t freeINodes = statistics.freeINodeAmount + statistics.directoryAmount;
+    if (statistics.freeBlockAmount != expectedFree || freeINodes != statistics.iNodeAmount) {
+        std::cerr << "FREE SPACE LOST: " << expectedFree - statistics.freeBlockAmount << " BLOCKS, "
+            << statistics.iNodeAmount - freeINodes << " INODES" << std::endl;
+        return false;
+    }
+    std::cout << "  ALL BLOCKS AND INODES FREE AGAIN" << std::endl;
+    return true;
+}
+
+// Size of the i-th file of a thread: small files, files of a few groups' worth of runs and tails of odd lengths
+size_t concurrentFileSize(size_t i) {
+    switch (i % 4) {
+        case 0:
+            return PROBE_FILE_SIZE;
+        case 1:
+            return 1024 * 1024 + i * 37;
+        case 2:
+            return i * 131 + 1;
+        default:
+            return 3 * BLOCKS_PER_GROUP * BLOCK_SIZE / 8 + i;
+    }
+}
+
+// Threads create, write, read back and remove files at once, then the files left are checked and removed
+// and the free space must come back but for the INode chunks taken
+bool runConcurrent(const std::filesystem::path& path, size_t size, size_t threads) {
+    std::cout << "CONCURRENT RUN OF " << threads << " THREADS ON AN IMAGE OF " << size << " BYTES" << std::endl;
+    Volume::destroy(path.string());
+    Volume volume;
+    if (Volume::create(path.string(), size) != VfsError::None || volume.open(path.string()) != VfsError::None) {
+        return fail("CREATING", VfsError::IoError);
+    }
+
+    std::atomic<bool> passed = true;
+    Stopwatch stopwatch;
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            for (size_t i = 0; i < CONCURRENT_FILES && passed; i++) {
+                std::string name = "thread" + std::to_string(t) + "_" + std::to_string(i);
+                if (!writeAndVerify(volume, name, concurrentFileSize(i), t * CONCURRENT_FILES + i)) {
+                    passed = false;
+                } else if (i % 2 == 1) {
+                    VfsError error = volume.removeFile(name);
+                    if (error != VfsError::None) {
+                        passed = fail("REMOVING " + name, error);
+                    }
+                }
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    if (!passed) {
+        return false;
+    }
+    printTime("WRITING " + std::to_string(threads * CONCURRENT_FILES) + " FILES", stopwatch.elapsed());
+
+    std::vector<FileInfo> files;
+    volume.listFiles(files);
+    if (files.size() != threads * ((CONCURRENT_FILES + 1) / 2)) {
+        std::cerr << "FOUND " << files.size() << " FILES INSTEAD OF " << threads * ((CONCURRENT_FILES + 1) / 2) << std::endl;
+        return false;
+    }
+    // The image read again must agree with the memory of the volume
+    volume.close();
+    if (volume.open(path.string()) != VfsError::None) {
+        return fail("REOPENING", VfsError::IoError);
+    }
+    for (size_t t = 0; t < threads; t++) {
+        for (size_t i = 0; i < CONCURRENT_FILES; i += 2) {
+            std::string name = "thread" + std::to_string(t) + "_" + std::to_string(i);
+            FileHandle handle;
+            size_t done;
+            std::vector<std::byte> data(concurrentFileSize(i));
+            VfsError error = volume.openFile(name, handle);
+            if (error == VfsError::None) {
+                error = volume.read(handle, 0, data, done);
+            }
+            volume.closeFile(handle);
+            for (size_t j = 0; j < data.size() && error == VfsError::None; j++) {
+                if (data[j] != std::byte((j * 131 + t * CONCURRENT_FILES + i) % 251)) {
+                    std::cerr << "DATA OF " << name << " DIFFERS AFTER REOPENING" << std::endl;
+                    return false;
+                }
+            }
+            if (error == VfsError::None) {
+                error = volume.removeFile(name);
+            }
+            if (error != VfsError::None) {
+                return fail("CHECKING " + name, error);
+            }
+        }
+    }
+
+    VolumeStatistics statistics;
+    volume.getStatistics(statistics);
+    size_t indexBlocks = (statistics.iNodeChunkAmount * sizeof(uint64_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t expectedFree = statistics.blockAmount - statistics.iNodeChunkAmount * INODE_CHUNK_BLOCKS - indexBlocks - statistics.directoryBlockAmount;
+    size_t freeINodes = statistics.freeINodeAmount + statistics.directoryAmount;
+    if (statistics.freeBlockAmount != expectedFree || freeINodes != statistics.iNodeAmount) {
+        std::cerr << "FREE SPACE LOST: " << expectedFree - statistics.freeBlockAmount << " BLOCKS, "
+            << statistics.iNodeAmount - freeINodes << " INODES" << std::endl;
+        return false;
+    }
+    std::cout << "  ALL FILES VERIFIED, ALL BLOCKS AND INODES FREE AGAIN" << std::endl;
+    return true;
+}
+
+void printHelp() {
+    std::cout << "USAGE:" << std::endl;
+    std::cout << "stress [OPTIONS]" << std::endl;
+    std::cout << "--size <SIZE> - SIZE OF THE SPARSE IMAGE FILLED, K/M/G/T SUFFIXES ALLOWED (DEFAULT " DEFAULT_LARGE_SIZE ")" << std::endl;
+    std::cout << "--small <SIZE> - SIZE OF THE IMAGE THE COSTS ARE COMPARED WITH (DEFAULT " DEFAULT_SMALL_SIZE ")" << std::endl;
+    std::cout << "--threads <N> - THREADS OF THE CONCURRENT RUN ON THE SMALL IMAGE, 0 SKIPS IT (DEFAULT " << DEFAULT_THREADS << ")" << std::endl;
+    std::cout << "--dir <PATH> - WORKING DIRECTORY (DEFAULT stress_work)" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::string largeSize = DEFAULT_LARGE_SIZE;
+    std::string smallSize = DEFAULT_SMALL_SIZE;
+    std::filesystem::path workDirectory = "stress_work";
+    size_t threads = DEFAULT_THREADS;
+
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        if (i + 1 >= argc) {
+            printHelp();
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (option == "--size") {
+            largeSize = value;
+        } else if (option == "--small") {
+            smallSize = value;
+        } else if (option == "--threads") {
+            threads = std::stoul(value);
+        } else if (option == "--dir") {
+            workDirectory = value;
+        } else {
+            printHelp();
+            return 1;
+        }
+    }
+
+    std::filesystem::create_directories(workDirectory);
+    double smallProbe = 0;
+    double largeProbe = 0;
+    bool passed = runImage(workDirectory / "small.img", parseSize(smallSize), false, smallProbe)
+        && runImage(workDirectory / "large.img", parseSize(largeSize), true, largeProbe)
+        && (threads == 0 || runConcurrent(workDirectory / "concurrent.img", parseSize(smallSize), threads));
+    std::filesystem::remove_all(workDirectory);
+
+    if (passed) {
+        std::cout << "SMALL FILE ROUND TRIP ON THE LARGE IMAGE TAKES " << largeProbe / smallProbe << " TIMES AS LONG" << std::endl;
+    }
+    std::cout << (passed ? "STRESS TEST PASSED" : "STRESS TEST FAILED") << std::endl;
+    return passed ? 0 : 1;
+}
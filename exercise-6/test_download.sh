@@ -12,4 +12,6 @@ make
 
 ./main disc COPYFROM vader.jpg
 
-./main disc COPYFROM legenda.txt
\ No newline at end of file
+./main disc COPYFROM legenda.txt
+
+./main disc COPYFROM docs/tekst.txt --into downloaded
@@ -62,4 +62,12 @@ lsdisc
 map
 lsdisc
 
-./main disc COPYTO test_files/szturmowiec.png
\ No newline at end of file
+./main disc COPYTO test_files/szturmowiec.png
+
+map
+lsdisc
+
+./main disc COPYTO test_files/tekst.txt --into docs
+
+map
+./main disc LS docs
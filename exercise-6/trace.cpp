@@ -0,0 +1,333 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unordered_map>
+#include <unistd.h>
+
+const char* describeTraceOperation(TraceOperation operation) {
+    switch (operation) {
+        case TRACE_OPEN: return "OPEN";
+        case TRACE_CREATE_FILE: return "CREATEFILE";
+        case TRACE_OPEN_FILE: return "OPENFILE";
+        case TRACE_REMOVE_FILE: return "RM";
+        case TRACE_READ: return "READ";
+        case TRACE_WRITE: return "WRITE";
+        case TRACE_LIST: return "LS";
+        case TRACE_STATISTICS: return "STATS";
+        case TRACE_CLOSE_FILE: return "CLOSEFILE";
+        case TRACE_OPERATION_AMOUNT: break;
+    }
+    return "UNKNOWN";
+}
+
+TraceWriter::~TraceWriter() {
+    close();
+}
+
+bool TraceWriter::flush() {
+    size_t written = 0;
+    while (written < buffer.size()) {
+        ssize_t result = ::write(traceFile, buffer.data() + written, buffer.size() - written);
+        if (result <= 0) {
+            break;
+        }
+        written += result;
+    }
+    bool flushed = written == buffer.size();
+    buffer.clear();
+    return flushed;
+}
+
+VfsError TraceWriter::open(const std::string& path) {
+    close();
+
+    traceFile = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (traceFile < 0) {
+        return VfsError::HostIoError;
+    }
+
+    // A new trace starts with its header, later commands only append records
+    struct stat traceStat;
+    if (fstat(traceFile, &traceStat) != 0) {
+        close();
+        return VfsError::HostIoError;
+    }
+    if (traceStat.st_size == 0) {
+        TraceHeader header = {TRACE_MAGIC, TRACE_VERSION};
+        buffer.insert(buffer.end(), reinterpret_cast<char*>(&header), reinterpret_cast<char*>(&header) + sizeof(header));
+        if (!flush()) {
+            close();
+            return VfsError::HostIoError;
+        }
+    }
+    return VfsError::None;
+}
+
+void TraceWriter::close() {
+    std::lock_guard<std::mutex> guard(lock);
+    if (traceFile >= 0) {
+        flush();
+        ::close(traceFile);
+        traceFile = -1;
+    }
+}
+
+void TraceWriter::record(const TraceRecord& record, std::string_view name) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (traceFile < 0) {
+        return;
+    }
+    buffer.insert(buffer.end(), reinterpret_cast<const char*>(&record), reinterpret_cast<const char*>(&record) + sizeof(record));
+    buffer.insert(buffer.end(), name.begin(), name.begin() + record.nameLength);
+    if (buffer.size() >= TRACE_BUFFER_SIZE) {
+        flush();
+    }
+}
+
+TraceScope::TraceScope(TraceWriter* p_writer, TraceOperation operation, std::string_view p_name, uint32_t file, uint64_t offset, uint64_t size) : writer(p_writer) {
+    if (writer == nullptr) {
+        return;
+    }
+    name = p_name;
+    record.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    record.offset = offset;
+    record.size = size;
+    record.file = file;
+    record.operation = operation;
+    record.nameLength = std::min<size_t>(name.size(), UINT16_MAX);
+    start = std::chrono::steady_clock::now();
+}
+
+TraceScope::~TraceScope() {
+    if (writer == nullptr) {
+        return;
+    }
+    record.duration = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    writer->record(record, name);
+}
+
+void TraceScope::setFile(size_t file) {
+    record.file = file;
+}
+
+void TraceScope::setSize(size_t size) {
+    record.size = size;
+}
+
+VfsError readTrace(const std::string& path, std::vector<TraceEntry>& entries) {
+    entries.clear();
+    int traceFile = ::open(path.c_str(), O_RDONLY);
+    if (traceFile < 0) {
+        return errno == ENOENT ? VfsError::NotFound : VfsError::HostIoError;
+    }
+
+    std::vector<char> content;
+    std::vector<char> chunk(TRACE_BUFFER_SIZE);
+    ssize_t result;
+    while ((result = ::read(traceFile, chunk.data(), chunk.size())) > 0) {
+        content.insert(content.end(), chunk.begin(), chunk.begin() + result);
+    }
+    ::close(traceFile);
+    if (result < 0) {
+        return VfsError::HostIoError;
+    }
+
+    TraceHeader header;
+    if (content.size() < sizeof(header)) {
+        return VfsError::Corrupted;
+    }
+    memcpy(&header, content.data(), sizeof(header));
+    if (header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+        return VfsError::Corrupted;
+    }
+
+    // A record cut short by a crash ends the trace
+    size_t position = sizeof(header);
+    while (position + sizeof(TraceRecord) <= content.size()) {
+        TraceEntry entry;
+        memcpy(&entry.record, content.data() + position, sizeof(entry.record));
+        position += sizeof(entry.record);
+        if (position + entry.record.nameLength > content.size() || entry.record.operation >= TRACE_OPERATION_AMOUNT) {
+            break;
+        }
+        entry.name.assign(content.data() + position, entry.record.nameLength);
+        position += entry.record.nameLength;
+        entries.push_back(std::move(entry));
+    }
+    return VfsError::None;
+}
+
+double percentile(std::vector<double> values, double fraction) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, size_t(fraction * values.size()))];
+}
+
+// Creates the files the trace opens or removes without creating them first, so they are found
+static VfsError prepareFiles(Volume& volume, const std::vector<TraceEntry>& entries, size_t& preparedFiles) {
+    std::unordered_map<std::string, bool> exists;
+    for (const TraceEntry& entry : entries) {
+        TraceOperation operation = TraceOperation(entry.record.operation);
+        if (operation != TRACE_CREATE_FILE && operation != TRACE_OPEN_FILE && operation != TRACE_REMOVE_FILE) {
+            continue;
+        }
+
+        auto [it, unknown] = exists.emplace(entry.name, true);
+        if (unknown && operation != TRACE_CREATE_FILE) {
+            FileHandle handle;
+            VfsError error = volume.createFile(entry.name, entry.record.size, handle);
+            volume.closeFile(handle);
+            if (error != VfsError::None) {
+                return error;
+            }
+            preparedFiles++;
+        }
+        it->second = operation != TRACE_REMOVE_FILE;
+    }
+    return VfsError::None;
+}
+
+// Runs the entries on the image created for the replay, the volume is closed by the caller
+static VfsError replayEntries(Volume& volume, const std::string& imagePath, const std::vector<TraceEntry>& entries, bool paced, ReplayReport& report) {
+    VfsError error = volume.open(imagePath);
+    if (error == VfsError::None) {
+        error = prepareFiles(volume, entries, report.preparedFiles);
+    }
+    if (error != VfsError::None) {
+        return error;
+    }
+
+    std::unordered_map<uint32_t, FileHandle> handles;
+    std::vector<std::byte> buffer;
+    std::vector<FileInfo> files;
+    VolumeStatistics statistics;
+
+    auto replayStart = std::chrono::steady_clock::now();
+    uint64_t pacedOffset = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+        const TraceRecord& record = entries[i].record;
+        const std::string& name = entries[i].name;
+
+        if (paced && i > 0) {
+            pacedOffset += std::min<uint64_t>(record.timestamp - std::min(record.timestamp, entries[i - 1].record.timestamp), TRACE_MAX_GAP_NANOSECONDS);
+            std::this_thread::sleep_until(replayStart + std::chrono::nanoseconds(pacedOffset));
+        }
+
+        // Handles the recorded run no longer had are closed untimed, a removal would wait for them forever
+        auto found = handles.find(record.file);
+        if (found != handles.end() && record.operation != TRACE_READ && record.operation != TRACE_WRITE && record.operation != TRACE_CLOSE_FILE) {
+            volume.closeFile(found->second);
+            handles.erase(found);
+            found = handles.end();
+        }
+        if (record.operation == TRACE_OPEN) {
+            for (auto& [file, handle] : handles) {
+                volume.closeFile(handle);
+            }
+            handles.clear();
+        }
+
+        if (record.operation == TRACE_READ || record.operation == TRACE_WRITE) {
+            buffer.resize(record.size);
+            if (record.operation == TRACE_WRITE) {
+                std::fill(buffer.begin(), buffer.end(), std::byte(record.offset & 0xFF));
+            }
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        size_t bytes = 0;
+        FileHandle handle;
+        switch (record.operation) {
+            case TRACE_OPEN:
+                error = volume.open(imagePath);
+                break;
+            case TRACE_CREATE_FILE:
+                error = volume.createFile(name, record.size, handle);
+                break;
+            case TRACE_OPEN_FILE:
+                error = volume.openFile(name, handle);
+                break;
+            case TRACE_REMOVE_FILE:
+                error = volume.removeFile(name);
+                break;
+            case TRACE_READ:
+                error = found == handles.end() ? VfsError::InvalidHandle : volume.read(found->second, record.offset, buffer, bytes);
+                break;
+            case TRACE_WRITE:
+                error = found == handles.end() ? VfsError::InvalidHandle : volume.write(found->second, record.offset, buffer, bytes);
+                break;
+            case TRACE_LIST:
+                volume.listFiles(files);
+                error = VfsError::None;
+                break;
+            case TRACE_STATISTICS:
+                volume.getStatistics(statistics);
+                error = VfsError::None;
+                break;
+            case TRACE_CLOSE_FILE:
+                if (found == handles.end()) {
+                    error = VfsError::InvalidHandle;
+                } else {
+                    volume.closeFile(found->second);
+                    handles.erase(found);
+                    error = VfsError::None;
+                }
+                break;
+        }
+        double latency = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if ((record.operation == TRACE_CREATE_FILE || record.operation == TRACE_OPEN_FILE) && error == VfsError::None) {
+            handles[record.file] = std::move(handle);
+        }
+
+        ReplayOperation& operation = report.perOperation[record.operation];
+        operation.latencies.push_back(latency);
+        operation.recordedLatencies.push_back(record.duration / 1e9);
+        operation.bytes += bytes;
+        operation.errors += error == VfsError::None ? 0 : 1;
+        report.bytes += bytes;
+        report.operations++;
+    }
+    report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - replayStart).count();
+
+    for (auto& [file, handle] : handles) {
+        volume.closeFile(handle);
+    }
+    return VfsError::None;
+}
+
+VfsError replayTrace(const std::string& tracePath, const std::string& imagePath, bool paced, ReplayReport& report) {
+    report = ReplayReport();
+    std::vector<TraceEntry> entries;
+    VfsError error = readTrace(tracePath, entries);
+    if (error != VfsError::None) {
+        return error;
+    }
+
+    // The first OPEN of the trace carries the size of the recorded image
+    auto firstOpen = std::find_if(entries.begin(), entries.end(), [](const TraceEntry& entry) {
+        return entry.record.operation == TRACE_OPEN;
+    });
+    if (firstOpen == entries.end()) {
+        return VfsError::Corrupted;
+    }
+    report.imageSize = firstOpen->record.size;
+
+    error = Volume::create(imagePath, report.imageSize);
+    if (error != VfsError::None) {
+        return error;
+    }
+    // The image only lives for the replay, so the next one starts from an empty system again
+    {
+        Volume volume;
+        error = replayEntries(volume, imagePath, entries, paced, report);
+    }
+    VfsError removed = Volume::destroy(imagePath);
+    return error != VfsError::None ? error : removed;
+}
@@ -0,0 +1,123 @@
+#ifndef __trace_h
+#define __trace_h
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "vfs.h"
+
+#define TRACE_MAGIC 0x5643524154534656
+#define TRACE_VERSION 1
+#define TRACE_BUFFER_SIZE 65536
+// Gaps between recorded operations longer than this are shortened when replaying at the original pacing,
+// so idle time between two commands does not stall the replay
+#define TRACE_MAX_GAP_NANOSECONDS 1000000000
+#define TRACE_NO_FILE UINT32_MAX
+
+enum TraceOperation : uint8_t {
+    TRACE_OPEN,
+    TRACE_CREATE_FILE,
+    TRACE_OPEN_FILE,
+    TRACE_REMOVE_FILE,
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_LIST,
+    TRACE_STATISTICS,
+    TRACE_CLOSE_FILE,
+    TRACE_OPERATION_AMOUNT
+};
+
+const char* describeTraceOperation(TraceOperation operation);
+
+struct TraceHeader {
+    uint64_t magic;
+    uint64_t version;
+};
+
+// One operation of the trace, followed in the file by `nameLength` bytes of its name.
+// `file` is the INode the operation worked on, it ties reads and writes to the create or open before them.
+struct TraceRecord {
+    // Wall clock nanoseconds, so traces of several commands appended to one file keep their order
+    uint64_t timestamp;
+    uint64_t duration;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t file;
+    uint8_t operation;
+    uint8_t reserved;
+    uint16_t nameLength;
+};
+
+struct TraceEntry {
+    TraceRecord record;
+    std::string name;
+};
+
+// Appends records to a trace file, buffered and safe to use from many threads
+class TraceWriter {
+    private:
+        int traceFile = -1;
+        std::vector<char> buffer;
+        std::mutex lock;
+
+        bool flush();
+
+    public:
+        TraceWriter() = default;
+        ~TraceWriter();
+        TraceWriter(const TraceWriter&) = delete;
+        TraceWriter& operator=(const TraceWriter&) = delete;
+
+        VfsError open(const std::string& path);
+        void close();
+        void record(const TraceRecord& record, std::string_view name);
+};
+
+// Records one operation when it goes out of scope, does nothing when tracing is off
+class TraceScope {
+    private:
+        TraceWriter* writer;
+        TraceRecord record = {};
+        std::string_view name;
+        std::chrono::steady_clock::time_point start;
+
+    public:
+        TraceScope(TraceWriter* p_writer, TraceOperation operation, std::string_view p_name, uint32_t file, uint64_t offset, uint64_t size);
+        ~TraceScope();
+
+        void setFile(size_t file);
+        void setSize(size_t size);
+};
+
+VfsError readTrace(const std::string& path, std::vector<TraceEntry>& entries);
+
+struct ReplayOperation {
+    size_t errors = 0;
+    size_t bytes = 0;
+    // Seconds of every call, replayed and as recorded
+    std::vector<double> latencies;
+    std::vector<double> recordedLatencies;
+};
+
+struct ReplayReport {
+    size_t imageSize = 0;
+    size_t operations = 0;
+    size_t bytes = 0;
+    double seconds = 0.0;
+    // Files opened by the trace but created before it started, made up front with their recorded size
+    size_t preparedFiles = 0;
+    ReplayOperation perOperation[TRACE_OPERATION_AMOUNT];
+};
+
+// Runs a trace against a new image at `imagePath`, sized like the image the trace was recorded on.
+// The image is removed again when the replay ends.
+// Written data is a fixed pattern, only sizes and offsets of the recorded operations are kept.
+VfsError replayTrace(const std::string& tracePath, const std::string& imagePath, bool paced, ReplayReport& report);
+
+double percentile(std::vector<double> values, double fraction);
+
+#endif
@@ -0,0 +1,4363 @@
+#include "vfs.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fcntl.h>
+#include <filesystem>
+#include <random>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_set>
+
+// Missing from older headers, kernels before 5.14 reject it and the hint falls back to MADV_WILLNEED
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+const char* describeError(VfsError error) {
+    switch (error) {
+        case VfsError::None: return "SUCCESS";
+        case VfsError::NotFound: return "NOT FOUND";
+        case VfsError::AlreadyExists: return "ALREADY EXISTS";
+        case VfsError::NoFreeINodes: return "NO FREE INODES";
+        case VfsError::NoSpace: return "NOT ENOUGH SPACE";
+        case VfsError::TooSmall: return "FILE SYSTEM SIZE TOO SMALL";
+        case VfsError::Corrupted: return "INVALID MAGIC NUMBER, SYSTEM CORRUPTED";
+        case VfsError::InvalidHandle: return "INVALID FILE HANDLE";
+        case VfsError::OutOfRange: return "OUT OF FILE RANGE";
+        case VfsError::IoError: return "SYSTEM I/O ERROR";
+        case VfsError::HostIoError: return "HOST FILE I/O ERROR";
+        case VfsError::TooManyClones: return "TOO MANY CLONES OF A BLOCK";
+        case VfsError::InvalidMembers: return "INVALID MEMBER FILES";
+        case VfsError::ReadOnly: return "SYSTEM OPENED READ-ONLY";
+        case VfsError::InvalidName: return "INVALID FILE NAME";
+        case VfsError::IsDirectory: return "IS A DIRECTORY";
+        case VfsError::NotDirectory: return "NOT A DIRECTORY";
+        case VfsError::DirectoryNotEmpty: return "DIRECTORY NOT EMPTY";
+    }
+    return "UNKNOWN ERROR";
+}
+
+const char* describePhase(VfsPhase phase) {
+    switch (phase) {
+        case PHASE_LOAD: return "LOAD";
+        case PHASE_LOOKUP: return "LOOKUP";
+        case PHASE_ALLOCATION: return "ALLOCATION";
+        case PHASE_METADATA: return "METADATA";
+        case PHASE_DATA: return "DATA";
+        case PHASE_HOST: return "HOST";
+        case PHASE_AMOUNT: break;
+    }
+    return "UNKNOWN";
+}
+
+Volume::~Volume() {
+    close();
+}
+
+size_t Volume::calculateBitmapWords(size_t bits) const {
+    return (bits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+}
+
+// Share counts are rounded up to whole words, so the blocks after them stay aligned
+size_t Volume::calculateShareCountSize() const {
+    return (superBlock.blocksPerGroup * sizeof(uint16_t) + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+}
+
+size_t Volume::calculateGroupMetadataSize() const {
+    return calculateBitmapWords(superBlock.blocksPerGroup) * sizeof(uint64_t) + calculateShareCountSize();
+}
+
+size_t Volume::calculateBlocksAmount(size_t fileSize) const {
+    return (fileSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Bytes of a file kept in a fragment block, the chain holds the rest in whole blocks
+size_t Volume::calculateTailLength(size_t fileSize) const {
+    return superBlock.tailPacking ? fileSize % BLOCK_SIZE : 0;
+}
+
+size_t Volume::calculateTailStart(const INode& iNode) const {
+    return calculateDataBlockOffsetFromIndex(iNode.tailBlock) + iNode.tailOffset;
+}
+
+// Blocks of a chunk are consecutive in one group, so its INodes lie one after another across them
+size_t Volume::calculateINodeOffset(size_t index) const {
+    return calculateDataBlockOffsetFromIndex(chunks[index / INODES_PER_CHUNK].firstBlock)
+        + INODE_CHUNK_BITMAP_WORDS * sizeof(uint64_t) + (index % INODES_PER_CHUNK) * sizeof(INode);
+}
+
+size_t Volume::calculateDataBlockOffsetFromIndex(size_t blockIndex) const {
+    return groups[blockIndex / superBlock.blocksPerGroup].descriptor.blockStart + (blockIndex % superBlock.blocksPerGroup) * sizeof(DataBlock);
+}
+
+void Volume::initializeSuperBlock(size_t systemSize) {
+    superBlock.magicNumber = MAGIC_NUMBER;
+    superBlock.fileSystemSize = systemSize;
+    superBlock.blocksPerGroup = BLOCKS_PER_GROUP;
+    superBlock.groupTableStart = sizeof(SuperBlock);
+
+    size_t groupDataSize = superBlock.blocksPerGroup * sizeof(DataBlock);
+    superBlock.groupAmount = std::max<size_t>(1, (systemSize + groupDataSize - 1) / groupDataSize);
+
+    // Dropping groups until the last one has room for its metadata and at least one data block
+    while (true) {
+        superBlock.groupStart = superBlock.groupTableStart + superBlock.groupAmount * sizeof(GroupDescriptor);
+        superBlock.groupSize = calculateGroupMetadataSize() + groupDataSize;
+
+        size_t lastGroupStart = superBlock.groupStart + (superBlock.groupAmount - 1) * superBlock.groupSize;
+        if (superBlock.groupAmount == 1 || lastGroupStart + calculateGroupMetadataSize() + sizeof(DataBlock) <= systemSize) {
+            break;
+        }
+        superBlock.groupAmount--;
+    }
+
+    // No INode exists before the first file takes a chunk
+    superBlock.iNodeAmount = 0;
+    superBlock.freeINodeAmount = 0;
+    superBlock.blockAmount = 0;
+    superBlock.generation = 0;
+    superBlock.chunkAmount = 0;
+    superBlock.chunkIndexBlock = 0;
+    superBlock.tailPacking = 0;
+    superBlock.memberAmount = 1;
+    superBlock.volumeId = 0;
+    memset(superBlock.memberPaths, 0, sizeof(superBlock.memberPaths));
+
+    groups.clear();
+    for (size_t i = 0; i < superBlock.groupAmount; i++) {
+        GroupDescriptor& descriptor = groups.emplace_back().descriptor;
+        descriptor.blockBitmapStart = superBlock.groupStart + i * superBlock.groupSize;
+        descriptor.shareCountStart = descriptor.blockBitmapStart + calculateBitmapWords(superBlock.blocksPerGroup) * sizeof(uint64_t);
+        descriptor.blockStart = descriptor.shareCountStart + calculateShareCountSize();
+        descriptor.blockAmount = systemSize > descriptor.blockStart
+            ? std::min(superBlock.blocksPerGroup, (systemSize - descriptor.blockStart) / sizeof(DataBlock))
+            : 0;
+        descriptor.freeBlockAmount = descriptor.blockAmount;
+        superBlock.blockAmount += descriptor.blockAmount;
+    }
+}
+
+void ImageLocks::attach(int file) {
+    std::lock_guard<std::mutex> guard(lock);
+    discFile = file;
+    regions.clear();
+}
+
+bool ImageLocks::setLock(size_t region, short type) {
+    struct flock range = {};
+    range.l_type = type;
+    range.l_whence = SEEK_SET;
+    range.l_start = LOCK_SPACE_START + region;
+    range.l_len = 1;
+    while (fcntl(discFile, F_OFD_SETLKW, &range) != 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Waits for the other threads of the process first, then the first holder waits for the other processes
+bool ImageLocks::acquire(size_t region, LockMode mode) {
+    std::unique_lock<std::mutex> guard(lock);
+    Region& state = regions[region];
+    state.waiters++;
+    changed.wait(guard, [&]() {
+        return !state.acquiring && (state.holders == 0 || (mode != LockMode::Exclusive && state.mode == mode));
+    });
+    state.waiters--;
+    state.holders++;
+    if (state.holders > 1) {
+        return true;
+    }
+
+    state.mode = mode;
+    state.acquiring = true;
+    guard.unlock();
+    bool locked = setLock(region, mode == LockMode::Shared ? F_RDLCK : F_WRLCK);
+    guard.lock();
+    state.acquiring = false;
+    if (!locked && --state.holders == 0 && state.waiters == 0) {
+        regions.erase(region);
+    }
+    changed.notify_all();
+    return locked;
+}
+
+// Every file has a region of its own, so idle regions are dropped to keep the map as small as the locks held.
+// Waiters keep theirs, they hold a reference to it.
+void ImageLocks::release(size_t region) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = regions.find(region);
+    if (it == regions.end()) {
+        return;
+    }
+    Region& state = it->second;
+    if (--state.holders == 0) {
+        setLock(region, F_UNLCK);
+        if (state.waiters == 0) {
+            regions.erase(it);
+        } else {
+            state.mode = LockMode::Shared;
+        }
+    }
+    changed.notify_all();
+}
+
+// Counts one image access and a seek when it does not continue the previous one
+void Volume::countAccess(size_t offset, size_t size) const {
+    VFS_COUNT(syscalls, 1);
+    if (counters.lastOffset.exchange(offset + size, std::memory_order_relaxed) != offset) {
+        VFS_COUNT(seeks, 1);
+    }
+}
+
+// Member holding an offset of the image and the offset inside it, returns the bytes of `size` lying there in one piece
+size_t Volume::locate(size_t offset, size_t size, size_t& member, size_t& memberOffset) const {
+    if (memberFiles.size() <= 1) {
+        member = 0;
+        memberOffset = offset;
+        return size;
+    }
+    size_t unit = offset / STRIPE_UNIT_SIZE;
+    size_t inUnit = offset % STRIPE_UNIT_SIZE;
+    member = unit % memberFiles.size();
+    memberOffset = MEMBER_HEADER_SIZE + unit / memberFiles.size() * STRIPE_UNIT_SIZE + inUnit;
+    return std::min(size, STRIPE_UNIT_SIZE - inUnit);
+}
+
+// Copies a piece of a member out of its mapping, nothing past the end of the member is touched
+bool Volume::copyMapped(void* buffer, size_t size, size_t member, size_t memberOffset) const {
+    std::span<std::byte> mapping = memberMappings[member];
+    if (memberOffset > mapping.size() || size > mapping.size() - memberOffset) {
+        return false;
+    }
+    std::memcpy(buffer, mapping.data() + memberOffset, size);
+    return true;
+}
+
+bool Volume::readAt(void* buffer, size_t size, size_t offset) const {
+    char* destination = static_cast<char*>(buffer);
+    while (size > 0) {
+        size_t member;
+        size_t memberOffset;
+        size_t piece = locate(offset, size, member, memberOffset);
+        ssize_t result = -1;
+        if (memberMappings.empty()) {
+            VFS_ACCESS(offset, piece);
+            result = pread(memberFiles[member], destination, piece, memberOffset);
+        } else if (copyMapped(destination, piece, member, memberOffset)) {
+            result = piece;
+        }
+        if (result <= 0) {
+            return false;
+        }
+        VFS_COUNT(bytesRead, result);
+        destination += result;
+        size -= result;
+        offset += result;
+    }
+    return true;
+}
+
+// Metadata written in the full sync mode first waits until the file data written before it is durable
+bool Volume::writeAt(const void* buffer, size_t size, size_t offset, bool metadata) {
+    if (metadata && syncMode == SyncMode::Full && dataSequence > syncedData && !syncImage(false)) {
+        return false;
+    }
+    const char* source = static_cast<const char*>(buffer);
+    bool written = true;
+    while (size > 0) {
+        size_t member;
+        size_t memberOffset;
+        size_t piece = locate(offset, size, member, memberOffset);
+        VFS_ACCESS(offset, piece);
+        ssize_t result = pwrite(memberFiles[member], source, piece, memberOffset);
+        if (result <= 0) {
+            written = false;
+            break;
+        }
+        VFS_COUNT(bytesWritten, result);
+        source += result;
+        size -= result;
+        offset += result;
+    }
+    countWrite(metadata);
+    return written;
+}
+
+// Moves a range of the image through vectored I/O. The part of every member lies in one piece of it,
+// so a striped image takes a call for every member touched.
+bool Volume::transferRange(iovec* segments, size_t segmentsAmount, size_t offset, size_t length, bool writing) {
+    if (!memberMappings.empty()) {
+        for (size_t i = 0; i < segmentsAmount; i++) {
+            if (writing || !readAt(segments[i].iov_base, segments[i].iov_len, offset)) {
+                return false;
+            }
+            offset += segments[i].iov_len;
+        }
+        return true;
+    }
+    VFS_ACCESS(offset, length);
+    if (memberFiles.size() <= 1) {
+        ssize_t result = writing ? pwritev(discFile, segments, segmentsAmount, offset) : preadv(discFile, segments, segmentsAmount, offset);
+        if (result > 0) {
+            VFS_COUNT(bytesRead, writing ? 0 : result);
+            VFS_COUNT(bytesWritten, writing ? result : 0);
+        }
+        if (writing) {
+            countWrite(false);
+        }
+        return result == ssize_t(length);
+    }
+
+    struct MemberRange {
+        std::vector<iovec> segments;
+        size_t offset = 0;
+        size_t length = 0;
+    };
+    std::vector<MemberRange> ranges(memberFiles.size());
+    for (size_t i = 0; i < segmentsAmount; i++) {
+        std::byte* base = static_cast<std::byte*>(segments[i].iov_base);
+        size_t done = 0;
+        while (done < segments[i].iov_len) {
+            size_t member;
+            size_t memberOffset;
+            size_t piece = locate(offset, segments[i].iov_len - done, member, memberOffset);
+            MemberRange& range = ranges[member];
+            if (range.segments.empty()) {
+                range.offset = memberOffset;
+            }
+            range.segments.push_back({base + done, piece});
+            range.length += piece;
+            done += piece;
+            offset += piece;
+        }
+    }
+    for (size_t member = 0; member < ranges.size(); member++) {
+        MemberRange& range = ranges[member];
+        if (range.segments.empty()) {
+            continue;
+        }
+        VFS_COUNT(syscalls, member == 0 ? 0 : 1);
+        ssize_t result = writing
+            ? pwritev(memberFiles[member], range.segments.data(), range.segments.size(), range.offset)
+            : preadv(memberFiles[member], range.segments.data(), range.segments.size(), range.offset);
+        if (result > 0) {
+            VFS_COUNT(bytesRead, writing ? 0 : result);
+            VFS_COUNT(bytesWritten, writing ? result : 0);
+        }
+        if (writing) {
+            countWrite(false);
+        }
+        if (result != ssize_t(range.length)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Numbers a finished write, a sync started later covers it
+void Volume::countWrite(bool metadata) {
+    writeSequence++;
+    if (!metadata) {
+        dataSequence++;
+    }
+}
+
+// Makes every write finished before the call durable, `full` syncs the file metadata of the image too
+bool Volume::syncImage(bool full) {
+    uint64_t written = writeSequence;
+    std::lock_guard<std::mutex> guard(syncLock);
+    if (syncedWrites >= written) {
+        return true;
+    }
+    uint64_t covered = writeSequence;
+    uint64_t coveredData = dataSequence;
+    for (int file : memberFiles) {
+        VFS_COUNT(syncs, 1);
+        if ((full ? fsync(file) : fdatasync(file)) != 0) {
+            return false;
+        }
+    }
+    syncedWrites = covered;
+    syncedData = coveredData;
+    return true;
+}
+
+// Applies the sync mode to the writes of an operation before it returns, a failed sync fails the operation
+VfsError Volume::finishChange(VfsError error) {
+    SyncMode mode = syncMode;
+    if ((mode == SyncMode::Data || mode == SyncMode::Full) && !syncImage(mode == SyncMode::Full) && error == VfsError::None) {
+        return VfsError::IoError;
+    }
+    return error;
+}
+
+void Volume::startSyncThread() {
+    if (syncMode == SyncMode::Batch && isOpen() && !syncThread.joinable()) {
+        syncThreadStopping = false;
+        syncThread = std::thread(&Volume::runSyncThread, this);
+    }
+}
+
+void Volume::stopSyncThread() {
+    if (!syncThread.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(syncThreadLock);
+        syncThreadStopping = true;
+    }
+    syncThreadWake.notify_all();
+    syncThread.join();
+}
+
+// Writes of the batch mode are synced together every SYNC_BATCH_INTERVAL_MS, operations never wait for the disc
+void Volume::runSyncThread() {
+    std::unique_lock<std::mutex> guard(syncThreadLock);
+    while (!syncThreadStopping) {
+        syncThreadWake.wait_for(guard, std::chrono::milliseconds(SYNC_BATCH_INTERVAL_MS), [this] { return syncThreadStopping; });
+        guard.unlock();
+        syncImage(false);
+        guard.lock();
+    }
+}
+
+bool Volume::writeSuperBlock() {
+    return writeAt(&superBlock, sizeof(SuperBlock), 0, true);
+}
+
+bool Volume::writeGroupDescriptor(size_t group) {
+    return writeAt(&groups[group].descriptor, sizeof(GroupDescriptor), superBlock.groupTableStart + group * sizeof(GroupDescriptor), true);
+}
+
+// Writes back the words of a bitmap covering bits [first, last]
+bool Volume::writeBitmapWords(size_t bitmapStart, std::vector<uint64_t>& bitmap, size_t first, size_t last) {
+    size_t firstWord = first / BITMAP_WORD_BITS;
+    size_t lastWord = last / BITMAP_WORD_BITS;
+    return writeAt(&bitmap[firstWord], (lastWord - firstWord + 1) * sizeof(uint64_t), bitmapStart + firstWord * sizeof(uint64_t), true);
+}
+
+bool Volume::writeINode(size_t index) {
+    VFS_PHASE(PHASE_METADATA);
+    return writeAt(&iNodes[index], sizeof(INode), calculateINodeOffset(index), true);
+}
+
+// Writes back the share counts of blocks [first, last] of a group
+bool Volume::writeShareCounts(size_t group, size_t first, size_t last) {
+    VFS_PHASE(PHASE_METADATA);
+    BlockGroup& blockGroup = groups[group];
+    return writeAt(&blockGroup.shareCounts[first], (last - first + 1) * sizeof(uint16_t), blockGroup.descriptor.shareCountStart + first * sizeof(uint16_t), true);
+}
+
+static uint64_t encodeRun(size_t length, size_t nextBlock) {
+    return (uint64_t(length - 1) << BLOCK_NUMBER_BITS) | nextBlock;
+}
+
+static size_t decodeRunLength(uint64_t run) {
+    return (run >> BLOCK_NUMBER_BITS) + 1;
+}
+
+static size_t decodeNextBlock(uint64_t run) {
+    return run & ((uint64_t(1) << BLOCK_NUMBER_BITS) - 1);
+}
+
+// Writes the record of a run into the trailer of the block the chain enters it at
+bool Volume::writeRun(size_t block, size_t length, size_t nextBlock) {
+    uint64_t run = encodeRun(length, nextBlock);
+    return writeAt(&run, sizeof(run), calculateDataBlockOffsetFromIndex(block) + offsetof(DataBlock, run), true);
+}
+
+// Links the runs into a chain, the last one continues at `lastNextBlock`.
+// Runs never cross a group, so no run is longer than a record can hold.
+bool Volume::linkBlocks(const std::vector<Extent>& extents, size_t lastNextBlock) {
+    VFS_PHASE(PHASE_METADATA);
+    for (size_t i = 0; i < extents.size(); i++) {
+        if (!writeRun(extents[i].start, extents[i].length, i + 1 < extents.size() ? extents[i + 1].start : lastNextBlock)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void setHandleExtents(FileHandle& handle, const std::vector<Extent>& extents, size_t sharedBlock) {
+    handle.extents.clear();
+    size_t fileBlock = 0;
+    for (Extent extent : extents) {
+        handle.extents.push_back({fileBlock, extent.start, extent.length});
+        fileBlock += extent.length;
+    }
+    handle.sharedBlock = sharedBlock;
+}
+
+VfsError Volume::loadSuperBlock() {
+    if (!readAt(&superBlock, sizeof(SuperBlock), 0) || superBlock.magicNumber != MAGIC_NUMBER) {
+        return VfsError::Corrupted;
+    }
+    return VfsError::None;
+}
+
+// Reads the whole descriptor table at once, only the groups in use are read further
+VfsError Volume::loadGroups() {
+    groups.clear();
+    std::vector<GroupDescriptor> descriptors(superBlock.groupAmount);
+    if (!readAt(descriptors.data(), descriptors.size() * sizeof(GroupDescriptor), superBlock.groupTableStart)) {
+        return VfsError::Corrupted;
+    }
+    if (isReadOnly()) {
+        adviseGroups(descriptors);
+    }
+
+    freeBlockAmount = 0;
+    for (size_t i = 0; i < superBlock.groupAmount; i++) {
+        BlockGroup& group = groups.emplace_back();
+        group.descriptor = descriptors[i];
+        freeBlockAmount += group.descriptor.freeBlockAmount;
+        if (group.descriptor.freeBlockAmount != group.descriptor.blockAmount && !loadGroup(i)) {
+            return VfsError::Corrupted;
+        }
+    }
+    for (std::atomic<size_t>& cursor : groupCursors) {
+        cursor = std::min<size_t>(cursor, groups.size() - 1);
+    }
+    return VfsError::None;
+}
+
+// Brings the bitmaps and share counts of a group into memory. A group never used has nothing worth reading,
+// everything in it is free. Callers other than loading hold the lock of the group.
+bool Volume::loadGroup(size_t index) {
+    BlockGroup& group = groups[index];
+    if (group.loaded) {
+        return true;
+    }
+    VFS_PHASE(PHASE_LOAD);
+    group.blockBitmap.assign(calculateBitmapWords(superBlock.blocksPerGroup), 0);
+    group.shareCounts.clear();
+    group.freeSpace.clear();
+    if (group.descriptor.freeBlockAmount == group.descriptor.blockAmount) {
+        group.freeSpace.release(0, group.descriptor.blockAmount);
+        group.loaded = true;
+        return true;
+    }
+
+    // A bitmap with every bit taken is known without reading it too
+    if (group.descriptor.freeBlockAmount == 0) {
+        setBits(group.blockBitmap, 0, group.descriptor.blockAmount, true);
+    } else if (!readAt(group.blockBitmap.data(), group.blockBitmap.size() * sizeof(uint64_t), group.descriptor.blockBitmapStart)) {
+        return false;
+    }
+    if (group.descriptor.sharedBlockAmount > 0) {
+        group.shareCounts.assign(superBlock.blocksPerGroup, 0);
+        if (!readAt(group.shareCounts.data(), group.shareCounts.size() * sizeof(uint16_t), group.descriptor.shareCountStart)) {
+            return false;
+        }
+    }
+    buildFreeSpace(group);
+    group.loaded = true;
+    return true;
+}
+
+void Volume::updateFreeBlocks(size_t released, size_t taken) {
+    std::lock_guard<std::mutex> guard(superBlockLock);
+    freeBlockAmount = freeBlockAmount + released - taken;
+}
+
+// Free runs of a group are rebuilt from its block bitmap, skipping whole words at once
+void Volume::buildFreeSpace(BlockGroup& group) {
+    size_t runStart = 0;
+    size_t blockAmount = group.descriptor.blockAmount;
+    size_t i = 0;
+    while (i < blockAmount) {
+        uint64_t word = group.blockBitmap[i / BITMAP_WORD_BITS];
+        if (i % BITMAP_WORD_BITS == 0 && (word == 0 || word == ~uint64_t(0)) && i + BITMAP_WORD_BITS <= blockAmount) {
+            if (word != 0) {
+                group.freeSpace.release(runStart, i - runStart);
+                runStart = i + BITMAP_WORD_BITS;
+            }
+            VFS_COUNT(blocksScanned, BITMAP_WORD_BITS);
+            i += BITMAP_WORD_BITS;
+            continue;
+        }
+        VFS_COUNT(blocksScanned, 1);
+        if (testBit(group.blockBitmap, i)) {
+            group.freeSpace.release(runStart, i - runStart);
+            runStart = i + 1;
+        }
+        i++;
+    }
+    group.freeSpace.release(runStart, blockAmount - runStart);
+}
+
+// Reloads the metadata when another process changed it since it was loaded, the metadata region must be held
+VfsError Volume::refresh() {
+    size_t generation;
+    {
+        // A thread sharing the metadata may be publishing the next generation
+        std::lock_guard<std::mutex> guard(superBlockLock);
+        if (!readAt(&generation, sizeof(generation), offsetof(SuperBlock, generation))) {
+            return VfsError::IoError;
+        }
+        if (generation == loadedGeneration) {
+            return VfsError::None;
+        }
+    }
+
+    std::unique_lock<std::shared_mutex> guard(namespaceLock);
+    if (generation == loadedGeneration) {
+        return VfsError::None;
+    }
+    VFS_PHASE(PHASE_LOAD);
+    VfsError error = loadSuperBlock();
+    if (error == VfsError::None) {
+        error = loadGroups();
+    }
+    if (error == VfsError::None) {
+        error = loadINodes();
+    }
+    if (error == VfsError::None) {
+        loadedGeneration = superBlock.generation;
+    }
+    return error;
+}
+
+// Publishes the next generation before anything changes, so a change failing halfway is reloaded too.
+// The metadata region must be held exclusively or for allocating.
+bool Volume::beginMetadataChange() {
+    std::lock_guard<std::mutex> guard(superBlockLock);
+    superBlock.generation++;
+    loadedGeneration = superBlock.generation;
+    return writeAt(&superBlock.generation, sizeof(superBlock.generation), offsetof(SuperBlock, generation), true);
+}
+
+// Reads the chunk index, then only the INodes in use, every run of them taken in the bitmap of a chunk at once.
+// Nothing but chunks is read, so this costs as much as the files stored.
+VfsError Volume::loadINodes() {
+    iNodes.clear();
+    nameIndex.clear();
+    chunks.clear();
+    std::vector<uint64_t> firstBlocks(superBlock.chunkAmount);
+    if (!getChainExtents(superBlock.chunkIndexBlock, firstBlocks.size() * sizeof(uint64_t), chunkIndexExtents)) {
+        return VfsError::Corrupted;
+    }
+    FileHandle handle;
+    setHandleExtents(handle, chunkIndexExtents, SIZE_MAX);
+    if (!firstBlocks.empty()
+        && transfer(handle, 0, reinterpret_cast<std::byte*>(firstBlocks.data()), firstBlocks.size() * sizeof(uint64_t), false) != VfsError::None) {
+        return VfsError::Corrupted;
+    }
+    if (isReadOnly()) {
+        adviseChunks(firstBlocks);
+    }
+
+    std::vector<INode> run;
+    for (size_t i = 0; i < firstBlocks.size(); i++) {
+        INodeChunk& chunk = chunks.emplace_back();
+        chunk.firstBlock = firstBlocks[i];
+        chunk.bitmap.assign(INODE_CHUNK_BITMAP_WORDS, 0);
+        if (chunk.firstBlock / superBlock.blocksPerGroup >= groups.size()
+            || !readAt(chunk.bitmap.data(), INODE_CHUNK_BITMAP_WORDS * sizeof(uint64_t), calculateDataBlockOffsetFromIndex(chunk.firstBlock))) {
+            return VfsError::Corrupted;
+        }
+        chunk.freeINodeAmount = INODES_PER_CHUNK;
+        for (size_t j = 0; j < INODES_PER_CHUNK;) {
+            if (!testBit(chunk.bitmap, j)) {
+                j++;
+                continue;
+            }
+            size_t end = j + 1;
+            while (end < INODES_PER_CHUNK && testBit(chunk.bitmap, end)) {
+                end++;
+            }
+            size_t index = i * INODES_PER_CHUNK + j;
+            run.resize(end - j);
+            if (!readAt(run.data(), run.size() * sizeof(INode), calculateINodeOffset(index))) {
+                return VfsError::Corrupted;
+            }
+            for (size_t k = 0; k < run.size(); k++) {
+                INode& iNode = iNodes.emplace(index + k, run[k]).first->second;
+                nameIndex.emplace(iNode.fileName, index + k);
+            }
+            chunk.freeINodeAmount -= run.size();
+            j = end;
+        }
+    }
+    return loadFragments();
+}
+
+// Rebuilds the room left in the fragment blocks from the tails of the files and of the snapshots,
+// so fragment blocks need no bitmaps on the image. Snapshots are only read on a packing volume.
+VfsError Volume::loadFragments() {
+    fragments.clear();
+    std::vector<size_t> snapshots;
+    for (const auto& [i, iNode] : iNodes) {
+        if (iNode.tailLength > 0) {
+            if (iNode.tailBlock / superBlock.blocksPerGroup >= groups.size()) {
+                return VfsError::Corrupted;
+            }
+            fragments.mark(iNode.tailBlock, iNode.tailOffset, iNode.tailLength);
+        }
+        if (std::string_view(iNode.fileName).starts_with(SNAPSHOT_PREFIX)) {
+            snapshots.push_back(i);
+        }
+    }
+    if (!superBlock.tailPacking) {
+        return VfsError::None;
+    }
+
+    std::vector<INode> entries;
+    for (size_t snapshot : snapshots) {
+        if (!readSnapshot(snapshot, entries)) {
+            return VfsError::Corrupted;
+        }
+        for (const INode& entry : entries) {
+            if (entry.tailLength > 0) {
+                fragments.mark(entry.tailBlock, entry.tailOffset, entry.tailLength);
+            }
+        }
+    }
+    return VfsError::None;
+}
+
+bool Volume::isINodeFree(size_t index) const {
+    return index / INODES_PER_CHUNK >= chunks.size() || !testBit(chunks[index / INODES_PER_CHUNK].bitmap, index % INODES_PER_CHUNK);
+}
+
+// Group holding the chunk of an INode, the data of its file is kept close to it
+size_t Volume::getINodeGroup(size_t index) const {
+    return chunks[index / INODES_PER_CHUNK].firstBlock / superBlock.blocksPerGroup;
+}
+
+// Chunks to take before `iNodesAmount` more INodes fit
+size_t Volume::calculateChunksNeeded(size_t iNodesAmount) const {
+    return iNodesAmount <= superBlock.freeINodeAmount ? 0 : (iNodesAmount - superBlock.freeINodeAmount + INODES_PER_CHUNK - 1) / INODES_PER_CHUNK;
+}
+
+uint16_t Volume::getShareCount(size_t block) const {
+    const BlockGroup& group = groups[block / superBlock.blocksPerGroup];
+    return group.shareCounts.empty() ? 0 : group.shareCounts[block % superBlock.blocksPerGroup];
+}
+
+bool Volume::isDataBlockFree(size_t index) const {
+    const BlockGroup& group = groups[index / superBlock.blocksPerGroup];
+    return !group.loaded || group.freeSpace.isFree(index % superBlock.blocksPerGroup);
+}
+
+size_t Volume::findINode(std::string_view name) const {
+    VFS_PHASE(PHASE_LOOKUP);
+    auto it = nameIndex.find(name);
+    return it == nameIndex.end() ? NO_INODE : it->second;
+}
+
+std::atomic<size_t>& Volume::getGroupCursor() {
+    return groupCursors[std::hash<std::thread::id>{}(std::this_thread::get_id()) % ALLOCATION_CURSORS];
+}
+
+// Picks the group of a new file: the first one from the group of the thread's previous file able to hold
+// the whole file in one run, otherwise the one with the most free blocks.
+// Starting where the last file went keeps the search short however many groups are full. A group another
+// thread is allocating in is passed over, so threads creating files at once settle in groups of their own.
+size_t Volume::chooseGroup(size_t blocksAmount) {
+    VFS_PHASE(PHASE_ALLOCATION);
+    size_t chosenGroup = 0;
+    size_t mostFreeBlocks = 0;
+    size_t busyGroup = SIZE_MAX;
+    std::atomic<size_t>& cursor = getGroupCursor();
+    size_t hint = cursor;
+    for (size_t i = 0; i < groups.size(); i++) {
+        size_t group = (hint + i) % groups.size();
+        BlockGroup& blockGroup = groups[group];
+        std::unique_lock<std::mutex> guard(blockGroup.lock, std::try_to_lock);
+        if (!guard.owns_lock()) {
+            busyGroup = busyGroup == SIZE_MAX ? group : busyGroup;
+            continue;
+        }
+        size_t largestExtent = blockGroup.loaded ? blockGroup.freeSpace.getLargestExtent() : blockGroup.descriptor.blockAmount;
+        if (largestExtent >= blocksAmount) {
+            cursor = group;
+            return group;
+        }
+        if (blockGroup.descriptor.freeBlockAmount >= mostFreeBlocks) {
+            chosenGroup = group;
+            mostFreeBlocks = blockGroup.descriptor.freeBlockAmount;
+        }
+    }
+    // Waiting for a busy group beats splitting the file
+    return busyGroup != SIZE_MAX ? busyGroup : chosenGroup;
+}
+
+// Whole taken words are skipped, the bitmap must have a free bit so the search ends inside it
+static size_t findFreeBit(const std::vector<uint64_t>& bitmap) {
+    size_t index = 0;
+    while (bitmap[index / BITMAP_WORD_BITS] == ~uint64_t(0)) {
+        index += BITMAP_WORD_BITS;
+    }
+    return index + std::countr_one(bitmap[index / BITMAP_WORD_BITS]);
+}
+
+// Takes consecutive blocks for a chunk of free INodes in `group`, or the first group after it with a run long enough,
+// and appends it to the chunk index. The namespace must be held exclusively.
+bool Volume::allocateChunk(size_t group) {
+    VFS_PHASE(PHASE_ALLOCATION);
+    Extent extent = {0, 0};
+    for (size_t i = 0; i < groups.size() && extent.length == 0; i++) {
+        size_t currentGroup = (group + i) % groups.size();
+        BlockGroup& blockGroup = groups[currentGroup];
+        std::lock_guard<std::mutex> guard(blockGroup.lock);
+        if (blockGroup.descriptor.freeBlockAmount < INODE_CHUNK_BLOCKS || !loadGroup(currentGroup)
+            || blockGroup.freeSpace.getLargestExtent() < INODE_CHUNK_BLOCKS) {
+            continue;
+        }
+
+        Extent local = blockGroup.freeSpace.allocate(INODE_CHUNK_BLOCKS).front();
+        setBits(blockGroup.blockBitmap, local.start, local.length, true);
+        blockGroup.descriptor.freeBlockAmount -= local.length;
+        updateFreeBlocks(0, local.length);
+        if (!writeBitmapWords(blockGroup.descriptor.blockBitmapStart, blockGroup.blockBitmap, local.start, local.start + local.length - 1)
+            || !writeGroupDescriptor(currentGroup)) {
+            return false;
+        }
+        extent = {currentGroup * superBlock.blocksPerGroup + local.start, local.length};
+    }
+    std::vector<uint64_t> bitmap(INODE_CHUNK_BITMAP_WORDS, 0);
+    if (extent.length == 0 || !writeAt(bitmap.data(), bitmap.size() * sizeof(uint64_t), calculateDataBlockOffsetFromIndex(extent.start), true)) {
+        return false;
+    }
+
+    // The index grows a block at a time, linked after its last run
+    size_t indexBlocks = 0;
+    for (Extent indexExtent : chunkIndexExtents) {
+        indexBlocks += indexExtent.length;
+    }
+    if (superBlock.chunkAmount == indexBlocks * BLOCK_SIZE / sizeof(uint64_t)) {
+        std::vector<Extent> added = allocateDataBlocks(extent.start / superBlock.blocksPerGroup, 1);
+        if (added.empty() || !linkBlocks(added, 0)) {
+            return false;
+        }
+        if (chunkIndexExtents.empty()) {
+            superBlock.chunkIndexBlock = added.front().start;
+        } else if (!writeRun(chunkIndexExtents.back().start, chunkIndexExtents.back().length, added.front().start)) {
+            return false;
+        }
+        chunkIndexExtents.push_back(added.front());
+    }
+    FileHandle handle;
+    setHandleExtents(handle, chunkIndexExtents, SIZE_MAX);
+    uint64_t firstBlock = extent.start;
+    if (transfer(handle, superBlock.chunkAmount * sizeof(uint64_t), reinterpret_cast<std::byte*>(&firstBlock), sizeof(firstBlock), true) != VfsError::None) {
+        return false;
+    }
+
+    chunks.push_back({extent.start, bitmap, INODES_PER_CHUNK});
+    std::lock_guard<std::mutex> guard(superBlockLock);
+    superBlock.chunkAmount++;
+    superBlock.iNodeAmount += INODES_PER_CHUNK;
+    superBlock.freeINodeAmount += INODES_PER_CHUNK;
+    return writeSuperBlock();
+}
+
+// Takes the lowest free INode of a chunk in `group`, of any chunk when none there has one left, or of a new chunk.
+// Only the memory is changed, the caller writes the bitmap of the chunk and the superblock.
+size_t Volume::takeINode(size_t group) {
+    size_t chosen = SIZE_MAX;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        if (chunks[i].freeINodeAmount == 0) {
+            continue;
+        }
+        bool inGroup = chunks[i].firstBlock / superBlock.blocksPerGroup == group;
+        if (chosen == SIZE_MAX || inGroup) {
+            chosen = i;
+        }
+        if (inGroup) {
+            break;
+        }
+    }
+    if (chosen == SIZE_MAX) {
+        if (!allocateChunk(group)) {
+            return NO_INODE;
+        }
+        chosen = chunks.size() - 1;
+    }
+
+    INodeChunk& chunk = chunks[chosen];
+    size_t index = findFreeBit(chunk.bitmap);
+    setBits(chunk.bitmap, index, 1, true);
+    chunk.freeINodeAmount--;
+    std::lock_guard<std::mutex> guard(superBlockLock);
+    superBlock.freeINodeAmount--;
+    return chosen * INODES_PER_CHUNK + index;
+}
+
+// Takes an INode as close to `group` as possible, returns its index or NO_INODE when no chunk can be taken
+size_t Volume::allocateINode(size_t group) {
+    VFS_PHASE(PHASE_ALLOCATION);
+    size_t index = takeINode(group);
+    if (index == NO_INODE
+        || !writeBitmapWords(calculateDataBlockOffsetFromIndex(chunks[index / INODES_PER_CHUNK].firstBlock), chunks[index / INODES_PER_CHUNK].bitmap,
+            index % INODES_PER_CHUNK, index % INODES_PER_CHUNK)) {
+        return NO_INODE;
+    }
+    std::lock_guard<std::mutex> guard(superBlockLock);
+    return writeSuperBlock() ? index : NO_INODE;
+}
+
+// Chunks stay taken once they are empty, the next files fill them again
+bool Volume::releaseINode(size_t index) {
+    VFS_PHASE(PHASE_ALLOCATION);
+    INodeChunk& chunk = chunks[index / INODES_PER_CHUNK];
+    size_t localIndex = index % INODES_PER_CHUNK;
+    setBits(chunk.bitmap, localIndex, 1, false);
+    chunk.freeINodeAmount++;
+    if (!writeBitmapWords(calculateDataBlockOffsetFromIndex(chunk.firstBlock), chunk.bitmap, localIndex, localIndex)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(superBlockLock);
+    superBlock.freeINodeAmount++;
+    return writeSuperBlock();
+}
+
+// Takes the blocks from the given group first and spills the rest over the following groups.
+// With `fromBlock` the lowest free blocks from that one on are taken instead, in block order and without wrapping around.
+// Returned extents hold global block indexes, an empty result for a non-zero amount means failure.
+std::vector<Extent> Volume::allocateDataBlocks(size_t group, size_t blocksAmount, size_t fromBlock) {
+    VFS_PHASE(PHASE_ALLOCATION);
+    bool inOrder = fromBlock != SIZE_MAX;
+    if (inOrder) {
+        group = fromBlock / superBlock.blocksPerGroup;
+    }
+    std::vector<Extent> extents;
+    for (size_t i = 0; i < groups.size() && blocksAmount > 0 && (!inOrder || group + i < groups.size()); i++) {
+        size_t currentGroup = (group + i) % groups.size();
+        BlockGroup& blockGroup = groups[currentGroup];
+        std::lock_guard<std::mutex> guard(blockGroup.lock);
+
+        size_t blocksFromGroup = std::min(blocksAmount, blockGroup.descriptor.freeBlockAmount);
+        if (blocksFromGroup == 0) {
+            continue;
+        }
+        if (!loadGroup(currentGroup)) {
+            return {};
+        }
+
+        std::vector<Extent> taken = inOrder
+            ? blockGroup.freeSpace.allocateFrom(i == 0 ? fromBlock % superBlock.blocksPerGroup : 0, blocksFromGroup)
+            : blockGroup.freeSpace.allocate(blocksFromGroup);
+        blocksFromGroup = 0;
+        for (Extent extent : taken) {
+            setBits(blockGroup.blockBitmap, extent.start, extent.length, true);
+            if (!writeBitmapWords(blockGroup.descriptor.blockBitmapStart, blockGroup.blockBitmap, extent.start, extent.start + extent.length - 1)) {
+                return {};
+            }
+            extents.push_back({currentGroup * superBlock.blocksPerGroup + extent.start, extent.length});
+            blocksFromGroup += extent.length;
+        }
+        blockGroup.descriptor.freeBlockAmount -= blocksFromGroup;
+        updateFreeBlocks(0, blocksFromGroup);
+        if (!writeGroupDescriptor(currentGroup)) {
+            return {};
+        }
+        blocksAmount -= blocksFromGroup;
+        // A file spilling over into later groups leaves the search for the next one where it ended
+        getGroupCursor() = currentGroup;
+    }
+    if (blocksAmount == 0) {
+        return extents;
+    }
+    // Too few blocks past `fromBlock`, the ones taken go back
+    for (Extent extent : extents) {
+        releaseDataBlocks(extent);
+    }
+    return {};
+}
+
+// Drops one owner of a run of blocks lying in a single group. Blocks left without owners
+// go back to the free space, coalesced with their free neighbours.
+bool Volume::releaseDataBlocks(Extent extent) {
+    VFS_PHASE(PHASE_ALLOCATION);
+    size_t group = extent.start / superBlock.blocksPerGroup;
+    size_t localStart = extent.start % superBlock.blocksPerGroup;
+    size_t localEnd = localStart + extent.length;
+    BlockGroup& blockGroup = groups[group];
+    std::lock_guard<std::mutex> guard(blockGroup.lock);
+
+    size_t released = 0;
+    auto releaseRun = [&](size_t start, size_t end) {
+        blockGroup.freeSpace.release(start, end - start);
+        setBits(blockGroup.blockBitmap, start, end - start, false);
+        blockGroup.descriptor.freeBlockAmount += end - start;
+        released += end - start;
+    };
+
+    bool shared = false;
+    size_t runStart = localStart;
+    for (size_t i = localStart; i < localEnd && !blockGroup.shareCounts.empty(); i++) {
+        if (blockGroup.shareCounts[i] > 0) {
+            if (--blockGroup.shareCounts[i] == 0) {
+                blockGroup.descriptor.sharedBlockAmount--;
+            }
+            shared = true;
+            releaseRun(runStart, i);
+            runStart = i + 1;
+        }
+    }
+    releaseRun(runStart, localEnd);
+    updateFreeBlocks(released, 0);
+
+    return writeBitmapWords(blockGroup.descriptor.blockBitmapStart, blockGroup.blockBitmap, localStart, localEnd - 1)
+        && (!shared || writeShareCounts(group, localStart, localEnd - 1))
+        && writeGroupDescriptor(group);
+}
+
+bool Volume::isSharingPossible(const std::vector<Extent>& extents) const {
+    for (Extent extent : extents) {
+        for (size_t i = extent.start; i < extent.start + extent.length; i++) {
+            if (getShareCount(i) == UINT16_MAX) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Adds one owner to every block of the runs, each lying in a single group
+bool Volume::shareDataBlocks(const std::vector<Extent>& extents) {
+    VFS_PHASE(PHASE_ALLOCATION);
+    for (Extent extent : extents) {
+        size_t group = extent.start / superBlock.blocksPerGroup;
+        size_t localStart = extent.start % superBlock.blocksPerGroup;
+        BlockGroup& blockGroup = groups[group];
+        std::lock_guard<std::mutex> guard(blockGroup.lock);
+        if (blockGroup.shareCounts.empty()) {
+            blockGroup.shareCounts.assign(superBlock.blocksPerGroup, 0);
+        }
+        for (size_t i = localStart; i < localStart + extent.length; i++) {
+            if (blockGroup.shareCounts[i]++ == 0) {
+                blockGroup.descriptor.sharedBlockAmount++;
+            }
+        }
+        if (!writeShareCounts(group, localStart, localStart + extent.length - 1) || !writeGroupDescriptor(group)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Collects the runs of a chain by following its run records, one read for every run.
+// Blocks shared with another file or a snapshot share the rest of the chain too, so share counts
+// never drop along a chain and the first shared block of a run is found by bisection.
+bool Volume::getChainExtents(size_t firstBlock, size_t fileSize, std::vector<Extent>& extents, size_t* sharedBlock) const {
+    VFS_PHASE(PHASE_LOOKUP);
+    extents.clear();
+    if (sharedBlock != nullptr) {
+        *sharedBlock = SIZE_MAX;
+    }
+    size_t blocksAmount = calculateBlocksAmount(fileSize);
+    size_t fileBlock = 0;
+    size_t block = firstBlock;
+    while (fileBlock < blocksAmount) {
+        size_t group = block / superBlock.blocksPerGroup;
+        uint64_t run;
+        if (group >= groups.size()
+            || !readAt(&run, sizeof(run), calculateDataBlockOffsetFromIndex(block) + offsetof(DataBlock, run))) {
+            return false;
+        }
+        // The record of the last run may go on past the end of a file cut shorter
+        size_t length = std::min(decodeRunLength(run), blocksAmount - fileBlock);
+        if (block % superBlock.blocksPerGroup + length > groups[group].descriptor.blockAmount) {
+            return false;
+        }
+
+        if (sharedBlock != nullptr && *sharedBlock == SIZE_MAX && getShareCount(block + length - 1) > 0) {
+            size_t low = 0;
+            size_t high = length - 1;
+            while (low < high) {
+                size_t middle = (low + high) / 2;
+                if (getShareCount(block + middle) > 0) {
+                    high = middle;
+                } else {
+                    low = middle + 1;
+                }
+            }
+            *sharedBlock = fileBlock + low;
+        }
+        extents.push_back({block, length});
+        VFS_COUNT(blocksScanned, 1);
+        fileBlock += length;
+        block = decodeNextBlock(run);
+    }
+    return true;
+}
+
+bool Volume::getFileExtents(size_t index, std::vector<Extent>& extents, size_t* sharedBlock) const {
+    const INode& iNode = iNodes.at(index);
+    return getChainExtents(iNode.firstBlock, iNode.fileSize - iNode.tailLength, extents, sharedBlock);
+}
+
+// Resolves the runs and the tail of a file into a handle, which is left closed
+bool Volume::fillHandle(size_t index, FileHandle& handle) const {
+    std::vector<Extent> extents;
+    size_t sharedBlock;
+    if (!getFileExtents(index, extents, &sharedBlock)) {
+        return false;
+    }
+    const INode& iNode = iNodes.at(index);
+    handle.iNode = index;
+    handle.size = iNode.fileSize;
+    setHandleExtents(handle, extents, sharedBlock);
+    handle.tailLength = iNode.tailLength;
+    handle.tailStart = iNode.tailLength == 0 ? 0 : calculateTailStart(iNode);
+    return true;
+}
+
+// Puts a tail into the fragment block with the best fitting room, or into a new one taken close to `group`
+bool Volume::allocateTail(INode& iNode, size_t length, size_t group) {
+    uint64_t block;
+    size_t offset;
+    if (!fragments.take(length, block, offset)) {
+        std::vector<Extent> added = allocateDataBlocks(group, 1);
+        if (added.empty()) {
+            return false;
+        }
+        fragments.addBlock(added.front().start);
+        fragments.take(length, block, offset);
+    }
+    iNode.tailBlock = block;
+    iNode.tailOffset = offset;
+    iNode.tailLength = length;
+    return true;
+}
+
+// A fragment block left without tails goes back to the free space
+bool Volume::releaseTail(INode& iNode) {
+    if (iNode.tailLength == 0) {
+        return true;
+    }
+    bool emptied = fragments.release(iNode.tailBlock, iNode.tailOffset, iNode.tailLength);
+    Extent block = {iNode.tailBlock, 1};
+    iNode.tailBlock = 0;
+    iNode.tailOffset = 0;
+    iNode.tailLength = 0;
+    return !emptied || releaseDataBlocks(block);
+}
+
+// Tails are never shared, a clone or a snapshot gets a copy of its own
+bool Volume::copyTail(const INode& source, INode& copy, size_t group) {
+    copy.tailBlock = 0;
+    copy.tailOffset = 0;
+    copy.tailLength = 0;
+    if (source.tailLength == 0) {
+        return true;
+    }
+    char data[BLOCK_SIZE];
+    return readAt(data, source.tailLength, calculateTailStart(source))
+        && allocateTail(copy, source.tailLength, group)
+        && writeAt(data, copy.tailLength, calculateTailStart(copy));
+}
+
+// Opens are only counted here, writing the INode on every one would cost more than the open itself
+void Volume::recordAccess(size_t index) {
+    std::lock_guard<std::mutex> guard(accessLock);
+    pendingAccesses[index]++;
+}
+
+// Adds the opens counted since the last time to the counters on the image. Other processes add theirs the same way,
+// so every counter is read back before it is written. The metadata must be held exclusively.
+bool Volume::writeAccessCounts() {
+    std::unordered_map<size_t, uint64_t> pending;
+    {
+        std::lock_guard<std::mutex> guard(accessLock);
+        pending.swap(pendingAccesses);
+    }
+    for (const auto& [index, count] : pending) {
+        if (isINodeFree(index)) {
+            continue;
+        }
+        size_t offset = calculateINodeOffset(index) + offsetof(INode, accessCount);
+        uint64_t stored;
+        if (!readAt(&stored, sizeof(stored), offset)) {
+            return false;
+        }
+        stored += count;
+        if (!writeAt(&stored, sizeof(stored), offset, true)) {
+            return false;
+        }
+        iNodes[index].accessCount = stored;
+    }
+    return true;
+}
+
+// Counters do not move the generation, other processes keep their stale copies until they reload
+void Volume::flushAccessCounts() {
+    {
+        std::lock_guard<std::mutex> guard(accessLock);
+        if (pendingAccesses.empty()) {
+            return;
+        }
+    }
+    ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, true);
+    if (!metadataGuard.isLocked() || refresh() != VfsError::None) {
+        return;
+    }
+    std::unique_lock<std::shared_mutex> guard(namespaceLock);
+    writeAccessCounts();
+}
+
+// Runs holding blocks [first, last] of a file, out of the runs of the whole file
+static std::vector<Extent> sliceExtents(const std::vector<Extent>& extents, size_t first, size_t last) {
+    std::vector<Extent> slice;
+    size_t fileBlock = 0;
+    for (Extent extent : extents) {
+        size_t start = std::max(first, fileBlock);
+        size_t end = std::min(last + 1, fileBlock + extent.length);
+        if (start < end) {
+            slice.push_back({extent.start + start - fileBlock, end - start});
+        }
+        fileBlock += extent.length;
+    }
+    return slice;
+}
+
+// Moves a byte range of a file with vectored I/O. A trailer sits right after the data of every
+// block, so crossing into the next block of a run moves the trailer in between too: read into
+// a scratch, or written with the value it already has, the run record of the extent in its
+// first block and zero in the others. Nothing is allocated.
+VfsError Volume::transfer(const FileHandle& handle, size_t offset, std::byte* buffer, size_t length, bool writing) {
+    VFS_PHASE(PHASE_DATA);
+    // The part in the tail is a single access, a file held in a fragment block alone takes no other
+    size_t chainBytes = handle.size - handle.tailLength;
+    if (handle.tailLength > 0 && offset + length > chainBytes) {
+        size_t tailFrom = std::max(offset, chainBytes);
+        size_t tailBytes = offset + length - tailFrom;
+        size_t tailOffset = handle.tailStart + tailFrom - chainBytes;
+        if (writing ? !writeAt(buffer + tailFrom - offset, tailBytes, tailOffset) : !readAt(buffer + tailFrom - offset, tailBytes, tailOffset)) {
+            return VfsError::IoError;
+        }
+        length -= tailBytes;
+        if (length == 0) {
+            return VfsError::None;
+        }
+    }
+
+    iovec segments[2 * IO_BATCH_BLOCKS];
+    uint64_t trailers[IO_BATCH_BLOCKS];
+    size_t segmentsAmount = 0;
+    size_t trailersAmount = 0;
+    size_t batchStart = 0;
+    size_t batchLength = 0;
+
+    auto flush = [&]() {
+        if (segmentsAmount == 0) {
+            return true;
+        }
+        bool moved = transferRange(segments, segmentsAmount, batchStart, batchLength, writing);
+        segmentsAmount = 0;
+        trailersAmount = 0;
+        return moved;
+    };
+
+    size_t fileBlock = offset / BLOCK_SIZE;
+    auto extent = std::prev(std::upper_bound(handle.extents.begin(), handle.extents.end(), fileBlock,
+        [](size_t block, const FileExtent& fileExtent) { return block < fileExtent.fileBlock; }));
+
+    size_t done = 0;
+    while (done < length) {
+        size_t blockInExtent = fileBlock - extent->fileBlock;
+        size_t block = extent->start + blockInExtent;
+        size_t inBlock = (offset + done) % BLOCK_SIZE;
+        size_t chunk = std::min(BLOCK_SIZE - inBlock, length - done);
+        size_t diskOffset = calculateDataBlockOffsetFromIndex(block) + inBlock;
+
+        if (segmentsAmount > 0 && (diskOffset != batchStart + batchLength || segmentsAmount + 2 > 2 * IO_BATCH_BLOCKS)) {
+            if (!flush()) {
+                return VfsError::IoError;
+            }
+        }
+        if (segmentsAmount == 0) {
+            batchStart = diskOffset;
+            batchLength = 0;
+        }
+
+        segments[segmentsAmount++] = {buffer + done, chunk};
+        batchLength += chunk;
+        done += chunk;
+
+        bool nextInRun = blockInExtent + 1 < extent->length;
+        if (nextInRun && inBlock + chunk == BLOCK_SIZE && done < length) {
+            trailers[trailersAmount] = 0;
+            if (blockInExtent == 0) {
+                size_t nextBlock = std::next(extent) == handle.extents.end() ? 0 : std::next(extent)->start;
+                trailers[trailersAmount] = encodeRun(extent->length, nextBlock);
+            }
+            segments[segmentsAmount++] = {&trailers[trailersAmount++], sizeof(uint64_t)};
+            batchLength += sizeof(uint64_t);
+        }
+
+        fileBlock++;
+        if (!nextInRun) {
+            ++extent;
+        }
+    }
+
+    return flush() ? VfsError::None : VfsError::IoError;
+}
+
+VfsError Volume::create(const std::string& path, size_t size, bool tailPacking, const std::vector<std::string>& members) {
+    std::vector<std::string> paths = {path};
+    paths.insert(paths.end(), members.begin(), members.end());
+    if (size < MIN_FILE_SYSTEM_SIZE) {
+        return VfsError::TooSmall;
+    }
+    if (paths.size() > MAX_MEMBERS) {
+        return VfsError::InvalidMembers;
+    }
+
+    Volume volume;
+    volume.initializeSuperBlock(size);
+    volume.superBlock.tailPacking = tailPacking;
+    volume.superBlock.memberAmount = paths.size();
+    volume.superBlock.volumeId = std::random_device()() ^ uint64_t(time(nullptr)) << 32;
+
+    // Members are named by absolute paths, so the volume opens from any directory
+    for (size_t i = 1; i < paths.size(); i++) {
+        std::string absolute = std::filesystem::absolute(paths[i]).lexically_normal().string();
+        if (absolute.size() >= MEMBER_PATH_SIZE) {
+            return VfsError::InvalidMembers;
+        }
+        strncpy(volume.superBlock.memberPaths[i - 1], absolute.c_str(), MEMBER_PATH_SIZE - 1);
+    }
+    // Files are created exclusively, so the ones opened so far are this call's own and a failure removes them
+    auto abandon = [&](VfsError error) {
+        for (size_t i = 0; i < volume.memberFiles.size(); i++) {
+            ::close(volume.memberFiles[i]);
+            remove(paths[i].c_str());
+        }
+        volume.memberFiles.clear();
+        volume.discFile = -1;
+        return error;
+    };
+    size_t units = (size + STRIPE_UNIT_SIZE - 1) / STRIPE_UNIT_SIZE;
+    for (size_t i = 0; i < paths.size(); i++) {
+        int file = ::open(paths[i].c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (file < 0) {
+            return abandon(errno == EEXIST ? VfsError::AlreadyExists : VfsError::IoError);
+        }
+        volume.memberFiles.push_back(file);
+        volume.discFile = volume.memberFiles.front();
+        MemberHeader header = {MEMBER_MAGIC, volume.superBlock.volumeId, i, paths.size()};
+        size_t memberSize = paths.size() == 1 ? size : MEMBER_HEADER_SIZE + (units + paths.size() - 1) / paths.size() * STRIPE_UNIT_SIZE;
+        if (ftruncate(file, memberSize) != 0 || (paths.size() > 1 && pwrite(file, &header, sizeof(header), 0) != sizeof(header))) {
+            return abandon(VfsError::IoError);
+        }
+    }
+
+    // The image is sparse, bitmaps and share counts of every group start out as the zeros
+    // the host gives unwritten space, so only the superblock and the descriptors are written
+    std::vector<GroupDescriptor> descriptors;
+    for (const BlockGroup& group : volume.groups) {
+        descriptors.push_back(group.descriptor);
+    }
+    if (!volume.writeSuperBlock()
+        || !volume.writeAt(descriptors.data(), descriptors.size() * sizeof(GroupDescriptor), volume.superBlock.groupTableStart)) {
+        return abandon(VfsError::IoError);
+    }
+    return VfsError::None;
+}
+
+VfsError Volume::destroy(const std::string& path) {
+    Volume volume;
+    VfsError error = volume.open(path);
+    if (error != VfsError::None) {
+        return error;
+    }
+    std::vector<std::string> paths = {path};
+    for (size_t i = 1; i < volume.superBlock.memberAmount; i++) {
+        paths.push_back(volume.superBlock.memberPaths[i - 1]);
+    }
+    volume.close();
+
+    for (const std::string& memberPath : paths) {
+        if (remove(memberPath.c_str()) != 0) {
+            error = VfsError::IoError;
+        }
+    }
+    return error;
+}
+
+// A striped image starts with a member header instead of the superblock. Its superblock, found in the first
+// unit, names the other members, which must carry headers of the same volume in their places.
+VfsError Volume::openMembers(int flags) {
+    memberFiles = {discFile};
+    MemberHeader header;
+    if (pread(discFile, &header, sizeof(header), 0) != sizeof(header)) {
+        return VfsError::Corrupted;
+    }
+    if (header.magicNumber != MEMBER_MAGIC) {
+        return VfsError::None;
+    }
+    SuperBlock stored;
+    if (header.index != 0 || header.memberAmount < 2 || header.memberAmount > MAX_MEMBERS
+        || pread(discFile, &stored, sizeof(stored), MEMBER_HEADER_SIZE) != sizeof(stored)
+        || stored.memberAmount != header.memberAmount || stored.volumeId != header.volumeId) {
+        return VfsError::Corrupted;
+    }
+
+    for (size_t i = 1; i < stored.memberAmount; i++) {
+        stored.memberPaths[i - 1][MEMBER_PATH_SIZE - 1] = 0;
+        int file = ::open(stored.memberPaths[i - 1], flags);
+        if (file < 0) {
+            return VfsError::InvalidMembers;
+        }
+        memberFiles.push_back(file);
+        MemberHeader memberHeader;
+        if (pread(file, &memberHeader, sizeof(memberHeader), 0) != sizeof(memberHeader) || memberHeader.magicNumber != MEMBER_MAGIC
+            || memberHeader.volumeId != header.volumeId || memberHeader.index != i || memberHeader.memberAmount != header.memberAmount) {
+            return VfsError::InvalidMembers;
+        }
+    }
+    return VfsError::None;
+}
+
+VfsError Volume::open(const std::string& path) {
+    return open(path, nullptr);
+}
+
+VfsError Volume::openMapped(const std::string& path, const MapOptions& options) {
+    return open(path, &options);
+}
+
+// Without `mapping` the image is opened for reading and writing, with it the image is mapped read-only
+VfsError Volume::open(const std::string& path, const MapOptions* mapping) {
+    close();
+
+    TraceScope traceScope(trace.get(), TRACE_OPEN, path, TRACE_NO_FILE, 0, 0);
+    VFS_PHASE(PHASE_LOAD);
+    VFS_COUNT(syscalls, 1);
+    int flags = mapping ? O_RDONLY : O_RDWR;
+    discFile = ::open(path.c_str(), flags);
+    if (discFile < 0) {
+        return errno == ENOENT ? VfsError::NotFound : VfsError::IoError;
+    }
+    imageLocks.attach(discFile);
+
+    VfsError error = openMembers(flags);
+    if (error == VfsError::None && mapping) {
+        mapOptions = *mapping;
+        error = mapMembers() ? VfsError::None : VfsError::IoError;
+    }
+    if (error == VfsError::None) {
+        ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, false);
+        error = metadataGuard.isLocked() ? loadSuperBlock() : VfsError::IoError;
+        if (error == VfsError::None) {
+            error = loadGroups();
+        }
+        if (error == VfsError::None) {
+            error = loadINodes();
+        }
+        loadedGeneration = superBlock.generation;
+    }
+    if (error != VfsError::None) {
+        close();
+    } else {
+        traceScope.setSize(superBlock.fileSystemSize);
+        startSyncThread();
+    }
+    return error;
+}
+
+// Maps every image file whole. The data region is read front to back by copies, the metadata and the INode
+// chunks get hints of their own once their place is known.
+bool Volume::mapMembers() {
+    for (int file : memberFiles) {
+        struct stat status;
+        if (fstat(file, &status) != 0 || status.st_size == 0) {
+            return false;
+        }
+        VFS_COUNT(syscalls, 1);
+        void* address = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, file, 0);
+        if (address == MAP_FAILED) {
+            return false;
+        }
+        memberMappings.emplace_back(static_cast<std::byte*>(address), status.st_size);
+        madvise(address, status.st_size, MADV_SEQUENTIAL);
+        if (mapOptions.hugePages) {
+            madvise(address, status.st_size, MADV_HUGEPAGE);
+        }
+    }
+    return true;
+}
+
+// Gives a hint for a range of the image to the mapping of every member holding part of it. On a striped image
+// the units of one member inside the range lie next to each other in it, so each member takes a single call.
+// Hints are only hints, failures are ignored.
+void Volume::adviseRange(size_t offset, size_t length, int advice) const {
+    if (length == 0) {
+        return;
+    }
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t members = memberMappings.size();
+    size_t firstUnit = offset / STRIPE_UNIT_SIZE;
+    size_t lastUnit = (offset + length - 1) / STRIPE_UNIT_SIZE;
+    for (size_t member = 0; member < members; member++) {
+        size_t start = offset;
+        size_t end = offset + length;
+        if (members > 1) {
+            size_t first = firstUnit + (member + members - firstUnit % members) % members;
+            size_t last = lastUnit - (lastUnit % members + members - member) % members;
+            if (first > lastUnit) {
+                continue;
+            }
+            start = MEMBER_HEADER_SIZE + first / members * STRIPE_UNIT_SIZE + (first == firstUnit ? offset % STRIPE_UNIT_SIZE : 0);
+            end = MEMBER_HEADER_SIZE + last / members * STRIPE_UNIT_SIZE
+                + (last == lastUnit ? (offset + length - 1) % STRIPE_UNIT_SIZE + 1 : STRIPE_UNIT_SIZE);
+        }
+        std::span<std::byte> mapping = memberMappings[member];
+        start = start / pageSize * pageSize;
+        end = std::min(end, mapping.size());
+        if (start >= end) {
+            continue;
+        }
+        VFS_COUNT(syscalls, 1);
+        if (madvise(mapping.data() + start, end - start, advice) != 0 && advice == MADV_POPULATE_READ) {
+            madvise(mapping.data() + start, end - start, MADV_WILLNEED);
+        }
+    }
+}
+
+// The superblock, the group table and the bitmaps and share counts of the groups in use are all read when
+// loading, so they are read ahead, or faulted in right away when populating along with the data of those groups
+void Volume::adviseGroups(const std::vector<GroupDescriptor>& descriptors) const {
+    int metadataAdvice = mapOptions.populate ? MADV_POPULATE_READ : MADV_WILLNEED;
+    adviseRange(0, superBlock.groupStart, metadataAdvice);
+    for (const GroupDescriptor& descriptor : descriptors) {
+        if (descriptor.freeBlockAmount == descriptor.blockAmount) {
+            continue;
+        }
+        adviseRange(descriptor.blockBitmapStart, descriptor.blockStart - descriptor.blockBitmapStart, metadataAdvice);
+        if (mapOptions.populate) {
+            adviseRange(descriptor.blockStart, descriptor.blockAmount * sizeof(DataBlock), MADV_POPULATE_READ);
+        }
+    }
+}
+
+// INode chunks lie scattered over the data region, each is read ahead whole rather than waiting for the readahead
+// of the sequential data region to come across it. Only actions are given here, so the mapping is never split.
+void Volume::adviseChunks(const std::vector<uint64_t>& firstBlocks) const {
+    int advice = mapOptions.populate ? MADV_POPULATE_READ : MADV_WILLNEED;
+    for (uint64_t firstBlock : firstBlocks) {
+        if (firstBlock / superBlock.blocksPerGroup < groups.size()) {
+            adviseRange(calculateDataBlockOffsetFromIndex(firstBlock), INODE_CHUNK_BLOCKS * sizeof(DataBlock), advice);
+        }
+    }
+}
+
+bool Volume::isReadOnly() const {
+    return !memberMappings.empty();
+}
+
+void Volume::close() {
+    if (discFile >= 0) {
+        flushAccessCounts();
+        stopSyncThread();
+        if (syncMode != SyncMode::None) {
+            syncImage(syncMode == SyncMode::Full);
+        }
+        for (std::span<std::byte> mapping : memberMappings) {
+            munmap(mapping.data(), mapping.size());
+        }
+        for (size_t i = 1; i < memberFiles.size(); i++) {
+            ::close(memberFiles[i]);
+        }
+        // Closing the descriptor drops every lock taken through it
+        ::close(discFile);
+        discFile = -1;
+        imageLocks.attach(-1);
+    }
+    memberFiles.clear();
+    memberMappings.clear();
+    groups.clear();
+    iNodes.clear();
+    chunks.clear();
+    chunkIndexExtents.clear();
+    nameIndex.clear();
+    fragments.clear();
+}
+
+// Every member of a striped image gets a thread of its own to keep busy
+size_t Volume::calculateCopyThreads(size_t chunks) const {
+    return std::max<size_t>(1, std::min(std::max(copyThreads.load(), memberFiles.size()), chunks));
+}
+
+bool Volume::isOpen() const {
+    return discFile >= 0;
+}
+
+VfsError Volume::createFile(std::string_view name, size_t size, FileHandle& handle) {
+    return isReadOnly() ? VfsError::ReadOnly : finishChange(createFileUnsynced(name, size, handle));
+}
+
+VfsError Volume::createFileUnsynced(std::string_view name, size_t size, FileHandle& handle) {
+    TraceScope traceScope(trace.get(), TRACE_CREATE_FILE, name, TRACE_NO_FILE, 0, size);
+    // Other threads of the process creating files share the metadata
+    ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, LockMode::Allocating);
+    if (!metadataGuard.isLocked()) {
+        return VfsError::IoError;
+    }
+    VfsError error = refresh();
+    if (error != VfsError::None) {
+        return error;
+    }
+    std::unique_lock<std::shared_mutex> guard(namespaceLock);
+
+    error = createINode(name, size, handle, guard);
+    if (handle.open) {
+        traceScope.setFile(handle.iNode);
+    }
+    return error;
+}
+
+// Directory holding a file, the empty name standing for the root
+static std::string_view getParentPath(std::string_view name) {
+    size_t slash = name.rfind('/');
+    return slash == std::string_view::npos ? std::string_view() : name.substr(0, slash);
+}
+
+// Name of a file within its directory
+static std::string_view getBaseName(std::string_view name) {
+    size_t slash = name.rfind('/');
+    return slash == std::string_view::npos ? name : name.substr(slash + 1);
+}
+
+static std::string_view trimPath(std::string_view path) {
+    while (path.starts_with('/')) {
+        path.remove_prefix(1);
+    }
+    while (path.ends_with('/')) {
+        path.remove_suffix(1);
+    }
+    return path;
+}
+
+// Every part of a name must fit a directory entry, and the nearest directory on its path that exists
+// has to be a directory, the ones after it are created with the file
+VfsError Volume::checkPath(std::string_view name) const {
+    if (name.empty() || name.size() >= FILE_NAME_SIZE) {
+        return VfsError::InvalidName;
+    }
+    for (std::string_view rest = name; !rest.empty();) {
+        size_t slash = rest.find('/');
+        std::string_view part = rest.substr(0, slash);
+        if (part.empty() || part == "." || part == ".." || part.size() >= DIRECTORY_NAME_SIZE || (slash != std::string_view::npos && slash + 1 == rest.size())) {
+            return VfsError::InvalidName;
+        }
+        rest = slash == std::string_view::npos ? std::string_view() : rest.substr(slash + 1);
+    }
+    for (std::string_view parent = getParentPath(name);; parent = getParentPath(parent)) {
+        size_t index = findINode(parent);
+        if (index != NO_INODE) {
+            return isDirectory(index) ? VfsError::None : VfsError::NotDirectory;
+        }
+        if (parent.empty()) {
+            return VfsError::None;
+        }
+    }
+}
+
+// Creates the directories missing on the path of a checked name, the root included. `created` counts
+// the ones above the name made here apart from the root, a directory keeps the namespace while it is made.
+VfsError Volume::createParents(std::string_view name, std::unique_lock<std::shared_mutex>& guard, size_t& created) {
+    created = 0;
+    std::string_view parent = getParentPath(name);
+    if (findINode(parent) != NO_INODE) {
+        return VfsError::None;
+    }
+    for (std::string_view missing = parent; !missing.empty() && findINode(missing) == NO_INODE; missing = getParentPath(missing)) {
+        created++;
+    }
+    VfsError error = createDirectoryINode(parent, guard);
+    if (error != VfsError::None) {
+        created = 0;
+    }
+    return error;
+}
+
+// Takes back the directories createParents() made for a file that could not be created, the nearest first.
+// Another thread may have entered a file in one meanwhile, that one stays with the directories above it.
+void Volume::removeParents(std::string_view name, size_t created) {
+    std::string_view parent = name;
+    for (size_t i = 0; i < created; i++) {
+        parent = getParentPath(parent);
+        size_t index = findINode(parent);
+        FileHandle handle;
+        DirectoryHeader header;
+        if (index == NO_INODE || !fillHandle(index, handle) || !transferDirectory(handle, 0, &header, sizeof(header), false)
+            || header.entryAmount > 0 || removeINode(index) != VfsError::None) {
+            return;
+        }
+    }
+}
+
+VfsError Volume::createDirectoryINode(std::string_view path, std::unique_lock<std::shared_mutex>& guard) {
+    FileHandle handle;
+    return createINode(path, 2 * DIRECTORY_NODE_SIZE, handle, guard, true);
+}
+
+// Gives back an INode taken for a file sharing the blocks of another, before they were shared.
+// Its name and tail go with it, the INode is cleared on the image too.
+void Volume::discardINode(size_t index) {
+    INode& iNode = iNodes[index];
+    releaseTail(iNode);
+    nameIndex.erase(nameIndex.find(std::string_view(iNode.fileName)));
+    iNode = INode();
+    writeINode(index);
+    iNodes.erase(index);
+    releaseINode(index);
+}
+
+// Creates a file with all of its blocks and enters it in its directory, the metadata must be held exclusively
+// or for allocating. The namespace is held exclusively through `guard` and let go while the blocks of a file
+// are taken and linked, so threads creating files at once only wait for each other to take their INodes.
+// A directory keeps it until its index is written, nothing is entered in it before.
+VfsError Volume::createINode(std::string_view name, size_t size, FileHandle& handle, std::unique_lock<std::shared_mutex>& guard, bool directory) {
+    if (findINode(name) != NO_INODE) {
+        return VfsError::AlreadyExists;
+    }
+    // The root has the empty name, hidden files are in no directory
+    bool listed = !(directory && name.empty()) && !name.starts_with(SNAPSHOT_PREFIX);
+    size_t createdParents = 0;
+    if (listed) {
+        VfsError error = checkPath(name);
+        if (error == VfsError::None) {
+            error = createParents(name, guard, createdParents);
+        }
+        if (error != VfsError::None) {
+            return error;
+        }
+    }
+    // The directories made for a file that fails go with it
+    auto fail = [&](VfsError error) {
+        removeParents(name, createdParents);
+        return error;
+    };
+
+    // A new chunk of INodes is taken from the same free blocks as the data
+    size_t chunkBlocks = calculateChunksNeeded(1) * INODE_CHUNK_BLOCKS;
+    if (chunkBlocks > getAmountOfFreeDataBlocks()) {
+        return fail(VfsError::NoFreeINodes);
+    }
+    size_t tailLength = calculateTailLength(size);
+    size_t blocksAmount = calculateBlocksAmount(size - tailLength);
+    // A tail fitting in no fragment block takes a new one
+    size_t tailBlocks = tailLength > 0 && !fragments.fits(tailLength) ? 1 : 0;
+    if (blocksAmount + chunkBlocks + tailBlocks > getAmountOfFreeDataBlocks()) {
+        return fail(VfsError::NoSpace);
+    }
+
+    if (!beginMetadataChange()) {
+        return fail(VfsError::IoError);
+    }
+
+    // Keeping the INode and the data of the file in the same group
+    size_t group = chooseGroup(blocksAmount);
+    size_t iNodeIndex = allocateINode(group);
+    if (iNodeIndex == NO_INODE) {
+        // A new chunk needs a run of consecutive blocks, which no group may have left
+        return fail(superBlock.freeINodeAmount == 0 ? VfsError::NoFreeINodes : VfsError::IoError);
+    }
+    // Nobody can open the file before the metadata is released, so this never waits for long.
+    // A directory is never opened and takes no lock, its handle is only used to write its index.
+    if (!directory && !imageLocks.acquire(1 + iNodeIndex, true)) {
+        releaseINode(iNodeIndex);
+        return fail(VfsError::IoError);
+    }
+    handle.iNode = iNodeIndex;
+    handle.size = size;
+    handle.open = true;
+    handle.extents.clear();
+    handle.sharedBlock = SIZE_MAX;
+
+    // The name is taken before the namespace is let go, the groups have locks of their own
+    INode& iNode = iNodes[iNodeIndex];
+    iNode = INode();
+    strncpy(iNode.fileName, std::string(name).c_str(), sizeof(iNode.fileName) - 1);
+    iNode.fileSize = size;
+    iNode.flags = directory ? INODE_DIRECTORY : 0;
+    nameIndex.emplace(iNode.fileName, iNodeIndex);
+    if (!directory) {
+        guard.unlock();
+    }
+    std::vector<Extent> extents = allocateDataBlocks(group, blocksAmount);
+    bool linked = (!extents.empty() || blocksAmount == 0) && linkBlocks(extents, 0);
+    if (!directory) {
+        guard.lock();
+    }
+    // Empty files own no blocks, the INode bitmap alone marks them as taken
+    iNode.firstBlock = extents.empty() ? 0 : extents.front().start;
+    bool created = linked && (tailLength == 0 || allocateTail(iNode, tailLength, group)) && writeINode(iNodeIndex);
+    if (created) {
+        setHandleExtents(handle, extents, SIZE_MAX);
+        handle.tailLength = tailLength;
+        handle.tailStart = tailLength == 0 ? 0 : calculateTailStart(iNode);
+    }
+
+    // A new directory holds its header and an empty leaf as the root
+    DirectoryHeader header;
+    DirectoryNode root;
+    created = created && (!directory || (transferDirectory(handle, 0, &header, sizeof(header), true)
+        && transferDirectory(handle, header.rootNode * DIRECTORY_NODE_SIZE, &root, sizeof(root), true)));
+    created = created && (!listed || linkEntry(iNodeIndex));
+    if (!created) {
+        // Other threads may have taken the space meanwhile. Everything the file took goes back.
+        for (Extent extent : extents) {
+            releaseDataBlocks(extent);
+        }
+        releaseTail(iNode);
+        nameIndex.erase(nameIndex.find(std::string_view(iNode.fileName)));
+        iNode = INode();
+        writeINode(iNodeIndex);
+        iNodes.erase(iNodeIndex);
+        releaseINode(iNodeIndex);
+        if (!directory) {
+            imageLocks.release(1 + iNodeIndex);
+        }
+        handle.open = false;
+        handle.extents.clear();
+        handle.tailLength = 0;
+        return fail(getAmountOfFreeDataBlocks() < blocksAmount + tailBlocks ? VfsError::NoSpace : VfsError::IoError);
+    }
+    return VfsError::None;
+}
+
+VfsError Volume::openFile(std::string_view name, FileHandle& handle) {
+    TraceScope traceScope(trace.get(), TRACE_OPEN_FILE, name, TRACE_NO_FILE, 0, 0);
+    ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, false);
+    if (!metadataGuard.isLocked()) {
+        return VfsError::IoError;
+    }
+    VfsError error = refresh();
+    if (error != VfsError::None) {
+        return error;
+    }
+
+    FileHandle opened;
+    {
+        std::shared_lock<std::shared_mutex> guard(namespaceLock);
+        size_t iNodeIndex = name.starts_with(SNAPSHOT_PREFIX) ? NO_INODE : findINode(name);
+        if (iNodeIndex == NO_INODE) {
+            return VfsError::NotFound;
+        }
+        if (isDirectory(iNodeIndex)) {
+            return VfsError::IsDirectory;
+        }
+        traceScope.setFile(iNodeIndex);
+        traceScope.setSize(iNodes[iNodeIndex].fileSize);
+        if (!fillHandle(iNodeIndex, opened)) {
+            return VfsError::IoError;
+        }
+    }
+
+    // Still holding the metadata, so the file cannot be removed before its lock is taken.
+    // A file being written by another handle is waited for here.
+    if (!imageLocks.acquire(1 + opened.iNode, false)) {
+        return VfsError::IoError;
+    }
+    // Opens of a read-only volume are not counted, they could never be written back
+    if (!isReadOnly()) {
+        recordAccess(opened.iNode);
+    }
+    handle = std::move(opened);
+    handle.open = true;
+    return VfsError::None;
+}
+
+void Volume::closeFile(FileHandle& handle) {
+    if (handle.open) {
+        TraceScope traceScope(trace.get(), TRACE_CLOSE_FILE, {}, handle.iNode, 0, 0);
+        imageLocks.release(1 + handle.iNode);
+    }
+    handle.open = false;
+    handle.extents.clear();
+    handle.tailLength = 0;
+}
+
+VfsError Volume::removeFile(std::string_view name) {
+    return isReadOnly() ? VfsError::ReadOnly : finishChange(removeFileUnsynced(name));
+}
+
+VfsError Volume::removeFileUnsynced(std::string_view name) {
+    TraceScope traceScope(trace.get(), TRACE_REMOVE_FILE, name, TRACE_NO_FILE, 0, 0);
+    ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, true);
+    if (!metadataGuard.isLocked()) {
+        return VfsError::IoError;
+    }
+    VfsError error = refresh();
+    if (error != VfsError::None) {
+        return error;
+    }
+    std::unique_lock<std::shared_mutex> guard(namespaceLock);
+
+    size_t iNodeIndex = name.starts_with(SNAPSHOT_PREFIX) ? NO_INODE : findINode(name);
+    if (iNodeIndex == NO_INODE) {
+        return VfsError::NotFound;
+    }
+    if (isDirectory(iNodeIndex)) {
+        return VfsError::IsDirectory;
+    }
+    traceScope.setFile(iNodeIndex);
+    traceScope.setSize(iNodes[iNodeIndex].fileSize);
+
+    // Waiting for the handles still reading the file
+    ImageLockGuard fileGuard(imageLocks, 1 + iNodeIndex, true);
+    if (!fileGuard.isLocked() || !beginMetadataChange()) {
+        return VfsError::IoError;
+    }
+    return removeINode(iNodeIndex);
+}
+
+// Drops the file's ownership of its blocks, frees its INode and takes it out of its directory,
+// the metadata must be held exclusively. The entry goes last, a file failing to go stays listed.
+VfsError Volume::removeINode(size_t index) {
+    // Walking the chain of the file and returning its runs to the free space of their groups
+    std::vector<Extent> extents;
+    if (!getFileExtents(index, extents)) {
+        return VfsError::IoError;
+    }
+    for (Extent extent : extents) {
+        if (!releaseDataBlocks(extent)) {
+            return VfsError::IoError;
+        }
+    }
+    if (!releaseTail(iNodes[index])) {
+        return VfsError::IoError;
+    }
+
+    std::string name = iNodes[index].fileName;
+    nameIndex.erase(nameIndex.find(std::string_view(name)));
+    iNodes[index] = INode();
+    {
+        std::lock_guard<std::mutex> guard(accessLock);
+        pendingAccesses.erase(index);
+    }
+    if (!writeINode(index) || !releaseINode(index)) {
+        return VfsError::IoError;
+    }
+    iNodes.erase(index);
+    return unlinkEntry(name) ? VfsError::None : VfsError::IoError;
+}
+
+bool Volume::isDirectory(size_t index) const {
+    return iNodes.at(index).flags & INODE_DIRECTORY;
+}
+
+static std::string_view getEntryName(const DirectoryEntry& entry) {
+    return std::string_view(entry.name, strnlen(entry.name, DIRECTORY_NAME_SIZE));
+}
+
+// Position of the first entry of a leaf not before `name`
+static size_t findEntryPosition(const DirectoryNode& node, std::string_view name) {
+    return std::lower_bound(node.entries, node.entries + node.entryAmount, name, [](const DirectoryEntry& entry, std::string_view name) {
+        return getEntryName(entry) < name;
+    }) - node.entries;
+}
+
+// Position of the child of an inner node holding `name`
+static size_t findChildPosition(const DirectoryNode& node, std::string_view name) {
+    size_t position = std::upper_bound(node.entries, node.entries + node.entryAmount, name, [](std::string_view name, const DirectoryEntry& entry) {
+        return name < getEntryName(entry);
+    }) - node.entries;
+    return position == 0 ? 0 : position - 1;
+}
+
+// Moves the header or a node of a directory, its nodes never reach a tail
+bool Volume::transferDirectory(const FileHandle& handle, size_t offset, void* data, size_t size, bool writing) {
+    return transfer(handle, offset, static_cast<std::byte*>(data), size, writing) == VfsError::None;
+}
+
+// Goes down the index of a directory to the leaf where `name` belongs, reading one node on every level.
+// `path` gets the nodes passed, the leaf last, and the positions of the children taken in them.
+bool Volume::findLeaf(const FileHandle& handle, const DirectoryHeader& header, std::string_view name, DirectoryNode& node, std::vector<std::pair<uint64_t, size_t>>& path) {
+    path.clear();
+    for (uint64_t nodeNumber = header.rootNode;;) {
+        if (nodeNumber >= header.nodeAmount || path.size() > header.nodeAmount
+            || !transferDirectory(handle, nodeNumber * DIRECTORY_NODE_SIZE, &node, sizeof(node), false)
+            || node.entryAmount > DIRECTORY_NODE_ENTRIES) {
+            return false;
+        }
+        if (node.leaf) {
+            path.emplace_back(nodeNumber, 0);
+            return true;
+        }
+        size_t position = findChildPosition(node, name);
+        path.emplace_back(nodeNumber, position);
+        nodeNumber = node.entries[position].target;
+    }
+}
+
+size_t Volume::findEntry(size_t directory, std::string_view name) {
+    FileHandle handle;
+    DirectoryHeader header;
+    DirectoryNode leaf;
+    std::vector<std::pair<uint64_t, size_t>> path;
+    if (!fillHandle(directory, handle) || !transferDirectory(handle, 0, &header, sizeof(header), false) || !findLeaf(handle, header, name, leaf, path)) {
+        return NO_INODE;
+    }
+    size_t position = findEntryPosition(leaf, name);
+    return position < leaf.entryAmount && getEntryName(leaf.entries[position]) == name ? leaf.entries[position].target : NO_INODE;
+}
+
+// Adds a name to the index of a directory, the metadata must be held. A full node is split in halves and
+// the first name of the second half goes up into the parent, a full root gets a new root above it.
+bool Volume::insertEntry(size_t directory, std::string_view name, size_t target) {
+    FileHandle handle;
+    DirectoryHeader header;
+    DirectoryNode node;
+    std::vector<std::pair<uint64_t, size_t>> path;
+    if (!fillHandle(directory, handle) || !transferDirectory(handle, 0, &header, sizeof(header), false) || !findLeaf(handle, header, name, node, path)) {
+        return false;
+    }
+    // A split taking a node past the end of the file doubles it, node 0 being the header stands for a failure
+    auto takeNode = [&]() -> uint64_t {
+        if ((header.nodeAmount + 1) * DIRECTORY_NODE_SIZE > handle.size
+            && (resizeINode(directory, 2 * handle.size) != VfsError::None || !fillHandle(directory, handle))) {
+            return 0;
+        }
+        return header.nodeAmount++;
+    };
+
+    DirectoryEntry entry;
+    name.copy(entry.name, sizeof(entry.name) - 1);
+    entry.target = target;
+    size_t position = findEntryPosition(node, name);
+    while (true) {
+        uint64_t nodeNumber = path.back().first;
+        path.pop_back();
+        if (node.entryAmount < DIRECTORY_NODE_ENTRIES) {
+            std::copy_backward(node.entries + position, node.entries + node.entryAmount, node.entries + node.entryAmount + 1);
+            node.entries[position] = entry;
+            node.entryAmount++;
+            if (!transferDirectory(handle, nodeNumber * DIRECTORY_NODE_SIZE, &node, sizeof(node), true)) {
+                return false;
+            }
+            break;
+        }
+
+        std::vector<DirectoryEntry> entries(node.entries, node.entries + node.entryAmount);
+        entries.insert(entries.begin() + position, entry);
+        size_t half = entries.size() / 2;
+        uint64_t siblingNumber = takeNode();
+        if (siblingNumber == 0) {
+            return false;
+        }
+        DirectoryNode sibling;
+        sibling.leaf = node.leaf;
+        sibling.entryAmount = entries.size() - half;
+        std::copy(entries.begin() + half, entries.end(), sibling.entries);
+        std::fill(std::copy(entries.begin(), entries.begin() + half, node.entries), node.entries + DIRECTORY_NODE_ENTRIES, DirectoryEntry());
+        node.entryAmount = half;
+        if (node.leaf) {
+            sibling.nextLeaf = node.nextLeaf;
+            node.nextLeaf = siblingNumber;
+        }
+        if (!transferDirectory(handle, siblingNumber * DIRECTORY_NODE_SIZE, &sibling, sizeof(sibling), true)
+            || !transferDirectory(handle, nodeNumber * DIRECTORY_NODE_SIZE, &node, sizeof(node), true)) {
+            return false;
+        }
+
+        entry = sibling.entries[0];
+        entry.target = siblingNumber;
+        if (path.empty()) {
+            DirectoryNode root;
+            root.leaf = 0;
+            root.entryAmount = 2;
+            root.entries[0] = node.entries[0];
+            root.entries[0].target = nodeNumber;
+            root.entries[1] = entry;
+            header.rootNode = takeNode();
+            if (header.rootNode == 0 || !transferDirectory(handle, header.rootNode * DIRECTORY_NODE_SIZE, &root, sizeof(root), true)) {
+                return false;
+            }
+            break;
+        }
+        position = path.back().second + 1;
+        if (!transferDirectory(handle, path.back().first * DIRECTORY_NODE_SIZE, &node, sizeof(node), false)) {
+            return false;
+        }
+    }
+    header.entryAmount++;
+    return transferDirectory(handle, 0, &header, sizeof(header), true);
+}
+
+// Drops a name from the index of a directory. Nodes are never merged, a leaf may be left empty and is
+// passed over by lookups and listings until names come back to it.
+bool Volume::removeEntry(size_t directory, std::string_view name) {
+    FileHandle handle;
+    DirectoryHeader header;
+    DirectoryNode leaf;
+    std::vector<std::pair<uint64_t, size_t>> path;
+    if (!fillHandle(directory, handle) || !transferDirectory(handle, 0, &header, sizeof(header), false) || !findLeaf(handle, header, name, leaf, path)) {
+        return false;
+    }
+    size_t position = findEntryPosition(leaf, name);
+    if (position == leaf.entryAmount || getEntryName(leaf.entries[position]) != name) {
+        return true;
+    }
+    std::copy(leaf.entries + position + 1, leaf.entries + leaf.entryAmount, leaf.entries + position);
+    leaf.entries[--leaf.entryAmount] = DirectoryEntry();
+    header.entryAmount--;
+    return transferDirectory(handle, path.back().first * DIRECTORY_NODE_SIZE, &leaf, sizeof(leaf), true)
+        && transferDirectory(handle, 0, &header, sizeof(header), true);
+}
+
+// Enters a file in the directory holding it, the root and hidden files are in none
+bool Volume::linkEntry(size_t index) {
+    std::string_view name = iNodes.at(index).fileName;
+    if (name.empty() || name.starts_with(SNAPSHOT_PREFIX)) {
+        return true;
+    }
+    size_t parent = findINode(getParentPath(name));
+    return parent != NO_INODE && insertEntry(parent, getBaseName(name), index);
+}
+
+bool Volume::unlinkEntry(std::string_view name) {
+    if (name.empty() || name.starts_with(SNAPSHOT_PREFIX)) {
+        return true;
+    }
+    size_t parent = findINode(getParentPath(name));
+    return parent == NO_INODE || removeEntry(parent, getBaseName(name));
+}
+
+// Follows a path from the root through the index of every directory on it, reading a few nodes on every level
+// however many entries the directories hold. Opens look names up in memory instead.
+size_t Volume::resolvePath(std::string_view path) {
+    size_t index = findINode("");
+    while (index != NO_INODE && !path.empty()) {
+        if (!isDirectory(index)) {
+            return NO_INODE;
+        }
+        size_t slash = path.find('/');
+        index = findEntry(index, path.substr(0, slash));
+        path = slash == std::string_view::npos ? std::string_view() : path.substr(slash + 1);
+    }
+    return index;
+}
+
+VfsError Volume::createDirectory(std::string_view path) {
+    return isReadOnly() ? VfsError::ReadOnly : finishChange(createDirectoryUnsynced(path));
+}
+
+VfsError Volume::createDirectoryUnsynced(std::string_view path) {
+    ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, LockMode::Allocating);
+    if (!metadataGuard.isLocked()) {
+        return VfsError::IoError;
+    }
+    VfsError error = refresh();
+    if (error != VfsError::None) {
+        return error;
+    }
+    std::unique_lock<std::shared_mutex> guard(namespaceLock);
+
+    path = trimPath(path);
+    return path.empty() || path.starts_with(SNAPSHOT_PREFIX) ? VfsError::InvalidName : createDirectoryINode(path, guard);
+}
+
+VfsError Volume::removeDirectory(std::string_view path) {
+    return isReadOnly() ? VfsError::ReadOnly : finishChange(removeDirectoryUnsynced(path));
+}
+
+VfsError Volume::removeDirectoryUnsynced(std::string_view path) {
+    ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, true);
+    if (!metadataGuard.isLocked()) {
+        return VfsError::IoError;
+    }
+    VfsError error = refresh();
+    if (error != VfsError::None) {
+        return error;
+    }
+    std::unique_lock<std::shared_mutex> guard(namespaceLock);
+
+    // The root stays, it is only ever created
+    path = trimPath(path);
+    size_t iNodeIndex = path.empty() || path.starts_with(SNAPSHOT_PREFIX) ? NO_INODE : findINode(path);
+    if (iNodeIndex == NO_INODE) {
+        return VfsError::NotFound;
+    }
+    if (!isDirectory(iNodeIndex)) {
+        return VfsError::NotDirectory;
+    }
+    FileHandle handle;
+    DirectoryHeader header;
+    if (!fillHandle(iNodeIndex, handle) || !transferDirectory(handle, 0, &header, sizeof(header), false)) {
+        return VfsError::IoError;
+    }
+    if (header.entryAmount > 0) {
+        return VfsError::DirectoryNotEmpty;
+    }
+    if (!beginMetadataChange()) {
+        return VfsError::IoError;
+    }
+    return removeINode(iNodeIndex);
+}
+
+VfsError Volume::listDirectory(std::string_view path, std::vector<FileInfo>& entries) {
+    entries.clear();
+    ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, false);
+    if (!metadataGuard.isLocked()) {
+        return VfsError::IoError;
+    }
+    VfsError error = refresh();
+    if (error != VfsError::None) {
+        return error;
+    }
+    std::shared_lock<std::shared_mutex> guard(namespaceLock);
+
+    // A volume nothing was created on has no root yet
+    path = trimPath(path);
+    size_t iNodeIndex = resolvePath(path);
+    if (iNodeIndex == NO_INODE) {
+        return path.empty() ? VfsError::None : VfsError::NotFound;
+    }
+    if (!isDirectory(iNodeIndex)) {
+        return VfsError::NotDirectory;
+    }
+
+    // The leftmost leaf holds the first names, every leaf links to the next one
+    FileHandle handle;
+    DirectoryHeader header;
+    DirectoryNode node;
+    std::vector<std::pair<uint64_t, size_t>> nodes;
+    if (!fillHandle(iNodeIndex, handle) || !transferDirectory(handle, 0, &header, sizeof(header), false) || !findLeaf(handle, header, "", node, nodes)) {
+        return VfsError::IoError;
+    }
+    for (size_t leaves = 1;; leaves++) {
+        for (size_t i = 0; i < node.entryAmount; i++) {
+            auto it = iNodes.find(node.entries[i].target);
+            if (it != iNodes.end()) {
+                entries.push_back({std::string(getEntryName(node.entries[i])), it->second.fileSize, 0, isDirectory(it->first)});
+            }
+        }
+        if (node.nextLeaf == 0) {
+            return VfsError::None;
+        }
+        if (node.nextLeaf >= header.nodeAmount || leaves > header.nodeAmount
+            || !transferDirectory(handle, node.nextLeaf * DIRECTORY_NODE_SIZE, &node, sizeof(node), false)
+            || node.entryAmount > DIRECTORY_NODE_ENTRIES) {
+            return VfsError::IoError;
+        }
+    }
+}
+
+VfsError Volume::read(const FileHandle& handle, size_t offset, std::span<std::byte> buffer, size_t& bytesRead) {
+    TraceScope traceScope(trace.get(), TRACE_READ, {}, handle.iNode, offset, buffer.size());
+    bytesRead = 0;
+    if (!handle.open) {
+        return VfsError::InvalidHandle;
+    }
+    if (offset >= handle.size) {
+        return VfsError::None;
+    }
+
+    size_t length = std::min(buffer.size(), handle.size - offset);
+    VfsError error = transfer(handle, offset, buffer.data(), length, false);
+    if (error == VfsError::None) {
+        bytesRead = length;
+    }
+    return error;
+}
+
+VfsError Volume::write(FileHandle& handle, size_t offset, std::span<const std::byte> data, size_t& bytesWritten) {
+    return isReadOnly() ? VfsError::ReadOnly : finishChange(writeUnsynced(handle, offset, data, bytesWritten));
+}
+
+VfsError Volume::writeUnsynced(FileHandle& handle, size_t offset, std::span<const std::byte> data, size_t& bytesWritten, size_t* bytesCopied) {
+    TraceScope traceScope(trace.get(), TRACE_WRITE, {}, handle.iNode, offset, data.size());
+    bytesWritten = 0;
+    if (!handle.open) {
+        return VfsError::InvalidHandle;
+    }
+    if (offset + data.size() > handle.size) {
+        return VfsError::OutOfRange;
+    }
+    if (data.empty()) {
+        return VfsError::None;
+    }
+
+    // Only the chain can be shared, the tail always belongs to the file alone
+    size_t chainBytes = handle.size - handle.tailLength;
+    size_t lastBlock = (std::min(offset + data.size(), chainBytes) - 1) / BLOCK_SIZE;
+    if (offset < chainBytes && lastBlock >= handle.sharedBlock) {
+        VfsError error = unshareBlocks(handle, lastBlock, bytesCopied);
+        if (error != VfsError::None) {
+            return error;
+        }
+    }
+
+    VfsError error = transfer(handle, offset, const_cast<std::byte*>(data.data()), data.size(), true);
+    if (error == VfsError::None) {
+        bytesWritten = data.size();
+    }
+    return error;
+}
+
+// Gives the file private copies of its shared blocks up to `lastBlock`, the rest of the chain stays shared.
+// Run records are kept in the blocks and only the end of a chain is shared. So every block from the first
+// shared one to `lastBlock` is copied, even when only the last of them is written.
+// The bytes of the copies are added to `bytesCopied` when given.
+// The handle lets its file lock go while it waits for the metadata, a clone or a snapshot holding the
+// metadata may be waiting for that lock.
+VfsError Volume::unshareBlocks(FileHandle& handle, size_t lastBlock, size_t* bytesCopied) {
+    VFS_PHASE(PHASE_ALLOCATION);
+    imageLocks.release(1 + handle.iNode);
+    ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, true);
+    // Nothing else may hold the file lock exclusively while the metadata is held, so this never waits
+    if (!metadataGuard.isLocked() || !imageLocks.acquire(1 + handle.iNode, false)) {
+        handle.open = false;
+        handle.extents.clear();
+        return VfsError::IoError;
+    }
+    VfsError error = refresh();
+    if (error != VfsError::None) {
+        return error;
+    }
+    std::unique_lock<std::shared_mutex> guard(namespaceLock);
+    if (isINodeFree(handle.iNode)) {
+        return VfsError::InvalidHandle;
+    }
+
+    // Another owner may have let the blocks go since the file was opened
+    std::vector<Extent> extents;
+    size_t sharedBlock;
+    if (!getFileExtents(handle.iNode, extents, &sharedBlock)) {
+        return VfsError::IoError;
+    }
+    if (lastBlock < sharedBlock) {
+        setHandleExtents(handle, extents, sharedBlock);
+        return VfsError::None;
+    }
+
+    if (lastBlock - sharedBlock + 1 > getAmountOfFreeDataBlocks()) {
+        return VfsError::NoSpace;
+    }
+    if (!beginMetadataChange()) {
+        return VfsError::IoError;
+    }
+    size_t copiesAmount = lastBlock - sharedBlock + 1;
+    error = copySharedBlocks(handle.iNode, extents, sharedBlock, lastBlock);
+    if (error == VfsError::None) {
+        setHandleExtents(handle, extents, sharedBlock);
+        if (bytesCopied != nullptr) {
+            *bytesCopied += copiesAmount * BLOCK_SIZE;
+        }
+    }
+    return error;
+}
+
+// Replaces the shared blocks of a file up to `lastBlock` with private copies and collects its runs again.
+// The metadata must be held exclusively and its change begun.
+VfsError Volume::copySharedBlocks(size_t index, std::vector<Extent>& extents, size_t& sharedBlock, size_t lastBlock) {
+    size_t copiesAmount = lastBlock - sharedBlock + 1;
+    INode& iNode = iNodes[index];
+    std::vector<Extent> copies = allocateDataBlocks(getINodeGroup(index), copiesAmount);
+    if (copies.empty()) {
+        return VfsError::IoError;
+    }
+    std::vector<Extent> originals = sliceExtents(extents, sharedBlock, lastBlock);
+    std::vector<char> data(BLOCK_SIZE);
+    auto copy = copies.begin();
+    size_t inCopy = 0;
+    for (Extent original : originals) {
+        for (size_t i = 0; i < original.length; i++) {
+            if (inCopy == copy->length) {
+                ++copy;
+                inCopy = 0;
+            }
+            if (!readAt(data.data(), BLOCK_SIZE, calculateDataBlockOffsetFromIndex(original.start + i))
+                || !writeAt(data.data(), BLOCK_SIZE, calculateDataBlockOffsetFromIndex(copy->start + inCopy))) {
+                return VfsError::IoError;
+            }
+            inCopy++;
+        }
+    }
+
+    // Finding the runs the copies go in between, a run keeps its file block in `fileBlock`
+    Extent previous = {0, 0};
+    Extent rest = {0, 0};
+    size_t previousFileBlock = 0;
+    size_t fileBlock = 0;
+    for (Extent extent : extents) {
+        if (fileBlock < sharedBlock) {
+            previous = extent;
+            previousFileBlock = fileBlock;
+        }
+        if (fileBlock <= lastBlock + 1 && lastBlock + 1 < fileBlock + extent.length) {
+            rest = {extent.start + lastBlock + 1 - fileBlock, fileBlock + extent.length - lastBlock - 1};
+            // The rest is entered in the middle of a run now, so it gets a record of its own
+            // with the part of the run left past it. Other owners may go further than this file.
+            if (rest.start != extent.start) {
+                uint64_t run;
+                if (!readAt(&run, sizeof(run), calculateDataBlockOffsetFromIndex(extent.start) + offsetof(DataBlock, run))
+                    || !writeRun(rest.start, decodeRunLength(run) - (rest.start - extent.start), decodeNextBlock(run))) {
+                    return VfsError::IoError;
+                }
+            }
+        }
+        fileBlock += extent.length;
+    }
+
+    // The last copy continues with the blocks still shared
+    if (!linkBlocks(copies, rest.length == 0 ? 0 : rest.start)) {
+        return VfsError::IoError;
+    }
+    if (sharedBlock == 0) {
+        iNode.firstBlock = copies.front().start;
+        if (!writeINode(index)) {
+            return VfsError::IoError;
+        }
+    } else if (!writeRun(previous.start, sharedBlock - previousFileBlock, copies.front().start)) {
+        return VfsError::IoError;
+    }
+
+    // The originals keep their other owners, so this only counts them down
+    for (Extent original : originals) {
+        if (!releaseDataBlocks(original)) {
+            return VfsError::IoError;
+        }
+    }
+    return getFileExtents(index, extents, &sharedBlock) ? VfsError::None : VfsError::IoError;
+}
+
+// Gives a file the blocks for `size` bytes, taking new ones at the end of its chain or letting the last ones go.
+// A tail is moved to the room its new length needs, bytes moving between the chain and the tail are kept.
+// The metadata and the file must be held exclusively.
+VfsError Volume::resizeINode(size_t index, size_t size, size_t* bytesCopied) {
+    INode& iNode = iNodes[index];
+    size_t oldChainBytes = iNode.fileSize - iNode.tailLength;
+    size_t newTailLength = calculateTailLength(size);
+    size_t oldBlocks = calculateBlocksAmount(oldChainBytes);
+    size_t newBlocks = calculateBlocksAmount(size - newTailLength);
+    std::vector<Extent> extents;
+    size_t sharedBlock;
+    if (!getFileExtents(index, extents, &sharedBlock)) {
+        return VfsError::IoError;
+    }
+
+    // Growing writes the record of the last run, so a shared one is copied first
+    size_t copiesAmount = newBlocks > oldBlocks && sharedBlock < oldBlocks ? oldBlocks - sharedBlock : 0;
+    size_t tailBlocks = newTailLength > 0 && !fragments.fits(newTailLength) ? 1 : 0;
+    if ((newBlocks > oldBlocks ? newBlocks - oldBlocks + copiesAmount : 0) + tailBlocks > getAmountOfFreeDataBlocks()) {
+        return VfsError::NoSpace;
+    }
+    if (!beginMetadataChange()) {
+        return VfsError::IoError;
+    }
+
+    // Bytes kept by the file that move between the chain and the tail, less than a block either way
+    size_t movedStart = std::min(oldChainBytes, size - newTailLength);
+    size_t movedEnd = std::min(iNode.fileSize, size);
+    std::vector<std::byte> moved(movedEnd > movedStart ? movedEnd - movedStart : 0);
+    FileHandle old;
+    if (!moved.empty() && (!fillHandle(index, old) || transfer(old, movedStart, moved.data(), moved.size(), false) != VfsError::None)) {
+        return VfsError::IoError;
+    }
+
+    if (newBlocks < oldBlocks) {
+        // Blocks past the end are never followed, so the record of the new last run is left as it is
+        for (Extent extent : sliceExtents(extents, newBlocks, oldBlocks - 1)) {
+            if (!releaseDataBlocks(extent)) {
+                return VfsError::IoError;
+            }
+        }
+        if (newBlocks == 0) {
+            iNode.firstBlock = 0;
+        }
+    } else if (newBlocks > oldBlocks) {
+        if (copiesAmount > 0) {
+            VfsError error = copySharedBlocks(index, extents, sharedBlock, oldBlocks - 1);
+            if (error != VfsError::None) {
+                return error;
+            }
+        }
+
+        // Continuing in the group of the last block, so the file stays close together
+        size_t lastOldBlock = extents.empty() ? 0 : extents.back().start + extents.back().length - 1;
+        size_t group = extents.empty() ? getINodeGroup(index) : lastOldBlock / superBlock.blocksPerGroup;
+        std::vector<Extent> added = allocateDataBlocks(group, newBlocks - oldBlocks);
+        if (added.empty() || !linkBlocks(added, 0)) {
+            return VfsError::IoError;
+        }
+        if (extents.empty()) {
+            iNode.firstBlock = added.front().start;
+        } else if (!writeRun(extents.back().start, extents.back().length, added.front().start)) {
+            return VfsError::IoError;
+        }
+    }
+
+    iNode.fileSize = size;
+    if (!releaseTail(iNode) || (newTailLength > 0 && !allocateTail(iNode, newTailLength, getINodeGroup(index))) || !writeINode(index)) {
+        return VfsError::IoError;
+    }
+    FileHandle resized;
+    if (!moved.empty() && (!fillHandle(index, resized) || transfer(resized, movedStart, moved.data(), moved.size(), true) != VfsError::None)) {
+        return VfsError::IoError;
+    }
+    if (bytesCopied != nullptr) {
+        *bytesCopied += copiesAmount * BLOCK_SIZE + moved.size();
+    }
+    return VfsError::None;
+}
+
+
+VfsError Volume::copyFileIn(const std::string& hostPath, std::string_view name) {
+    int hostFile = ::open(hostPath.c_str(), O_RDONLY);
+    if (hostFile < 0) {
+        return VfsError::HostIoError;
+    }
+
+    VfsError error = copyFileIn(hostFile, name);
+    ::close(hostFile);
+    return error;
+}
+
+VfsError Volume::copyFileOut(std::string_view name, const std::string& hostPath) {
+    // Looking the file up first, so a missing file leaves no host file behind
+    FileHandle handle;
+    VfsError error = openFile(name, handle);
+    if (error != VfsError::None) {
+        return error;
+    }
+
+    int hostFile = ::open(hostPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (hostFile < 0) {
+        closeFile(handle);
+        return VfsError::HostIoError;
+    }
+    error = copyFileOut(handle, hostFile);
+    closeFile(handle);
+    ::close(hostFile);
+    return error;
+}
+
+VfsError Volume::copyFileIn(int hostFile, std::string_view name) {
+    return isReadOnly() ? VfsError::ReadOnly : finishChange(copyFileInUnsynced(hostFile, name));
+}
+
+VfsError Volume::copyFileInUnsynced(int hostFile, std::string_view name) {
+    struct stat hostStat;
+    FileHandle handle;
+    VfsError error = fstat(hostFile, &hostStat) == 0 ? createFileUnsynced(name, hostStat.st_size, handle) : VfsError::HostIoError;
+    if (error != VfsError::None) {
+        closeFile(handle);
+        return error;
+    }
+
+    // A new file shares no blocks, so its chunks are written side by side
+    size_t chunks = (handle.size + COPY_BUFFER_SIZE - 1) / COPY_BUFFER_SIZE;
+    size_t threads = calculateCopyThreads(chunks);
+    std::atomic<size_t> nextChunk = 0;
+    std::atomic<VfsError> firstError = VfsError::None;
+
+    auto copyChunks = [&]() {
+        std::vector<std::byte> buffer(std::min<size_t>(COPY_BUFFER_SIZE, std::max<size_t>(handle.size, 1)));
+        size_t chunk;
+        while (firstError == VfsError::None && (chunk = nextChunk++) < chunks) {
+            size_t offset = chunk * COPY_BUFFER_SIZE;
+            size_t length = std::min(buffer.size(), handle.size - offset);
+            ssize_t result;
+            {
+                VFS_PHASE(PHASE_HOST);
+                result = pread(hostFile, buffer.data(), length, offset);
+            }
+            size_t bytesWritten;
+            VfsError chunkError = result == ssize_t(length)
+                ? writeUnsynced(handle, offset, std::span<const std::byte>(buffer.data(), length), bytesWritten)
+                : VfsError::HostIoError;
+            if (chunkError != VfsError::None) {
+                VfsError expected = VfsError::None;
+                firstError.compare_exchange_strong(expected, chunkError);
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads; i++) {
+        workers.emplace_back(copyChunks);
+    }
+    copyChunks();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    closeFile(handle);
+    return firstError;
+}
+
+VfsError Volume::updateFile(const std::string& hostPath, std::string_view name, size_t& bytesWritten) {
+    bytesWritten = 0;
+    int hostFile = ::open(hostPath.c_str(), O_RDONLY);
+    if (hostFile < 0) {
+        return VfsError::HostIoError;
+    }
+
+    VfsError error = updateFile(hostFile, name, bytesWritten);
+    ::close(hostFile);
+    return error;
+}
+
+// Compares the host file with the stored one block by block and writes only the runs of blocks that differ.
+// A block is only compared with the one at the same offset, writing in place cannot move the data of a block,
+// so an insertion or a removal shifting the data rewrites everything after it.
+VfsError Volume::updateFile(int hostFile, std::string_view name, size_t& bytesWritten) {
+    return isReadOnly() ? VfsError::ReadOnly : finishChange(updateFileUnsynced(hostFile, name, bytesWritten));
+}
+
+VfsError Volume::updateFileUnsynced(int hostFile, std::string_view name, size_t& bytesWritten) {
+    bytesWritten = 0;
+    struct stat hostStat;
+    if (fstat(hostFile, &hostStat) != 0) {
+        return VfsError::HostIoError;
+    }
+    size_t size = hostStat.st_size;
+
+    FileHandle handle;
+    {
+        ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, true);
+        if (!metadataGuard.isLocked()) {
+            return VfsError::IoError;
+        }
+        VfsError error = refresh();
+        if (error != VfsError::None) {
+            return error;
+        }
+        std::unique_lock<std::shared_mutex> guard(namespaceLock);
+
+        size_t iNodeIndex = name.starts_with(SNAPSHOT_PREFIX) ? NO_INODE : findINode(name);
+        if (iNodeIndex == NO_INODE) {
+            return VfsError::NotFound;
+        }
+        if (isDirectory(iNodeIndex)) {
+            return VfsError::IsDirectory;
+        }
+        if (iNodes[iNodeIndex].fileSize != size) {
+            // Waiting for the handles of the file, its chain is about to change
+            ImageLockGuard fileGuard(imageLocks, 1 + iNodeIndex, true);
+            error = fileGuard.isLocked() ? resizeINode(iNodeIndex, size, &bytesWritten) : VfsError::IoError;
+            if (error != VfsError::None) {
+                return error;
+            }
+        }
+        if (!fillHandle(iNodeIndex, handle)) {
+            return VfsError::IoError;
+        }
+        guard.unlock();
+
+        // Opened before the metadata is let go, so the file compared is the one found and resized
+        if (!imageLocks.acquire(1 + iNodeIndex, false)) {
+            return VfsError::IoError;
+        }
+        handle.open = true;
+        recordAccess(iNodeIndex);
+    }
+
+    VfsError error = VfsError::None;
+    std::vector<std::byte> hostBuffer(std::min<size_t>(COPY_BUFFER_SIZE, std::max<size_t>(handle.size, 1)));
+    std::vector<std::byte> storedBuffer(hostBuffer.size());
+    size_t offset = 0;
+    while (error == VfsError::None && offset < handle.size) {
+        size_t length = std::min(hostBuffer.size(), handle.size - offset);
+        ssize_t result;
+        {
+            VFS_PHASE(PHASE_HOST);
+            result = pread(hostFile, hostBuffer.data(), length, offset);
+        }
+        if (result != ssize_t(length)) {
+            error = VfsError::HostIoError;
+            break;
+        }
+        size_t bytesRead;
+        error = read(handle, offset, std::span<std::byte>(storedBuffer.data(), length), bytesRead);
+        if (error == VfsError::None && bytesRead != length) {
+            error = VfsError::IoError;
+        }
+
+        // Chunks are whole blocks apart from the end of the file, so blocks of the chunk are blocks of the file
+        size_t blocksAmount = calculateBlocksAmount(length);
+        size_t runStart = length;
+        for (size_t i = 0; error == VfsError::None && i <= blocksAmount; i++) {
+            size_t start = std::min(i * BLOCK_SIZE, length);
+            bool changed = i < blocksAmount && memcmp(&hostBuffer[start], &storedBuffer[start], std::min<size_t>(BLOCK_SIZE, length - start)) != 0;
+            if (changed && runStart == length) {
+                runStart = start;
+            } else if (!changed && runStart != length) {
+                size_t written;
+                error = writeUnsynced(handle, offset + runStart, std::span<const std::byte>(&hostBuffer[runStart], start - runStart), written, &bytesWritten);
+                bytesWritten += written;
+                runStart = length;
+            }
+        }
+        offset += length;
+    }
+
+    closeFile(handle);
+    return error;
+}
+
+// Takes an INode for every new file, in a chunk of its preferred group when one there has an INode left.
+// Every chunk bitmap touched and the superblock are written once.
+bool Volume::allocateINodes(const std::vector<size_t>& preferredGroups, std::vector<size_t>& indexes) {
+    VFS_PHASE(PHASE_ALLOCATION);
+    indexes.clear();
+    std::map<size_t, std::pair<size_t, size_t>> touched;
+    for (size_t preferredGroup : preferredGroups) {
+        size_t index = takeINode(preferredGroup);
+        if (index == NO_INODE) {
+            return false;
+        }
+        size_t localIndex = index % INODES_PER_CHUNK;
+        auto [it, inserted] = touched.try_emplace(index / INODES_PER_CHUNK, localIndex, localIndex);
+        it->second = {std::min(it->second.first, localIndex), std::max(it->second.second, localIndex)};
+        indexes.push_back(index);
+    }
+
+    for (auto [chunk, range] : touched) {
+        if (!writeBitmapWords(calculateDataBlockOffsetFromIndex(chunks[chunk].firstBlock), chunks[chunk].bitmap, range.first, range.second)) {
+            return false;
+        }
+    }
+    std::lock_guard<std::mutex> guard(superBlockLock);
+    return writeSuperBlock();
+}
+
+// Writes the files one after another into the blocks of `extents`, staging whole blocks with their run
+// records so every contiguous stretch of blocks goes out in large writes. Tails go to the places taken
+// in `created`, the ones following each other in a fragment block are written at once.
+VfsError Volume::streamImport(const std::vector<ImportEntry*>& files, const std::vector<Extent>& extents, const std::vector<INode>& created) {
+    std::vector<DataBlock> staged(IMPORT_BUFFER_BLOCKS);
+    size_t stagedStart = 0;
+    size_t stagedAmount = 0;
+    auto flush = [&]() {
+        VFS_PHASE(PHASE_DATA);
+        bool written = stagedAmount == 0
+            || writeAt(staged.data(), stagedAmount * sizeof(DataBlock), calculateDataBlockOffsetFromIndex(stagedStart));
+        stagedAmount = 0;
+        return written;
+    };
+
+    std::vector<char> tails;
+    size_t tailsStart = 0;
+    auto flushTails = [&]() {
+        VFS_PHASE(PHASE_DATA);
+        bool written = tails.empty() || writeAt(tails.data(), tails.size(), tailsStart);
+        tails.clear();
+        return written;
+    };
+
+    std::vector<char> buffer(COPY_BUFFER_SIZE);
+    auto extent = extents.begin();
+    size_t inExtent = 0;
+    auto nextBlock = [&]() {
+        if (inExtent == extent->length) {
+            ++extent;
+            inExtent = 0;
+        }
+        return extent->start + inExtent++;
+    };
+
+    for (size_t fileIndex = 0; fileIndex < files.size(); fileIndex++) {
+        ImportEntry* file = files[fileIndex];
+        size_t tailLength = created[fileIndex].tailLength;
+        size_t blocksAmount = calculateBlocksAmount(file->size - tailLength);
+        if (blocksAmount == 0 && tailLength == 0) {
+            continue;
+        }
+        int hostFile = ::open(file->hostPath.c_str(), O_RDONLY);
+        if (hostFile < 0) {
+            return VfsError::HostIoError;
+        }
+
+        size_t done = 0;
+        size_t buffered = 0;
+        size_t bufferStart = 0;
+        // Refills the host buffer with whole blocks once it is used up
+        auto refill = [&]() {
+            if (done != bufferStart + buffered) {
+                return true;
+            }
+            bufferStart = done;
+            size_t length = std::min(buffer.size(), file->size - done);
+            ssize_t result;
+            {
+                VFS_PHASE(PHASE_HOST);
+                result = pread(hostFile, buffer.data(), length, done);
+            }
+            buffered = length;
+            return result == ssize_t(length);
+        };
+
+        size_t block = blocksAmount > 0 ? nextBlock() : 0;
+        // Blocks of the file left in the current run, its record goes into the first of them
+        size_t leftInRun = 0;
+        for (size_t i = 0; i < blocksAmount; i++) {
+            if (!refill()) {
+                ::close(hostFile);
+                return VfsError::HostIoError;
+            }
+
+            if (stagedAmount > 0 && (block != stagedStart + stagedAmount || stagedAmount == staged.size())) {
+                if (!flush()) {
+                    ::close(hostFile);
+                    return VfsError::IoError;
+                }
+            }
+            if (stagedAmount == 0) {
+                stagedStart = block;
+            }
+            DataBlock& dataBlock = staged[stagedAmount++];
+            size_t length = std::min<size_t>(BLOCK_SIZE, file->size - done);
+            memcpy(dataBlock.data, &buffer[done - bufferStart], length);
+            memset(dataBlock.data + length, 0, BLOCK_SIZE - length);
+            done += length;
+
+            dataBlock.run = 0;
+            if (leftInRun == 0) {
+                leftInRun = std::min(extent->start + extent->length - block, blocksAmount - i);
+                size_t following = i + leftInRun < blocksAmount ? std::next(extent)->start : 0;
+                dataBlock.run = encodeRun(leftInRun, following);
+            }
+            leftInRun--;
+            block = i + 1 < blocksAmount ? nextBlock() : 0;
+        }
+
+        if (tailLength > 0) {
+            if (!refill()) {
+                ::close(hostFile);
+                return VfsError::HostIoError;
+            }
+            size_t tailStart = calculateTailStart(created[fileIndex]);
+            if (!tails.empty() && tailStart != tailsStart + tails.size() && !flushTails()) {
+                ::close(hostFile);
+                return VfsError::IoError;
+            }
+            if (tails.empty()) {
+                tailsStart = tailStart;
+            }
+            // Padded to whole units, so the next tail of the block continues the same write
+            tails.insert(tails.end(), &buffer[done - bufferStart], &buffer[done - bufferStart] + tailLength);
+            tails.resize(tails.size() + (FRAGMENT_UNIT_SIZE - tailLength % FRAGMENT_UNIT_SIZE) % FRAGMENT_UNIT_SIZE, 0);
+        }
+        ::close(hostFile);
+    }
+    return flush() && flushTails() ? VfsError::None : VfsError::IoError;
+}
+
+VfsError Volume::importFiles(std::vector<ImportEntry>& entries, ImportOrder order) {
+    return isReadOnly() ? VfsError::ReadOnly : finishChange(importFilesUnsynced(entries, order));
+}
+
+VfsError Volume::importFilesUnsynced(std::vector<ImportEntry>& entries, ImportOrder order) {
+    // Sizes are taken before anything is locked, the layout is planned from them
+    for (ImportEntry& entry : entries) {
+        struct stat hostStat;
+        entry.error = stat(entry.hostPath.c_str(), &hostStat) == 0 ? VfsError::None : VfsError::HostIoError;
+        entry.size = entry.error == VfsError::None ? hostStat.st_size : 0;
+    }
+    std::stable_sort(entries.begin(), entries.end(), [order](const ImportEntry& a, const ImportEntry& b) {
+        return order == ImportOrder::Size ? a.size < b.size : a.name < b.name;
+    });
+
+    ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, true);
+    if (!metadataGuard.isLocked()) {
+        return VfsError::IoError;
+    }
+    VfsError error = refresh();
+    if (error != VfsError::None) {
+        return error;
+    }
+    std::unique_lock<std::shared_mutex> guard(namespaceLock);
+
+    std::vector<ImportEntry*> files;
+    std::unordered_set<std::string_view> names;
+    size_t blocksAmount = 0;
+    for (ImportEntry& entry : entries) {
+        if (entry.error != VfsError::None) {
+            continue;
+        }
+        if (entry.name.starts_with(SNAPSHOT_PREFIX) || findINode(entry.name) != NO_INODE || !names.insert(entry.name).second) {
+            entry.error = VfsError::AlreadyExists;
+            continue;
+        }
+        entry.error = checkPath(entry.name);
+        if (entry.error != VfsError::None) {
+            continue;
+        }
+        files.push_back(&entry);
+        blocksAmount += calculateBlocksAmount(entry.size - calculateTailLength(entry.size));
+    }
+    if (files.empty()) {
+        return VfsError::None;
+    }
+    size_t chunkBlocks = calculateChunksNeeded(files.size()) * INODE_CHUNK_BLOCKS;
+    if (chunkBlocks > getAmountOfFreeDataBlocks()) {
+        return VfsError::NoFreeINodes;
+    }
+    if (blocksAmount + chunkBlocks > getAmountOfFreeDataBlocks()) {
+        return VfsError::NoSpace;
+    }
+    if (!beginMetadataChange()) {
+        return VfsError::IoError;
+    }
+    // Directories made for files that are not imported after all go again, the deepest first
+    std::vector<size_t> createdParents(files.size(), 0);
+    auto removeAllParents = [&]() {
+        for (size_t i = files.size(); i-- > 0;) {
+            removeParents(files[i]->name, createdParents[i]);
+        }
+    };
+    for (size_t i = 0; i < files.size(); i++) {
+        error = createParents(files[i]->name, guard, createdParents[i]);
+        if (error != VfsError::None) {
+            removeAllParents();
+            return error;
+        }
+    }
+
+    size_t group = chooseGroup(blocksAmount);
+    std::vector<Extent> extents = allocateDataBlocks(group, blocksAmount);
+    if (extents.empty() && blocksAmount > 0) {
+        removeAllParents();
+        return VfsError::IoError;
+    }
+    // Tails are placed before the stream starts, so it knows where to write them
+    std::vector<INode> created(files.size());
+    for (size_t i = 0; i < files.size() && error == VfsError::None; i++) {
+        size_t tailLength = calculateTailLength(files[i]->size);
+        if (tailLength > 0 && !allocateTail(created[i], tailLength, group)) {
+            error = VfsError::NoSpace;
+        }
+    }
+    if (error == VfsError::None) {
+        error = streamImport(files, extents, created);
+    }
+    if (error != VfsError::None) {
+        for (Extent extent : extents) {
+            // Split at group boundaries, a run of the allocation never crosses one
+            releaseDataBlocks(extent);
+        }
+        for (INode& iNode : created) {
+            releaseTail(iNode);
+        }
+        removeAllParents();
+        return error;
+    }
+
+    // Every file keeps its INode in the group of its first block
+    std::vector<size_t> preferredGroups;
+    std::vector<size_t> firstBlocks;
+    size_t fileBlock = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        size_t fileBlocks = calculateBlocksAmount(files[i]->size - created[i].tailLength);
+        std::vector<Extent> slice = fileBlocks == 0 ? std::vector<Extent>() : sliceExtents(extents, fileBlock, fileBlock + fileBlocks - 1);
+        size_t firstBlock = slice.empty() ? (extents.empty() ? group * superBlock.blocksPerGroup : extents.front().start) : slice.front().start;
+        preferredGroups.push_back(firstBlock / superBlock.blocksPerGroup);
+        firstBlocks.push_back(slice.empty() ? 0 : firstBlock);
+        fileBlock += fileBlocks;
+    }
+    std::vector<size_t> indexes;
+    if (!allocateINodes(preferredGroups, indexes)) {
+        removeAllParents();
+        return VfsError::IoError;
+    }
+
+    for (size_t i = 0; i < files.size(); i++) {
+        INode& iNode = iNodes[indexes[i]];
+        iNode = created[i];
+        strncpy(iNode.fileName, files[i]->name.c_str(), sizeof(iNode.fileName) - 1);
+        iNode.fileSize = files[i]->size;
+        iNode.firstBlock = firstBlocks[i];
+        nameIndex.emplace(iNode.fileName, indexes[i]);
+    }
+
+    // INodes taken one after another in a group lie next to each other, so they are written in runs
+    VFS_PHASE(PHASE_METADATA);
+    std::sort(indexes.begin(), indexes.end());
+    std::vector<INode> run;
+    for (size_t i = 0; i < indexes.size();) {
+        size_t end = i + 1;
+        while (end < indexes.size() && indexes[end] == indexes[end - 1] + 1 && indexes[end] % INODES_PER_CHUNK != 0) {
+            end++;
+        }
+        run.clear();
+        for (size_t j = i; j < end; j++) {
+            run.push_back(iNodes[indexes[j]]);
+        }
+        if (!writeAt(run.data(), run.size() * sizeof(INode), calculateINodeOffset(indexes[i]), true)) {
+            return VfsError::IoError;
+        }
+        i = end;
+    }
+    for (size_t index : indexes) {
+        if (!linkEntry(index)) {
+            return VfsError::IoError;
+        }
+    }
+    return VfsError::None;
+}
+
+VfsError Volume::copyFileOut(std::string_view name, int hostFile) {
+    FileHandle handle;
+    VfsError error = openFile(name, handle);
+    if (error != VfsError::None) {
+        return error;
+    }
+    error = copyFileOut(handle, hostFile);
+    closeFile(handle);
+    return error;
+}
+
+// Sizes the host file up front, then copies buffer sized chunks taken in turn by several threads,
+// each reading its chunk and writing it at the same host offset
+VfsError Volume::copyFileOut(const FileHandle& handle, int hostFile) {
+    {
+        VFS_PHASE(PHASE_HOST);
+        if (ftruncate(hostFile, handle.size) != 0) {
+            return VfsError::HostIoError;
+        }
+        // Not every host file system can preallocate, the file is already sized anyway
+        if (handle.size > 0) {
+            posix_fallocate(hostFile, 0, handle.size);
+        }
+    }
+
+    size_t chunks = (handle.size + COPY_BUFFER_SIZE - 1) / COPY_BUFFER_SIZE;
+    size_t threads = calculateCopyThreads(chunks);
+    std::atomic<size_t> nextChunk = 0;
+    std::atomic<VfsError> firstError = VfsError::None;
+
+    auto copyChunks = [&]() {
+        std::vector<std::byte> buffer(std::min<size_t>(COPY_BUFFER_SIZE, std::max<size_t>(handle.size, 1)));
+        size_t chunk;
+        while (firstError == VfsError::None && (chunk = nextChunk++) < chunks) {
+            size_t offset = chunk * COPY_BUFFER_SIZE;
+            size_t bytesRead;
+            VfsError error = read(handle, offset, buffer, bytesRead);
+            if (error == VfsError::None) {
+                VFS_PHASE(PHASE_HOST);
+                if (pwrite(hostFile, buffer.data(), bytesRead, offset) != ssize_t(bytesRead)) {
+                    error = VfsError::HostIoError;
+                }
+            }
+            if (error != VfsError::None) {
+                VfsError expected = VfsError::None;
+                firstError.compare_exchange_strong(expected, error);
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads; i++) {
+        workers.emplace_back(copyChunks);
+    }
+    copyChunks();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    return firstError;
+}
+
+static bool writeAll(int file, const void* buffer, size_t size) {
+    const char* data = static_cast<const char*>(buffer);
+    while (size > 0) {
+        ssize_t result = ::write(file, data, size);
+        if (result <= 0) {
+            return false;
+        }
+        data += result;
+        size -= result;
+    }
+    return true;
+}
+
+static size_t calculateTarPadding(size_t size) {
+    return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}
+
+static void appendTarRecord(std::vector<char>& archive, std::string_view name, size_t size, char type) {
+    char header[TAR_BLOCK_SIZE] = {};
+    memcpy(header, name.data(), std::min<size_t>(name.size(), 100));
+    snprintf(header + 100, 8, "%07o", 0644);
+    snprintf(header + 108, 8, "%07o", 0);
+    snprintf(header + 116, 8, "%07o", 0);
+    snprintf(header + 124, 12, "%011llo", (unsigned long long)std::min<size_t>(size, 077777777777));
+    snprintf(header + 136, 12, "%011llo", (unsigned long long)time(nullptr));
+    header[156] = type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+
+    // The checksum is counted with its own field filled with spaces
+    memset(header + 148, ' ', 8);
+    unsigned checksum = 0;
+    for (unsigned char byte : header) {
+        checksum += byte;
+    }
+    snprintf(header + 148, 8, "%06o", checksum);
+    archive.insert(archive.end(), header, header + TAR_BLOCK_SIZE);
+}
+
+// Names longer than the header holds and sizes past its octal field go into a pax extended header first
+static void appendTarHeader(std::vector<char>& archive, std::string_view name, size_t size) {
+    std::string records;
+    auto addRecord = [&](const std::string& key, const std::string& value) {
+        // The length counts its own digits, so it is settled by trying longer lengths
+        std::string record = " " + key + "=" + value + "\n";
+        size_t length = record.size();
+        while (std::to_string(length).size() + record.size() != length) {
+            length = std::to_string(length).size() + record.size();
+        }
+        records += std::to_string(length) + record;
+    };
+    if (name.size() > 100) {
+        addRecord("path", std::string(name));
+    }
+    if (size > 077777777777) {
+        addRecord("size", std::to_string(size));
+    }
+    if (!records.empty()) {
+        appendTarRecord(archive, "PaxHeader", records.size(), 'x');
+        archive.insert(archive.end(), records.begin(), records.end());
+        archive.insert(archive.end(), calculateTarPadding(records.size()), 0);
+    }
+    appendTarRecord(archive, name, size, '0');
+}
+
+VfsError Volume::exportArchive(int outputFile, size_t& filesExported) {
+    filesExported = 0;
+    ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, false);
+    if (!metadataGuard.isLocked()) {
+        return VfsError::IoError;
+    }
+    VfsError error = refresh();
+    if (error != VfsError::None) {
+        return error;
+    }
+    std::shared_lock<std::shared_mutex> guard(namespaceLock);
+
+    // Files starting earlier on the image come first, so the archive follows the image
+    std::vector<size_t> files;
+    for (const auto& [i, iNode] : iNodes) {
+        if (!std::string_view(iNode.fileName).starts_with(SNAPSHOT_PREFIX) && !isDirectory(i)) {
+            files.push_back(i);
+        }
+    }
+    std::sort(files.begin(), files.end(), [&](size_t a, size_t b) {
+        return iNodes[a].firstBlock < iNodes[b].firstBlock;
+    });
+
+    off_t start = lseek(outputFile, 0, SEEK_CUR);
+    if (start < 0) {
+        error = exportInOrder(outputFile, files);
+    } else {
+        // Headers are written first, each file's data then lands after its header wherever the sweep finds it
+        std::vector<char> headers;
+        std::vector<size_t> dataOffsets;
+        size_t archiveSize = 0;
+        for (size_t file : files) {
+            headers.clear();
+            appendTarHeader(headers, iNodes[file].fileName, iNodes[file].fileSize);
+            VFS_PHASE(PHASE_HOST);
+            if (pwrite(outputFile, headers.data(), headers.size(), start + archiveSize) != ssize_t(headers.size())) {
+                return VfsError::HostIoError;
+            }
+            dataOffsets.push_back(archiveSize + headers.size());
+            archiveSize += headers.size() + iNodes[file].fileSize + calculateTarPadding(iNodes[file].fileSize);
+        }
+        // Padding and the two empty blocks ending the archive are holes of the output, read back as zeros
+        if (ftruncate(outputFile, start + archiveSize + 2 * TAR_BLOCK_SIZE) != 0) {
+            return VfsError::HostIoError;
+        }
+        error = exportInPlace(outputFile, start, files, dataOffsets);
+        if (error == VfsError::None && lseek(outputFile, start + archiveSize + 2 * TAR_BLOCK_SIZE, SEEK_SET) < 0) {
+            error = VfsError::HostIoError;
+        }
+    }
+    if (error == VfsError::None) {
+        filesExported = files.size();
+    }
+    return error;
+}
+
+// Reads the runs of all files sorted by their place on the image, in chunks of whole blocks,
+// and writes the data of every run at its place in the archive
+VfsError Volume::exportInPlace(int outputFile, size_t start, const std::vector<size_t>& files, const std::vector<size_t>& dataOffsets) {
+    struct Piece {
+        size_t block;
+        size_t length;
+        // Bytes of the file in the run, the last block of a file is not full
+        size_t bytes;
+        size_t archiveOffset;
+    };
+    std::vector<Piece> pieces;
+    std::vector<size_t> tails;
+    std::vector<Extent> extents;
+    for (size_t i = 0; i < files.size(); i++) {
+        if (!getFileExtents(files[i], extents)) {
+            return VfsError::IoError;
+        }
+        const INode& iNode = iNodes[files[i]];
+        size_t fileOffset = 0;
+        for (Extent extent : extents) {
+            size_t bytes = std::min(extent.length * BLOCK_SIZE, iNode.fileSize - iNode.tailLength - fileOffset);
+            pieces.push_back({extent.start, extent.length, bytes, dataOffsets[i] + fileOffset});
+            fileOffset += bytes;
+        }
+        if (iNode.tailLength > 0) {
+            tails.push_back(i);
+        }
+    }
+    std::sort(pieces.begin(), pieces.end(), [](const Piece& a, const Piece& b) {
+        return a.block < b.block;
+    });
+    std::sort(tails.begin(), tails.end(), [&](size_t a, size_t b) {
+        return iNodes[files[a]].tailBlock < iNodes[files[b]].tailBlock;
+    });
+
+    size_t chunkBlocks = COPY_BUFFER_SIZE / BLOCK_SIZE;
+    std::vector<DataBlock> blocks(chunkBlocks);
+    std::vector<char> data(COPY_BUFFER_SIZE);
+    for (const Piece& piece : pieces) {
+        for (size_t done = 0; done < piece.length; done += chunkBlocks) {
+            size_t amount = std::min(chunkBlocks, piece.length - done);
+            if (!readAt(blocks.data(), amount * sizeof(DataBlock), calculateDataBlockOffsetFromIndex(piece.block + done))) {
+                return VfsError::IoError;
+            }
+            size_t bytes = std::min(amount * BLOCK_SIZE, piece.bytes - done * BLOCK_SIZE);
+            for (size_t i = 0; i * BLOCK_SIZE < bytes; i++) {
+                memcpy(&data[i * BLOCK_SIZE], blocks[i].data, std::min<size_t>(BLOCK_SIZE, bytes - i * BLOCK_SIZE));
+            }
+            VFS_PHASE(PHASE_HOST);
+            if (pwrite(outputFile, data.data(), bytes, start + piece.archiveOffset + done * BLOCK_SIZE) != ssize_t(bytes)) {
+                return VfsError::HostIoError;
+            }
+        }
+    }
+
+    // Every fragment block is read once for all the tails it holds
+    uint64_t loadedBlock = 0;
+    for (size_t i = 0; i < tails.size(); i++) {
+        const INode& iNode = iNodes[files[tails[i]]];
+        if ((i == 0 || iNode.tailBlock != loadedBlock)
+            && !readAt(blocks.data(), BLOCK_SIZE, calculateDataBlockOffsetFromIndex(iNode.tailBlock))) {
+            return VfsError::IoError;
+        }
+        loadedBlock = iNode.tailBlock;
+        VFS_PHASE(PHASE_HOST);
+        if (pwrite(outputFile, blocks[0].data + iNode.tailOffset, iNode.tailLength, start + dataOffsets[tails[i]] + iNode.fileSize - iNode.tailLength)
+            != ssize_t(iNode.tailLength)) {
+            return VfsError::HostIoError;
+        }
+    }
+    return VfsError::None;
+}
+
+// A pipe cannot be written out of order, so every file is read through in turn
+VfsError Volume::exportInOrder(int outputFile, const std::vector<size_t>& files) {
+    std::vector<char> headers;
+    std::vector<std::byte> buffer(COPY_BUFFER_SIZE);
+    // Also ends the archive with its two empty blocks
+    std::vector<char> padding(2 * TAR_BLOCK_SIZE, 0);
+    for (size_t file : files) {
+        FileHandle handle;
+        if (!fillHandle(file, handle)) {
+            return VfsError::IoError;
+        }
+
+        headers.clear();
+        appendTarHeader(headers, iNodes[file].fileName, handle.size);
+        if (!writeAll(outputFile, headers.data(), headers.size())) {
+            return VfsError::HostIoError;
+        }
+        for (size_t offset = 0; offset < handle.size; offset += buffer.size()) {
+            size_t length = std::min(buffer.size(), handle.size - offset);
+            VfsError error = transfer(handle, offset, buffer.data(), length, false);
+            if (error != VfsError::None) {
+                return error;
+            }
+            VFS_PHASE(PHASE_HOST);
+            if (!writeAll(outputFile, buffer.data(), length)) {
+                return VfsError::HostIoError;
+            }
+        }
+        if (!writeAll(outputFile, padding.data(), calculateTarPadding(handle.size))) {
+            return VfsError::HostIoError;
+        }
+    }
+    return writeAll(outputFile, padding.data(), padding.size()) ? VfsError::None : VfsError::HostIoError;
+}
+
+// The new file shares every block of the source, both get private copies of the blocks they write later
+VfsError Volume::cloneFile(std::string_view source, std::string_view name) {
+    return isReadOnly() ? VfsError::ReadOnly : finishChange(cloneFileUnsynced(source, name));
+}
+
+VfsError Volume::cloneFileUnsynced(std::string_view source, std::string_view name) {
+    ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, true);
+    if (!metadataGuard.isLocked()) {
+        return VfsError::IoError;
+    }
+    VfsError error = refresh();
+    if (error != VfsError::None) {
+        return error;
+    }
+    std::unique_lock<std::shared_mutex> guard(namespaceLock);
+
+    size_t sourceIndex = source.starts_with(SNAPSHOT_PREFIX) ? NO_INODE : findINode(source);
+    if (sourceIndex == NO_INODE) {
+        return VfsError::NotFound;
+    }
+    if (isDirectory(sourceIndex)) {
+        return VfsError::IsDirectory;
+    }
+    if (name.starts_with(SNAPSHOT_PREFIX) || findINode(name) != NO_INODE) {
+        return VfsError::AlreadyExists;
+    }
+    error = checkPath(name);
+    if (error != VfsError::None) {
+        return error;
+    }
+    size_t chunkBlocks = calculateChunksNeeded(1) * INODE_CHUNK_BLOCKS;
+    if (chunkBlocks > getAmountOfFreeDataBlocks()) {
+        return VfsError::NoFreeINodes;
+    }
+    // The tail is the one part of the source copied
+    size_t tailLength = iNodes.at(sourceIndex).tailLength;
+    if (chunkBlocks + (tailLength > 0 && !fragments.fits(tailLength) ? 1 : 0) > getAmountOfFreeDataBlocks()) {
+        return VfsError::NoSpace;
+    }
+
+    // Waiting for the handles of the source, their blocks are about to become shared
+    ImageLockGuard fileGuard(imageLocks, 1 + sourceIndex, true);
+    if (!fileGuard.isLocked()) {
+        return VfsError::IoError;
+    }
+    std::vector<Extent> extents;
+    if (!getFileExtents(sourceIndex, extents)) {
+        return VfsError::IoError;
+    }
+    if (!isSharingPossible(extents)) {
+        return VfsError::TooManyClones;
+    }
+    if (!beginMetadataChange()) {
+        return VfsError::IoError;
+    }
+    size_t createdParents;
+    error = createParents(name, guard, createdParents);
+    if (error != VfsError::None) {
+        return error;
+    }
+
+    size_t iNodeIndex = allocateINode(getINodeGroup(sourceIndex));
+    if (iNodeIndex == NO_INODE) {
+        removeParents(name, createdParents);
+        return superBlock.freeINodeAmount == 0 ? VfsError::NoFreeINodes : VfsError::IoError;
+    }
+    INode& iNode = iNodes[iNodeIndex];
+    iNode = iNodes.at(sourceIndex);
+    memset(iNode.fileName, 0, sizeof(iNode.fileName));
+    strncpy(iNode.fileName, std::string(name).c_str(), sizeof(iNode.fileName) - 1);
+    iNode.accessCount = 0;
+    nameIndex.emplace(iNode.fileName, iNodeIndex);
+    if (!copyTail(iNodes.at(sourceIndex), iNode, getINodeGroup(iNodeIndex)) || !writeINode(iNodeIndex) || !linkEntry(iNodeIndex)) {
+        discardINode(iNodeIndex);
+        removeParents(name, createdParents);
+        return VfsError::IoError;
+    }
+    return shareDataBlocks(extents) ? VfsError::None : VfsError::IoError;
+}
+
+// Reads the INodes saved by a snapshot, the metadata must be held
+bool Volume::readSnapshot(size_t index, std::vector<INode>& entries) {
+    FileHandle handle;
+    if (!fillHandle(index, handle)) {
+        return false;
+    }
+    entries.resize(handle.size / sizeof(INode));
+    return entries.empty() || transfer(handle, 0, reinterpret_cast<std::byte*>(entries.data()), handle.size, false) == VfsError::None;
+}
+
+// Saves the INodes of every file in a hidden file and shares their blocks with it,
+// so taking a snapshot copies no data besides the tails of packed files. Directories are not saved,
+// their blocks are never shared.
+VfsError Volume::createSnapshot(std::string_view name) {
+    return isReadOnly() ? VfsError::ReadOnly : finishChange(createSnapshotUnsynced(name));
+}
+
+VfsError Volume::createSnapshotUnsynced(std::string_view name) {
+    ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, true);
+    if (!metadataGuard.isLocked()) {
+        return VfsError::IoError;
+    }
+    VfsError error = refresh();
+    if (error != VfsError::None) {
+        return error;
+    }
+    std::unique_lock<std::shared_mutex> guard(namespaceLock);
+
+    std::string snapshotName = SNAPSHOT_PREFIX + std::string(name);
+    if (findINode(snapshotName) != NO_INODE) {
+        return VfsError::AlreadyExists;
+    }
+
+    // Waiting for the handles of every file, their blocks are about to become shared
+    std::vector<INode> entries;
+    std::vector<Extent> extents;
+    std::vector<Extent> sharedExtents;
+    std::deque<ImageLockGuard> fileGuards;
+    for (const auto& [i, iNode] : iNodes) {
+        if (std::string_view(iNode.fileName).starts_with(SNAPSHOT_PREFIX) || isDirectory(i)) {
+            continue;
+        }
+        if (!fileGuards.emplace_back(imageLocks, 1 + i, true).isLocked() || !getFileExtents(i, extents)) {
+            return VfsError::IoError;
+        }
+        entries.push_back(iNode);
+        sharedExtents.insert(sharedExtents.end(), extents.begin(), extents.end());
+    }
+    if (!isSharingPossible(sharedExtents)) {
+        return VfsError::TooManyClones;
+    }
+    if (!beginMetadataChange()) {
+        return VfsError::IoError;
+    }
+    // Tails are not shared, the snapshot keeps copies of them
+    for (INode& entry : entries) {
+        INode source = entry;
+        if (!copyTail(source, entry, source.tailBlock / superBlock.blocksPerGroup)) {
+            return getAmountOfFreeDataBlocks() == 0 ? VfsError::NoSpace : VfsError::IoError;
+        }
+    }
+
+    FileHandle handle;
+    error = createINode(snapshotName, entries.size() * sizeof(INode), handle, guard);
+    if (error == VfsError::None && !entries.empty()) {
+        error = transfer(handle, 0, reinterpret_cast<std::byte*>(entries.data()), handle.size, true);
+    }
+    // Nobody knows the hidden file, so its lock goes without a traced close
+    if (handle.open) {
+        imageLocks.release(1 + handle.iNode);
+    }
+    if (error == VfsError::None && !shareDataBlocks(sharedExtents)) {
+        error = VfsError::IoError;
+    }
+    return error;
+}
+
+// Replaces every file with the ones saved by the snapshot, which is kept for later rollbacks.
+// Directories stay, the ones missing on the paths of the saved files are created again.
+VfsError Volume::rollbackSnapshot(std::string_view name) {
+    return isReadOnly() ? VfsError::ReadOnly : finishChange(rollbackSnapshotUnsynced(name));
+}
+
+VfsError Volume::rollbackSnapshotUnsynced(std::string_view name) {
+    ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, true);
+    if (!metadataGuard.isLocked()) {
+        return VfsError::IoError;
+    }
+    VfsError error = refresh();
+    if (error != VfsError::None) {
+        return error;
+    }
+    std::unique_lock<std::shared_mutex> guard(namespaceLock);
+
+    size_t snapshotIndex = findINode(SNAPSHOT_PREFIX + std::string(name));
+    if (snapshotIndex == NO_INODE) {
+        return VfsError::NotFound;
+    }
+    std::vector<INode> entries;
+    if (!readSnapshot(snapshotIndex, entries)) {
+        return VfsError::IoError;
+    }
+
+    // Waiting for the handles of every file, they are all about to go
+    std::vector<size_t> files;
+    std::deque<ImageLockGuard> fileGuards;
+    for (const auto& [i, iNode] : iNodes) {
+        if (std::string_view(iNode.fileName).starts_with(SNAPSHOT_PREFIX) || isDirectory(i)) {
+            continue;
+        }
+        if (!fileGuards.emplace_back(imageLocks, 1 + i, true).isLocked()) {
+            return VfsError::IoError;
+        }
+        files.push_back(i);
+    }
+    // A directory made since in place of a saved file is left for the user to remove
+    for (const INode& entry : entries) {
+        size_t index = findINode(entry.fileName);
+        if (index != NO_INODE && isDirectory(index)) {
+            return VfsError::AlreadyExists;
+        }
+    }
+    // INodes of the files removed are taken again first
+    if (entries.size() > files.size() && calculateChunksNeeded(entries.size() - files.size()) * INODE_CHUNK_BLOCKS > getAmountOfFreeDataBlocks()) {
+        return VfsError::NoFreeINodes;
+    }
+    std::vector<Extent> extents;
+    std::vector<Extent> sharedExtents;
+    for (const INode& entry : entries) {
+        if (!getChainExtents(entry.firstBlock, entry.fileSize - entry.tailLength, extents)) {
+            return VfsError::IoError;
+        }
+        sharedExtents.insert(sharedExtents.end(), extents.begin(), extents.end());
+    }
+    if (!isSharingPossible(sharedExtents)) {
+        return VfsError::TooManyClones;
+    }
+    if (!beginMetadataChange()) {
+        return VfsError::IoError;
+    }
+
+    for (size_t file : files) {
+        error = removeINode(file);
+        if (error != VfsError::None) {
+            return error;
+        }
+    }
+    for (const INode& entry : entries) {
+        size_t createdParents;
+        error = createParents(entry.fileName, guard, createdParents);
+        if (error != VfsError::None) {
+            return error;
+        }
+        // Keeping the INode in the group of the first block again
+        size_t iNodeIndex = allocateINode(entry.firstBlock / superBlock.blocksPerGroup);
+        if (iNodeIndex == NO_INODE) {
+            removeParents(entry.fileName, createdParents);
+            return VfsError::IoError;
+        }
+        // The snapshot keeps its tails for later rollbacks, the file gets a copy
+        iNodes[iNodeIndex] = entry;
+        nameIndex.emplace(iNodes[iNodeIndex].fileName, iNodeIndex);
+        bool tailCopied = copyTail(entry, iNodes[iNodeIndex], getINodeGroup(iNodeIndex));
+        if (!tailCopied || !writeINode(iNodeIndex) || !linkEntry(iNodeIndex)) {
+            discardINode(iNodeIndex);
+            removeParents(entry.fileName, createdParents);
+            return !tailCopied && getAmountOfFreeDataBlocks() == 0 ? VfsError::NoSpace : VfsError::IoError;
+        }
+    }
+    return shareDataBlocks(sharedExtents) ? VfsError::None : VfsError::IoError;
+}
+
+VfsError Volume::removeSnapshot(std::string_view name) {
+    return isReadOnly() ? VfsError::ReadOnly : finishChange(removeSnapshotUnsynced(name));
+}
+
+VfsError Volume::removeSnapshotUnsynced(std::string_view name) {
+    ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, true);
+    if (!metadataGuard.isLocked()) {
+        return VfsError::IoError;
+    }
+    VfsError error = refresh();
+    if (error != VfsError::None) {
+        return error;
+    }
+    std::unique_lock<std::shared_mutex> guard(namespaceLock);
+
+    size_t snapshotIndex = findINode(SNAPSHOT_PREFIX + std::string(name));
+    if (snapshotIndex == NO_INODE) {
+        return VfsError::NotFound;
+    }
+    std::vector<INode> entries;
+    if (!readSnapshot(snapshotIndex, entries) || !beginMetadataChange()) {
+        return VfsError::IoError;
+    }
+
+    // Blocks the files still share with the snapshot are only counted down, its tails are its own
+    std::vector<Extent> extents;
+    for (INode& entry : entries) {
+        if (!getChainExtents(entry.firstBlock, entry.fileSize - entry.tailLength, extents)) {
+            return VfsError::IoError;
+        }
+        for (Extent extent : extents) {
+            if (!releaseDataBlocks(extent)) {
+                return VfsError::IoError;
+            }
+        }
+        if (!releaseTail(entry)) {
+            return VfsError::IoError;
+        }
+    }
+    return removeINode(snapshotIndex);
+}
+
+void Volume::listSnapshots(std::vector<SnapshotInfo>& snapshots) {
+    snapshots.clear();
+    ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, false);
+    if (!metadataGuard.isLocked() || refresh() != VfsError::None) {
+        return;
+    }
+    std::shared_lock<std::shared_mutex> guard(namespaceLock);
+
+    for (const auto& [i, iNode] : iNodes) {
+        std::string_view fileName = iNode.fileName;
+        if (fileName.starts_with(SNAPSHOT_PREFIX)) {
+            snapshots.push_back({std::string(fileName.substr(strlen(SNAPSHOT_PREFIX))), iNode.fileSize / sizeof(INode)});
+        }
+    }
+}
+
+// Takes the chain of an unshared file again from the lowest free blocks past `cursor`, its own ones included,
+// and writes it there from memory when that moved it. `cursor` is left past the chain.
+bool Volume::relocateChain(size_t index, const std::vector<Extent>& extents, size_t& cursor, size_t& blocksMoved) {
+    blocksMoved = 0;
+    if (extents.empty()) {
+        return true;
+    }
+    INode& iNode = iNodes[index];
+    FileHandle old;
+    std::vector<std::byte> data(iNode.fileSize - iNode.tailLength);
+    if (!fillHandle(index, old) || transfer(old, 0, data.data(), data.size(), false) != VfsError::None) {
+        return false;
+    }
+    for (Extent extent : extents) {
+        if (!releaseDataBlocks(extent)) {
+            return false;
+        }
+    }
+
+    // With nothing free past the cursor the file takes the lowest free blocks of all
+    size_t blocksAmount = calculateBlocksAmount(data.size());
+    std::vector<Extent> placed = allocateDataBlocks(0, blocksAmount, cursor);
+    if (placed.empty()) {
+        placed = allocateDataBlocks(0, blocksAmount, 0);
+        if (placed.empty()) {
+            return false;
+        }
+    } else {
+        cursor = placed.back().start + placed.back().length;
+    }
+    if (std::equal(placed.begin(), placed.end(), extents.begin(), extents.end(),
+        [](Extent a, Extent b) { return a.start == b.start && a.length == b.length; })) {
+        return true;
+    }
+
+    iNode.firstBlock = placed.front().start;
+    FileHandle moved;
+    moved.size = data.size();
+    setHandleExtents(moved, placed, SIZE_MAX);
+    if (!linkBlocks(placed, 0) || transfer(moved, 0, data.data(), data.size(), true) != VfsError::None || !writeINode(index)) {
+        return false;
+    }
+    blocksMoved = blocksAmount;
+    return true;
+}
+
+// Moves a tail lying past the zone into the fragment blocks taken for hot tails, best fitting as usual.
+// A new one is taken at `cursor` when none has room.
+bool Volume::relocateTail(size_t index, FragmentAllocator& hotFragments, size_t zoneEnd, size_t& cursor, bool& moved) {
+    moved = false;
+    INode& iNode = iNodes[index];
+    if (iNode.tailLength == 0 || iNode.tailBlock < zoneEnd) {
+        return true;
+    }
+    size_t length = iNode.tailLength;
+    uint64_t block;
+    size_t offset;
+    if (!hotFragments.take(length, block, offset)) {
+        std::vector<Extent> added = allocateDataBlocks(0, 1, cursor);
+        if (added.empty()) {
+            return true;
+        }
+        cursor = added.front().start + 1;
+        hotFragments.addBlock(added.front().start);
+        hotFragments.take(length, block, offset);
+    }
+    fragments.mark(block, offset, length);
+
+    char data[BLOCK_SIZE];
+    if (!readAt(data, length, calculateTailStart(iNode)) || !releaseTail(iNode)) {
+        return false;
+    }
+    iNode.tailBlock = block;
+    iNode.tailOffset = offset;
+    iNode.tailLength = length;
+    moved = true;
+    return writeAt(data, length, calculateTailStart(iNode)) && writeINode(index);
+}
+
+// End of the zone at the start of the data region taking `neededBlocks` blocks out of the free ones and the runs given,
+// blocks of neither kind are stepped over. `zoneFree` is left with the free blocks inside it.
+size_t Volume::findZoneEnd(std::vector<Extent> runs, size_t neededBlocks, size_t& zoneFree) {
+    zoneFree = 0;
+    for (size_t i = 0; i < groups.size(); i++) {
+        BlockGroup& blockGroup = groups[i];
+        size_t groupStart = i * superBlock.blocksPerGroup;
+        std::lock_guard<std::mutex> guard(blockGroup.lock);
+        if (!blockGroup.loaded) {
+            runs.push_back({groupStart, blockGroup.descriptor.blockAmount});
+            continue;
+        }
+        for (const auto& [start, length] : blockGroup.freeSpace.getExtents()) {
+            runs.push_back({groupStart + start, length});
+        }
+    }
+    std::sort(runs.begin(), runs.end(), [](Extent a, Extent b) { return a.start < b.start; });
+
+    size_t counted = 0;
+    size_t zoneEnd = 0;
+    for (Extent run : runs) {
+        if (counted == neededBlocks) {
+            break;
+        }
+        size_t taken = std::min(run.length, neededBlocks - counted);
+        if (isDataBlockFree(run.start)) {
+            zoneFree += taken;
+        }
+        counted += taken;
+        zoneEnd = run.start + taken;
+    }
+    return zoneEnd;
+}
+
+VfsError Volume::reorganize(size_t limit, ReorganizeReport& report) {
+    return isReadOnly() ? VfsError::ReadOnly : finishChange(reorganizeUnsynced(limit, report));
+}
+
+VfsError Volume::reorganizeUnsynced(size_t limit, ReorganizeReport& report) {
+    report = ReorganizeReport();
+    ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, true);
+    if (!metadataGuard.isLocked()) {
+        return VfsError::IoError;
+    }
+    VfsError error = refresh();
+    if (error != VfsError::None) {
+        return error;
+    }
+    std::unique_lock<std::shared_mutex> guard(namespaceLock);
+
+    // Counters added by other processes do not move the generation, so the INodes are read again
+    if (!writeAccessCounts()) {
+        return VfsError::IoError;
+    }
+    error = loadINodes();
+    if (error != VfsError::None) {
+        return error;
+    }
+
+    std::vector<size_t> hot;
+    for (const auto& [i, iNode] : iNodes) {
+        if (iNode.accessCount > 0 && !std::string_view(iNode.fileName).starts_with(SNAPSHOT_PREFIX)) {
+            hot.push_back(i);
+        }
+    }
+    // Hottest first, files opened as often keep the order of their INodes
+    std::stable_sort(hot.begin(), hot.end(), [this](size_t a, size_t b) { return iNodes.at(a).accessCount > iNodes.at(b).accessCount; });
+    report.hotFiles = hot.size();
+    if (limit > 0 && hot.size() > limit) {
+        hot.resize(limit);
+    }
+    if (hot.empty()) {
+        return VfsError::None;
+    }
+
+    // Only files owning all their blocks and small enough to be held in memory move. The zone for the hot ones
+    // is taken out of the free blocks, the blocks of such files and the fragment blocks of their tails.
+    std::unordered_map<size_t, std::vector<Extent>> movable;
+    std::vector<Extent> zoneRuns;
+    for (const auto& [i, iNode] : iNodes) {
+        size_t sharedBlock;
+        std::vector<Extent> extents;
+        if (std::string_view(iNode.fileName).starts_with(SNAPSHOT_PREFIX) || !getFileExtents(i, extents, &sharedBlock)) {
+            continue;
+        }
+        if (sharedBlock == SIZE_MAX && iNode.fileSize - iNode.tailLength <= REORGANIZE_BUFFER_SIZE) {
+            zoneRuns.insert(zoneRuns.end(), extents.begin(), extents.end());
+            movable.emplace(i, std::move(extents));
+        }
+    }
+    // Hot tails are packed the way they will be, to know how many fragment blocks they take
+    std::vector<size_t> hotMovable;
+    std::set<uint64_t> hotTailBlocks;
+    FragmentAllocator packing;
+    size_t neededBlocks = 0;
+    for (size_t index : hot) {
+        const INode& iNode = iNodes.at(index);
+        if (!movable.contains(index)) {
+            report.filesSkipped++;
+            continue;
+        }
+        hotMovable.push_back(index);
+        neededBlocks += calculateBlocksAmount(iNode.fileSize - iNode.tailLength);
+        uint64_t block;
+        size_t offset;
+        if (iNode.tailLength > 0 && !packing.take(iNode.tailLength, block, offset)) {
+            packing.addBlock(packing.getBlockAmount());
+            packing.take(iNode.tailLength, block, offset);
+        }
+        if (iNode.tailLength > 0) {
+            hotTailBlocks.insert(iNode.tailBlock);
+        }
+    }
+    neededBlocks += packing.getBlockAmount();
+    for (uint64_t block : hotTailBlocks) {
+        zoneRuns.push_back({block, 1});
+    }
+    if (!beginMetadataChange()) {
+        return VfsError::IoError;
+    }
+
+    // Cold files in the zone go past it first, as long as there is room there
+    size_t zoneFree;
+    size_t zoneEnd = findZoneEnd(std::move(zoneRuns), neededBlocks, zoneFree);
+    size_t freePastZone = getAmountOfFreeDataBlocks() - zoneFree;
+    std::set<size_t> hotSet(hotMovable.begin(), hotMovable.end());
+    std::vector<std::pair<size_t, size_t>> cold;
+    for (const auto& [index, extents] : movable) {
+        size_t lowest = SIZE_MAX;
+        for (Extent extent : extents) {
+            lowest = std::min(lowest, extent.start);
+        }
+        if (lowest < zoneEnd && !hotSet.contains(index)) {
+            cold.push_back({lowest, index});
+        }
+    }
+    std::sort(cold.begin(), cold.end());
+    size_t coldCursor = zoneEnd;
+    for (const auto& [lowest, index] : cold) {
+        const std::vector<Extent>& extents = movable.at(index);
+        size_t blocksAmount = calculateBlocksAmount(iNodes.at(index).fileSize - iNodes.at(index).tailLength);
+        if (blocksAmount > freePastZone) {
+            continue;
+        }
+        ImageLockGuard fileGuard(imageLocks, 1 + index, true);
+        size_t blocksMoved;
+        if (!fileGuard.isLocked() || !relocateChain(index, extents, coldCursor, blocksMoved)) {
+            return VfsError::IoError;
+        }
+        freePastZone -= blocksAmount;
+        report.coldFilesMoved += blocksMoved > 0 ? 1 : 0;
+        report.coldBlocksMoved += blocksMoved;
+    }
+
+    size_t cursor = 0;
+    FragmentAllocator hotFragments;
+    for (size_t index : hotMovable) {
+        // Waiting for the handles of the file, its blocks are about to move
+        ImageLockGuard fileGuard(imageLocks, 1 + index, true);
+        size_t blocksMoved;
+        bool tailMoved;
+        if (!fileGuard.isLocked() || !relocateChain(index, movable.at(index), cursor, blocksMoved)
+            || !relocateTail(index, hotFragments, zoneEnd, cursor, tailMoved)) {
+            return VfsError::IoError;
+        }
+        report.filesMoved += blocksMoved > 0 || tailMoved ? 1 : 0;
+        report.blocksMoved += blocksMoved;
+    }
+    return VfsError::None;
+}
+
+VfsError Volume::check(bool repair, CheckReport& report) {
+    return repair && isReadOnly() ? VfsError::ReadOnly : finishChange(checkUnsynced(repair, report));
+}
+
+// Runs `work(item, thread)` for every item below `amount` on `threads` threads, each taking CHECK_BATCH_SIZE items at once
+template <typename Work>
+static void runParallel(size_t threads, size_t amount, Work work) {
+    std::atomic<size_t> nextItem = 0;
+    auto runItems = [&](size_t thread) {
+        size_t first;
+        while ((first = nextItem.fetch_add(CHECK_BATCH_SIZE)) < amount) {
+            for (size_t item = first; item < std::min(amount, first + CHECK_BATCH_SIZE); item++) {
+                work(item, thread);
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads; i++) {
+        workers.emplace_back(runItems, i);
+    }
+    runItems(0);
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+static void addCheckReport(CheckReport& total, const CheckReport& part) {
+    total.files += part.files;
+    total.blocksInUse += part.blocksInUse;
+    total.crossLinkedBlocks += part.crossLinkedBlocks;
+    total.cycles += part.cycles;
+    total.orphanBlocks += part.orphanBlocks;
+    total.unmarkedBlocks += part.unmarkedBlocks;
+    total.sizeMismatches += part.sizeMismatches;
+    total.overlappingTails += part.overlappingTails;
+    total.shareCountMismatches += part.shareCountMismatches;
+    total.counterMismatches += part.counterMismatches;
+}
+
+// Adds the runs of a chain to `owned`, every block once. A chain going through a block twice runs in a cycle,
+// one ending before `size` or longer than the whole image does not match its file.
+void Volume::checkChain(uint64_t firstBlock, size_t size, std::vector<Extent>& owned, CheckReport& report) const {
+    std::vector<Extent> extents;
+    size_t limit = std::min(size, superBlock.blockAmount * BLOCK_SIZE);
+    if (limit < size || !getChainExtents(firstBlock, limit, extents)) {
+        report.sizeMismatches++;
+    }
+    std::sort(extents.begin(), extents.end(), [](Extent a, Extent b) {
+        return a.start < b.start;
+    });
+    size_t end = 0;
+    bool cycle = false;
+    for (Extent extent : extents) {
+        if (extent.start < end) {
+            cycle = true;
+            if (extent.start + extent.length <= end) {
+                continue;
+            }
+            extent.length -= end - extent.start;
+            extent.start = end;
+        }
+        owned.push_back(extent);
+        end = extent.start + extent.length;
+    }
+    report.cycles += cycle ? 1 : 0;
+}
+
+void Volume::checkFile(const INode& iNode, CheckWalk& walk) const {
+    walk.report.files++;
+    size_t tailLength = std::min<size_t>(iNode.tailLength, iNode.fileSize);
+    if (iNode.tailLength != calculateTailLength(iNode.fileSize)) {
+        walk.report.sizeMismatches++;
+    } else if (tailLength > 0) {
+        if (iNode.tailBlock / superBlock.blocksPerGroup >= groups.size() || iNode.tailOffset + tailLength > BLOCK_SIZE) {
+            walk.report.sizeMismatches++;
+        } else {
+            walk.tails.push_back({iNode.tailBlock, iNode.tailOffset, iNode.tailLength});
+        }
+    }
+    checkChain(iNode.firstBlock, iNode.fileSize - tailLength, walk.owned, walk.report);
+}
+
+// Bitmap and share counts of a group as its owners have it, the share counts stay empty when no block is shared
+void Volume::expectGroup(size_t group, std::span<const CheckRun> runs, std::vector<uint64_t>& bitmap, std::vector<uint16_t>& shareCounts) const {
+    bitmap.assign(calculateBitmapWords(superBlock.blocksPerGroup), 0);
+    shareCounts.clear();
+    size_t groupStart = group * superBlock.blocksPerGroup;
+    for (const CheckRun& run : runs) {
+        setBits(bitmap, run.start - groupStart, run.length, true);
+        if (run.owners > 1) {
+            if (shareCounts.empty()) {
+                shareCounts.assign(superBlock.blocksPerGroup, 0);
+            }
+            std::fill_n(shareCounts.begin() + (run.start - groupStart), run.length, std::min<size_t>(run.owners - 1, UINT16_MAX));
+        }
+    }
+}
+
+// Compares a group with what its owners imply, true when anything differs
+bool Volume::checkGroup(size_t group, std::span<const CheckRun> runs, CheckReport& report) const {
+    const BlockGroup& blockGroup = groups[group];
+    size_t blockAmount = blockGroup.descriptor.blockAmount;
+    std::vector<uint64_t> bitmap;
+    std::vector<uint16_t> shareCounts;
+    expectGroup(group, runs, bitmap, shareCounts);
+
+    // A group never loaded has nothing taken, bits past the last block mean nothing
+    size_t orphans = 0;
+    size_t unmarked = 0;
+    size_t storedTaken = 0;
+    for (size_t i = 0; i < bitmap.size() && i * BITMAP_WORD_BITS < blockAmount; i++) {
+        uint64_t stored = blockGroup.blockBitmap.empty() ? 0 : blockGroup.blockBitmap[i];
+        if (blockAmount - i * BITMAP_WORD_BITS < BITMAP_WORD_BITS) {
+            stored &= (uint64_t(1) << (blockAmount - i * BITMAP_WORD_BITS)) - 1;
+        }
+        orphans += std::popcount(stored & ~bitmap[i]);
+        unmarked += std::popcount(bitmap[i] & ~stored);
+        storedTaken += std::popcount(stored);
+        report.blocksInUse += std::popcount(bitmap[i]);
+    }
+
+    size_t crossLinked = 0;
+    size_t shareMismatches = 0;
+    size_t storedShared = 0;
+    if (!shareCounts.empty() || !blockGroup.shareCounts.empty()) {
+        for (size_t i = 0; i < blockAmount; i++) {
+            uint16_t stored = blockGroup.shareCounts.empty() ? 0 : blockGroup.shareCounts[i];
+            uint16_t expected = shareCounts.empty() ? 0 : shareCounts[i];
+            storedShared += stored > 0 ? 1 : 0;
+            crossLinked += expected > stored ? 1 : 0;
+            shareMismatches += expected < stored ? 1 : 0;
+        }
+    }
+    size_t counters = (blockGroup.descriptor.freeBlockAmount != blockAmount - storedTaken ? 1 : 0)
+        + (blockGroup.descriptor.sharedBlockAmount != storedShared ? 1 : 0);
+
+    report.orphanBlocks += orphans;
+    report.unmarkedBlocks += unmarked;
+    report.crossLinkedBlocks += crossLinked;
+    report.shareCountMismatches += shareMismatches;
+    report.counterMismatches += counters;
+    return orphans + unmarked + crossLinked + shareMismatches + counters > 0;
+}
+
+// Writes the bitmap, share counts and counters the owners of a group imply over the stored ones.
+// Share counts are written whole, stale ones left on the image would come back with the next share.
+bool Volume::rebuildGroup(size_t group, std::span<const CheckRun> runs) {
+    VFS_PHASE(PHASE_METADATA);
+    BlockGroup& blockGroup = groups[group];
+    std::vector<uint16_t> shareCounts;
+    expectGroup(group, runs, blockGroup.blockBitmap, shareCounts);
+    blockGroup.shareCounts = shareCounts.empty() ? std::vector<uint16_t>(superBlock.blocksPerGroup, 0) : shareCounts;
+
+    size_t taken = 0;
+    for (uint64_t word : blockGroup.blockBitmap) {
+        taken += std::popcount(word);
+    }
+    blockGroup.descriptor.freeBlockAmount = blockGroup.descriptor.blockAmount - taken;
+    blockGroup.descriptor.sharedBlockAmount = std::count_if(shareCounts.begin(), shareCounts.end(), [](uint16_t count) {
+        return count > 0;
+    });
+    blockGroup.freeSpace.clear();
+    buildFreeSpace(blockGroup);
+    blockGroup.loaded = true;
+
+    bool written = writeBitmapWords(blockGroup.descriptor.blockBitmapStart, blockGroup.blockBitmap, 0, blockGroup.descriptor.blockAmount - 1)
+        && writeShareCounts(group, 0, superBlock.blocksPerGroup - 1)
+        && writeGroupDescriptor(group);
+    if (blockGroup.descriptor.sharedBlockAmount == 0) {
+        blockGroup.shareCounts.clear();
+    }
+    return written;
+}
+
+// Walks the files on every thread first, then merges what they own into runs of blocks with the same amount of owners
+// and compares the groups with them, again on every thread. Only groups that differ are written when repairing.
+VfsError Volume::checkUnsynced(bool repair, CheckReport& report) {
+    report = {};
+    ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, repair);
+    if (!metadataGuard.isLocked()) {
+        return VfsError::IoError;
+    }
+    VfsError error = refresh();
+    if (error != VfsError::None) {
+        return error;
+    }
+    std::unique_lock<std::shared_mutex> guard(namespaceLock);
+    VFS_PHASE(PHASE_LOOKUP);
+
+    std::vector<std::pair<size_t, const INode*>> files;
+    for (const auto& [i, iNode] : iNodes) {
+        files.emplace_back(i, &iNode);
+    }
+    size_t threads = std::max<size_t>(copyThreads, std::thread::hardware_concurrency());
+    std::vector<CheckWalk> walks(threads);
+    runParallel(threads, files.size(), [&](size_t item, size_t thread) {
+        auto [index, iNode] = files[item];
+        CheckWalk& walk = walks[thread];
+        checkFile(*iNode, walk);
+        if (!std::string_view(iNode->fileName).starts_with(SNAPSHOT_PREFIX)) {
+            return;
+        }
+        std::vector<INode> entries;
+        if (iNode->fileSize % sizeof(INode) != 0 || !readSnapshot(index, entries)) {
+            walk.report.sizeMismatches++;
+            return;
+        }
+        for (const INode& entry : entries) {
+            checkFile(entry, walk);
+        }
+    });
+
+    std::vector<Extent> owned;
+    std::vector<CheckTail> tails;
+    for (CheckWalk& walk : walks) {
+        owned.insert(owned.end(), walk.owned.begin(), walk.owned.end());
+        tails.insert(tails.end(), walk.tails.begin(), walk.tails.end());
+        addCheckReport(report, walk.report);
+    }
+    walks.clear();
+
+    size_t freeINodeAmount = 0;
+    for (const INodeChunk& chunk : chunks) {
+        owned.push_back({chunk.firstBlock, INODE_CHUNK_BLOCKS});
+        freeINodeAmount += chunk.freeINodeAmount;
+    }
+    checkChain(superBlock.chunkIndexBlock, superBlock.chunkAmount * sizeof(uint64_t), owned, report);
+    bool superBlockDiffers = superBlock.freeINodeAmount != freeINodeAmount || superBlock.iNodeAmount != chunks.size() * INODES_PER_CHUNK;
+    report.counterMismatches += superBlockDiffers ? 1 : 0;
+
+    // A fragment block has one owner however many tails it holds
+    std::sort(tails.begin(), tails.end(), [](const CheckTail& a, const CheckTail& b) {
+        return a.block < b.block;
+    });
+    uint64_t takenUnits = 0;
+    for (size_t i = 0; i < tails.size(); i++) {
+        if (i == 0 || tails[i].block != tails[i - 1].block) {
+            owned.push_back({tails[i].block, 1});
+            takenUnits = 0;
+        }
+        size_t first = tails[i].offset / FRAGMENT_UNIT_SIZE;
+        size_t units = (tails[i].offset + tails[i].length + FRAGMENT_UNIT_SIZE - 1) / FRAGMENT_UNIT_SIZE - first;
+        uint64_t mask = (units == FRAGMENT_UNITS ? ~uint64_t(0) : (uint64_t(1) << units) - 1) << first;
+        report.overlappingTails += (takenUnits & mask) != 0 ? 1 : 0;
+        takenUnits |= mask;
+    }
+
+    // Owners change only where a run starts or ends, the stretches between are split at the ends of groups
+    std::vector<std::pair<size_t, bool>> edges;
+    edges.reserve(owned.size() * 2);
+    for (Extent extent : owned) {
+        edges.emplace_back(extent.start, true);
+        edges.emplace_back(extent.start + extent.length, false);
+    }
+    owned.clear();
+    std::sort(edges.begin(), edges.end());
+    std::vector<CheckRun> runs;
+    size_t owners = 0;
+    for (size_t i = 0; i + 1 < edges.size(); i++) {
+        owners = edges[i].second ? owners + 1 : owners - 1;
+        size_t start = edges[i].first;
+        while (owners > 0 && start < edges[i + 1].first) {
+            size_t groupEnd = (start / superBlock.blocksPerGroup + 1) * superBlock.blocksPerGroup;
+            size_t end = std::min(edges[i + 1].first, groupEnd);
+            runs.push_back({start, end - start, owners});
+            start = end;
+        }
+    }
+    auto getGroupRuns = [&](size_t group) {
+        auto byStart = [](const CheckRun& run, size_t block) {
+            return run.start < block;
+        };
+        auto first = std::lower_bound(runs.begin(), runs.end(), group * superBlock.blocksPerGroup, byStart);
+        auto last = std::lower_bound(first, runs.end(), (group + 1) * superBlock.blocksPerGroup, byStart);
+        return std::span<const CheckRun>(first, last);
+    };
+
+    std::vector<CheckReport> groupReports(threads);
+    std::vector<uint8_t> groupsDiffering(groups.size(), 0);
+    runParallel(threads, groups.size(), [&](size_t group, size_t thread) {
+        groupsDiffering[group] = checkGroup(group, getGroupRuns(group), groupReports[thread]) ? 1 : 0;
+    });
+    for (const CheckReport& groupReport : groupReports) {
+        addCheckReport(report, groupReport);
+    }
+
+    std::vector<size_t> rebuilt;
+    for (size_t group = 0; group < groups.size(); group++) {
+        if (groupsDiffering[group]) {
+            rebuilt.push_back(group);
+        }
+    }
+    if (!repair || (rebuilt.empty() && !superBlockDiffers)) {
+        return VfsError::None;
+    }
+    if (!beginMetadataChange()) {
+        return VfsError::IoError;
+    }
+    std::atomic<bool> failed = false;
+    runParallel(threads, rebuilt.size(), [&](size_t item, size_t) {
+        if (!rebuildGroup(rebuilt[item], getGroupRuns(rebuilt[item]))) {
+            failed = true;
+        }
+    });
+    report.groupsRepaired = rebuilt.size();
+
+    std::lock_guard<std::mutex> superBlockGuard(superBlockLock);
+    freeBlockAmount = 0;
+    for (const BlockGroup& group : groups) {
+        freeBlockAmount += group.descriptor.freeBlockAmount;
+    }
+    superBlock.freeINodeAmount = freeINodeAmount;
+    superBlock.iNodeAmount = chunks.size() * INODES_PER_CHUNK;
+    return !failed && writeSuperBlock() ? VfsError::None : VfsError::IoError;
+}
+
+void Volume::listFiles(std::vector<FileInfo>& files, bool countFragments) {
+    TraceScope traceScope(trace.get(), TRACE_LIST, {}, TRACE_NO_FILE, 0, 0);
+    files.clear();
+    ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, false);
+    if (!metadataGuard.isLocked() || refresh() != VfsError::None) {
+        return;
+    }
+    std::shared_lock<std::shared_mutex> guard(namespaceLock);
+
+    std::vector<Extent> extents;
+    for (const auto& [i, iNode] : iNodes) {
+        if (std::string_view(iNode.fileName).starts_with(SNAPSHOT_PREFIX) || isDirectory(i)) {
+            continue;
+        }
+        size_t fragments = 0;
+        // A tail counts as one more
+        if (countFragments && getFileExtents(i, extents)) {
+            fragments = extents.size() + (iNode.tailLength > 0 ? 1 : 0);
+        }
+        files.push_back({iNode.fileName, iNode.fileSize, fragments});
+    }
+}
+
+static void addToHistogram(VolumeStatistics& statistics, size_t length) {
+    size_t bucket = 0;
+    while ((length >> (bucket + 1)) != 0 && bucket + 1 < HISTOGRAM_BUCKETS) {
+        bucket++;
+    }
+    statistics.freeExtentHistogram[bucket]++;
+    statistics.freeExtents++;
+    statistics.largestFreeExtent = std::max(statistics.largestFreeExtent, length);
+}
+
+void Volume::getStatistics(VolumeStatistics& statistics) {
+    TraceScope traceScope(trace.get(), TRACE_STATISTICS, {}, TRACE_NO_FILE, 0, 0);
+    ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, false);
+    if (metadataGuard.isLocked()) {
+        refresh();
+    }
+    std::shared_lock<std::shared_mutex> guard(namespaceLock);
+    statistics.groupAmount = superBlock.groupAmount;
+    statistics.iNodeChunkAmount = superBlock.chunkAmount;
+    statistics.iNodeAmount = superBlock.iNodeAmount;
+    statistics.freeINodeAmount = superBlock.freeINodeAmount;
+    statistics.blockAmount = superBlock.blockAmount;
+    statistics.freeBlockAmount = getAmountOfFreeDataBlocks();
+    statistics.memberAmount = memberFiles.size();
+    statistics.largestFreeExtent = 0;
+    statistics.freeExtents = 0;
+    statistics.freeExtentHistogram.assign(HISTOGRAM_BUCKETS, 0);
+    statistics.sharedBlockAmount = 0;
+    statistics.snapshotAmount = 0;
+    statistics.directoryAmount = 0;
+    statistics.directoryBlockAmount = 0;
+    statistics.tailPacking = superBlock.tailPacking;
+    statistics.fragmentBlockAmount = fragments.getBlockAmount();
+    statistics.fragmentBytesTaken = fragments.getTakenBytes();
+
+    for (const auto& [i, iNode] : iNodes) {
+        if (std::string_view(iNode.fileName).starts_with(SNAPSHOT_PREFIX)) {
+            statistics.snapshotAmount++;
+        }
+        if (isDirectory(i)) {
+            statistics.directoryAmount++;
+            statistics.directoryBlockAmount += calculateBlocksAmount(iNode.fileSize);
+        }
+    }
+
+    // A group never loaded is a single free run
+    for (const BlockGroup& group : groups) {
+        statistics.sharedBlockAmount += group.descriptor.sharedBlockAmount;
+        if (!group.loaded) {
+            addToHistogram(statistics, group.descriptor.blockAmount);
+            continue;
+        }
+        for (auto [start, length] : group.freeSpace.getExtents()) {
+            addToHistogram(statistics, length);
+        }
+    }
+}
+
+void Volume::getINodeUsage(size_t scale, std::vector<size_t>& usage) {
+    ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, false);
+    if (metadataGuard.isLocked()) {
+        refresh();
+    }
+    std::shared_lock<std::shared_mutex> guard(namespaceLock);
+    usage.assign((superBlock.iNodeAmount + scale - 1) / scale, 0);
+    for (const auto& [i, iNode] : iNodes) {
+        usage[i / scale]++;
+    }
+}
+
+// Counts the used blocks in every cell going over free runs instead of blocks
+void Volume::getBlockUsage(size_t scale, std::vector<size_t>& usage) {
+    ImageLockGuard metadataGuard(imageLocks, LOCK_METADATA, false);
+    if (metadataGuard.isLocked()) {
+        refresh();
+    }
+    std::shared_lock<std::shared_mutex> guard(namespaceLock);
+    usage.assign((superBlock.blockAmount + scale - 1) / scale, scale);
+    if (superBlock.blockAmount % scale != 0) {
+        usage.back() = superBlock.blockAmount % scale;
+    }
+
+    for (size_t i = 0; i < groups.size(); i++) {
+        std::map<size_t, size_t> freeExtents = groups[i].loaded ? groups[i].freeSpace.getExtents()
+            : std::map<size_t, size_t>{{0, groups[i].descriptor.blockAmount}};
+        for (auto [localStart, length] : freeExtents) {
+            size_t start = i * superBlock.blocksPerGroup + localStart;
+            size_t end = start + length;
+            while (start < end) {
+                size_t cellEnd = std::min(end, (start / scale + 1) * scale);
+                usage[start / scale] -= cellEnd - start;
+                start = cellEnd;
+            }
+        }
+    }
+}
+
+size_t Volume::getINodeAmount() const {
+    return superBlock.iNodeAmount;
+}
+
+size_t Volume::getBlockAmount() const {
+    return superBlock.blockAmount;
+}
+
+size_t Volume::getAmountOfFreeDataBlocks() const {
+    std::lock_guard<std::mutex> guard(superBlockLock);
+    return freeBlockAmount;
+}
+
+void Volume::getIoStatistics(IoStatistics& statistics) const {
+#ifdef VFS_NO_STATS
+    statistics.enabled = false;
+#else
+    statistics.enabled = true;
+#endif
+    statistics.bytesRead = counters.bytesRead.load(std::memory_order_relaxed);
+    statistics.bytesWritten = counters.bytesWritten.load(std::memory_order_relaxed);
+    statistics.seeks = counters.seeks.load(std::memory_order_relaxed);
+    statistics.syscalls = counters.syscalls.load(std::memory_order_relaxed);
+    statistics.blocksScanned = counters.blocksScanned.load(std::memory_order_relaxed);
+    statistics.syncs = counters.syncs.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < PHASE_AMOUNT; i++) {
+        statistics.phaseNanoseconds[i] = counters.phaseNanoseconds[i].load(std::memory_order_relaxed);
+    }
+}
+
+void Volume::resetIoStatistics() {
+    counters.bytesRead = 0;
+    counters.bytesWritten = 0;
+    counters.seeks = 0;
+    counters.syscalls = 0;
+    counters.blocksScanned = 0;
+    counters.syncs = 0;
+    for (size_t i = 0; i < PHASE_AMOUNT; i++) {
+        counters.phaseNanoseconds[i] = 0;
+    }
+}
+
+VfsError Volume::startTrace(const std::string& path) {
+    std::unique_ptr<TraceWriter> writer = std::make_unique<TraceWriter>();
+    VfsError error = writer->open(path);
+    if (error == VfsError::None) {
+        trace = std::move(writer);
+    }
+    return error;
+}
+
+void Volume::stopTrace() {
+    trace.reset();
+}
+
+void Volume::setCopyThreads(size_t threads) {
+    copyThreads = std::max<size_t>(1, threads);
+}
+
+void Volume::setSyncMode(SyncMode mode) {
+    stopSyncThread();
+    syncMode = mode;
+    startSyncThread();
+}
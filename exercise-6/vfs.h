@@ -0,0 +1,1071 @@
+#ifndef __vfs_h
+#define __vfs_h
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define MAGIC_NUMBER 2137
+#define FILE_NAME_SIZE 512
+#define BLOCK_SIZE 1024
+#define MIN_FILE_SYSTEM_SIZE 1048576
+#define BITMAP_WORD_BITS 64
+#define BLOCKS_PER_GROUP 8192
+#define HISTOGRAM_BUCKETS 24
+#define IO_BATCH_BLOCKS 128
+#define COPY_BUFFER_SIZE 1048576
+#define TAR_BLOCK_SIZE 512
+// Blocks staged before an import writes them, run records included
+#define IMPORT_BUFFER_BLOCKS 4096
+// Run records of a chain keep the length of the run in their top bits and the number of the block
+// starting the next run in the rest, enough for 2^48 blocks
+#define RUN_LENGTH_BITS 16
+#define BLOCK_NUMBER_BITS 48
+#define NO_INODE SIZE_MAX
+// INodes live in chunks of consecutive blocks taken from the data region whenever the ones before are full.
+// A chunk starts with a bitmap of its taken INodes, the INodes follow it.
+#define INODE_CHUNK_BLOCKS 64
+#define INODE_CHUNK_BITMAP_WORDS 2
+#define INODES_PER_CHUNK ((INODE_CHUNK_BLOCKS * sizeof(DataBlock) - INODE_CHUNK_BITMAP_WORDS * sizeof(uint64_t)) / sizeof(INode))
+// Lock regions lie far past the end of any image, region 0 stands for the metadata and 1 + i for INode i
+#define LOCK_SPACE_START (uint64_t(1) << 62)
+#define LOCK_METADATA 0
+// Snapshots are kept as files named with this prefix, holding the INodes of the files they saved
+#define SNAPSHOT_PREFIX "\x01snapshot:"
+// On a packing volume the bytes of a file past its last whole block go into a fragment block shared with
+// other tails. A fragment block is split in units, one bit of a bitmap word each.
+#define FRAGMENT_UNIT_SIZE 16
+#define FRAGMENT_UNITS (BLOCK_SIZE / FRAGMENT_UNIT_SIZE)
+// A striped volume spreads its image over member files, units of it going to them round-robin.
+// Every member starts with a header naming the volume, the superblock lists the paths of all but the first.
+#define STRIPE_UNIT_SIZE (64 * 1024)
+#define MEMBER_HEADER_SIZE 4096
+#define MEMBER_MAGIC 2138
+#define MAX_MEMBERS 16
+#define MEMBER_PATH_SIZE 256
+// Largest chain a reorganization moves, it is held in memory while its blocks are taken again.
+// A larger file is read sequentially anyway.
+#define REORGANIZE_BUFFER_SIZE (64 * COPY_BUFFER_SIZE)
+// Longest time writes of the batch sync mode wait for the sync making them durable
+#define SYNC_BATCH_INTERVAL_MS 50
+// Threads creating files at the same time keep a group cursor each, picked by their id
+#define ALLOCATION_CURSORS 16
+// Files or groups a thread of a check takes at once
+#define CHECK_BATCH_SIZE 64
+// A directory is a file holding a B+tree of its entries keyed by name, in nodes of DIRECTORY_NODE_SIZE bytes.
+// Node 0 is the header, the file doubles whenever a split needs more nodes than it has.
+#define DIRECTORY_NODE_SIZE 4096
+// Longest name of an entry, the terminating zero included. Every part of a path is held to it, while the
+// whole path may take up to FILE_NAME_SIZE.
+#define DIRECTORY_NAME_SIZE 120
+#define DIRECTORY_NODE_ENTRIES ((DIRECTORY_NODE_SIZE - 2 * sizeof(uint64_t)) / sizeof(DirectoryEntry))
+// Flags of an INode
+#define INODE_DIRECTORY 1
+
+struct INode {
+    char fileName[FILE_NAME_SIZE] = {};
+    size_t fileSize = 0;
+    // Number of the block starting the chain, meaningless for an empty file
+    uint64_t firstBlock = 0;
+    // Tail of a packed file, `tailLength` bytes at `tailOffset` of a fragment block. The chain holds the rest.
+    uint64_t tailBlock = 0;
+    uint32_t tailOffset = 0;
+    uint32_t tailLength = 0;
+    // Opens of the file so far. Counted in memory and added to the image in batches, so only approximate.
+    uint64_t accessCount = 0;
+    uint64_t flags = 0;
+};
+
+// Entry of a directory node. In a leaf it names the INode of a file, in an inner node the child holding
+// the names from this one up to the next entry, the first entry of a node standing for every name before.
+struct DirectoryEntry {
+    char name[DIRECTORY_NAME_SIZE] = {};
+    uint64_t target = 0;
+};
+
+struct DirectoryNode {
+    uint32_t leaf = 1;
+    uint32_t entryAmount = 0;
+    // Leaf holding the names following the ones of this leaf, 0 past the last one
+    uint64_t nextLeaf = 0;
+    DirectoryEntry entries[DIRECTORY_NODE_ENTRIES];
+};
+
+struct DirectoryHeader {
+    uint64_t rootNode = 1;
+    uint64_t nodeAmount = 2;
+    // Files and directories in the directory
+    uint64_t entryAmount = 0;
+};
+
+// A chain is a list of runs of consecutive blocks. Only the block a chain enters a run at
+// holds a record of it, the trailers of the other blocks are not read.
+struct DataBlock {
+    char data[BLOCK_SIZE] = {};
+    uint64_t run = 0;
+};
+
+struct SuperBlock {
+    size_t magicNumber;
+    size_t fileSystemSize;
+    // INodes of all chunks taken so far
+    size_t iNodeAmount;
+    size_t blockAmount;
+    size_t groupAmount;
+    size_t blocksPerGroup;
+    size_t groupTableStart;
+    size_t groupStart;
+    size_t groupSize;
+    size_t freeINodeAmount;
+    // Bumped by every change of the metadata, other processes reload theirs when it moved
+    size_t generation;
+    // The chunk index is a chain of blocks holding the first block of every INode chunk
+    size_t chunkAmount;
+    uint64_t chunkIndexBlock;
+    // Set when the volume was created to pack tails of files into fragment blocks
+    size_t tailPacking;
+    // Image files the volume is striped over, 1 for a plain image
+    size_t memberAmount;
+    uint64_t volumeId;
+    char memberPaths[MAX_MEMBERS - 1][MEMBER_PATH_SIZE];
+};
+
+struct MemberHeader {
+    size_t magicNumber;
+    uint64_t volumeId;
+    size_t index;
+    size_t memberAmount;
+};
+
+// Every block group has its own block bitmap, share counts and data blocks
+struct GroupDescriptor {
+    size_t blockBitmapStart;
+    size_t shareCountStart;
+    size_t blockStart;
+    size_t blockAmount;
+    size_t freeBlockAmount;
+    // Blocks with more than one owner, a group without any has no share counts to read
+    size_t sharedBlockAmount;
+};
+
+inline bool testBit(const std::vector<uint64_t>& bitmap, size_t index) {
+    return (bitmap[index / BITMAP_WORD_BITS] & (uint64_t(1) << (index % BITMAP_WORD_BITS))) != 0;
+}
+
+// Whole words inside the range are set at once
+inline void setBits(std::vector<uint64_t>& bitmap, size_t start, size_t length, bool value) {
+    size_t i = start;
+    while (i < start + length) {
+        if (i % BITMAP_WORD_BITS == 0 && i + BITMAP_WORD_BITS <= start + length) {
+            bitmap[i / BITMAP_WORD_BITS] = value ? ~uint64_t(0) : 0;
+            i += BITMAP_WORD_BITS;
+            continue;
+        }
+        if (value) {
+            bitmap[i / BITMAP_WORD_BITS] |= uint64_t(1) << (i % BITMAP_WORD_BITS);
+        } else {
+            bitmap[i / BITMAP_WORD_BITS] &= ~(uint64_t(1) << (i % BITMAP_WORD_BITS));
+        }
+        i++;
+    }
+}
+
+struct Extent {
+    size_t start;
+    size_t length;
+};
+
+// Free space of the data region kept as runs of consecutive free blocks.
+// Runs are indexed both by start (for coalescing) and by length (for best fit),
+// so every operation is O(log n) in the number of free runs.
+class ExtentAllocator {
+    private:
+        std::map<size_t, size_t> extentsByStart;
+        std::set<std::pair<size_t, size_t>> extentsByLength;
+        size_t freeBlocks = 0;
+
+        void insertExtent(size_t start, size_t length) {
+            extentsByStart[start] = length;
+            extentsByLength.insert({length, start});
+            freeBlocks += length;
+        }
+
+        void eraseExtent(std::map<size_t, size_t>::iterator it) {
+            extentsByLength.erase({it->second, it->first});
+            freeBlocks -= it->second;
+            extentsByStart.erase(it);
+        }
+
+        // Takes the first `length` blocks of the free run starting at `start`
+        Extent takeFrom(size_t start, size_t length) {
+            auto it = extentsByStart.find(start);
+            size_t extentLength = it->second;
+            eraseExtent(it);
+            if (extentLength > length) {
+                insertExtent(start + length, extentLength - length);
+            }
+            return {start, length};
+        }
+
+    public:
+        void clear() {
+            extentsByStart.clear();
+            extentsByLength.clear();
+            freeBlocks = 0;
+        }
+
+        // Returns blocks to the free space, merging them with neighbouring free runs
+        void release(size_t start, size_t length) {
+            if (length == 0) {
+                return;
+            }
+
+            auto next = extentsByStart.lower_bound(start);
+            if (next != extentsByStart.begin()) {
+                auto previous = std::prev(next);
+                if (previous->first + previous->second == start) {
+                    start = previous->first;
+                    length += previous->second;
+                    eraseExtent(previous);
+                }
+            }
+
+            next = extentsByStart.lower_bound(start);
+            if (next != extentsByStart.end() && start + length == next->first) {
+                length += next->second;
+                eraseExtent(next);
+            }
+
+            insertExtent(start, length);
+        }
+
+        // Best fitting single run if one exists, otherwise the fewest runs:
+        // largest runs first and the best fitting run for the remainder
+        std::vector<Extent> allocate(size_t blocks) {
+            std::vector<Extent> extents;
+            if (blocks > freeBlocks) {
+                return extents;
+            }
+
+            while (blocks > 0) {
+                auto bestFit = extentsByLength.lower_bound({blocks, 0});
+                if (bestFit != extentsByLength.end()) {
+                    extents.push_back(takeFrom(bestFit->second, blocks));
+                    break;
+                }
+
+                auto largest = std::prev(extentsByLength.end());
+                Extent extent = takeFrom(largest->second, largest->first);
+                blocks -= extent.length;
+                extents.push_back(extent);
+            }
+
+            return extents;
+        }
+
+        // Lowest free blocks at or after `from` in block order, fewer than `blocks` when no more are free there
+        std::vector<Extent> allocateFrom(size_t from, size_t blocks) {
+            std::vector<Extent> extents;
+            auto it = extentsByStart.upper_bound(from);
+            if (it != extentsByStart.begin() && std::prev(it)->first + std::prev(it)->second > from) {
+                --it;
+            }
+            while (blocks > 0 && it != extentsByStart.end()) {
+                size_t extentStart = it->first;
+                size_t extentEnd = it->first + it->second;
+                size_t start = std::max(extentStart, from);
+                size_t length = std::min(blocks, extentEnd - start);
+                eraseExtent(it++);
+                if (start > extentStart) {
+                    insertExtent(extentStart, start - extentStart);
+                }
+                if (start + length < extentEnd) {
+                    insertExtent(start + length, extentEnd - start - length);
+                }
+                extents.push_back({start, length});
+                blocks -= length;
+            }
+            return extents;
+        }
+
+        bool isFree(size_t block) const {
+            auto it = extentsByStart.upper_bound(block);
+            if (it == extentsByStart.begin()) {
+                return false;
+            }
+            --it;
+            return block < it->first + it->second;
+        }
+
+        size_t getFreeBlocks() const {
+            return freeBlocks;
+        }
+
+        size_t getLargestExtent() const {
+            return extentsByLength.empty() ? 0 : extentsByLength.rbegin()->first;
+        }
+
+        const std::map<size_t, size_t>& getExtents() const {
+            return extentsByStart;
+        }
+};
+
+// Free units of the fragment blocks holding tails. Blocks are indexed by their longest free run of units,
+// so a tail goes to the block it fits best in O(log n) in the number of fragment blocks.
+class FragmentAllocator {
+    private:
+        // Taken units of every fragment block
+        std::map<uint64_t, uint64_t> takenUnits;
+        std::set<std::pair<size_t, uint64_t>> blocksByRun;
+        size_t takenUnitAmount = 0;
+
+        static size_t calculateUnits(size_t length) {
+            return (length + FRAGMENT_UNIT_SIZE - 1) / FRAGMENT_UNIT_SIZE;
+        }
+
+        // First free run of at least `units` units, or the longest free run when `units` is 0.
+        // Returns FRAGMENT_UNITS when none is long enough.
+        static size_t findRun(uint64_t taken, size_t units, size_t& longest) {
+            longest = 0;
+            size_t unit = 0;
+            while (unit < FRAGMENT_UNITS) {
+                size_t length = std::min<size_t>(std::countr_zero(taken >> unit), FRAGMENT_UNITS - unit);
+                if (units > 0 && length >= units) {
+                    return unit;
+                }
+                longest = std::max(longest, length);
+                unit += length;
+                if (unit < FRAGMENT_UNITS) {
+                    unit += std::countr_one(taken >> unit);
+                }
+            }
+            return FRAGMENT_UNITS;
+        }
+
+        static uint64_t maskUnits(size_t first, size_t units) {
+            return (units == FRAGMENT_UNITS ? ~uint64_t(0) : (uint64_t(1) << units) - 1) << first;
+        }
+
+        void setTaken(std::map<uint64_t, uint64_t>::iterator it, uint64_t taken) {
+            size_t longest;
+            findRun(it->second, 0, longest);
+            blocksByRun.erase({longest, it->first});
+            takenUnitAmount = takenUnitAmount - std::popcount(it->second) + std::popcount(taken);
+            it->second = taken;
+            findRun(taken, 0, longest);
+            blocksByRun.insert({longest, it->first});
+        }
+
+    public:
+        void clear() {
+            takenUnits.clear();
+            blocksByRun.clear();
+            takenUnitAmount = 0;
+        }
+
+        // Adds a fragment block with no tail in it yet
+        void addBlock(uint64_t block) {
+            takenUnits[block] = 0;
+            blocksByRun.insert({FRAGMENT_UNITS, block});
+        }
+
+        // Marks the units of a tail already stored, adding its block when it is the first one seen there
+        void mark(uint64_t block, size_t offset, size_t length) {
+            if (!takenUnits.contains(block)) {
+                addBlock(block);
+            }
+            auto it = takenUnits.find(block);
+            setTaken(it, it->second | maskUnits(offset / FRAGMENT_UNIT_SIZE, calculateUnits(length)));
+        }
+
+        bool fits(size_t length) const {
+            return blocksByRun.lower_bound({calculateUnits(length), 0}) != blocksByRun.end();
+        }
+
+        // Takes room for a tail in the given fragment block, false when it has none
+        bool takeIn(uint64_t block, size_t length, size_t& offset) {
+            auto it = takenUnits.find(block);
+            if (it == takenUnits.end()) {
+                return false;
+            }
+            size_t units = calculateUnits(length);
+            size_t longest;
+            size_t first = findRun(it->second, units, longest);
+            if (first == FRAGMENT_UNITS) {
+                return false;
+            }
+            setTaken(it, it->second | maskUnits(first, units));
+            offset = first * FRAGMENT_UNIT_SIZE;
+            return true;
+        }
+
+        // Takes room for a tail in the block whose longest free run fits it best
+        bool take(size_t length, uint64_t& block, size_t& offset) {
+            auto best = blocksByRun.lower_bound({calculateUnits(length), 0});
+            if (best == blocksByRun.end()) {
+                return false;
+            }
+            block = best->second;
+            return takeIn(block, length, offset);
+        }
+
+        // Returns the units of a tail, true when its block holds no tail anymore and was dropped
+        bool release(uint64_t block, size_t offset, size_t length) {
+            auto it = takenUnits.find(block);
+            setTaken(it, it->second & ~maskUnits(offset / FRAGMENT_UNIT_SIZE, calculateUnits(length)));
+            if (it->second != 0) {
+                return false;
+            }
+            blocksByRun.erase({FRAGMENT_UNITS, block});
+            takenUnits.erase(it);
+            return true;
+        }
+
+        size_t getBlockAmount() const {
+            return takenUnits.size();
+        }
+
+        size_t getTakenBytes() const {
+            return takenUnitAmount * FRAGMENT_UNIT_SIZE;
+        }
+};
+
+// In memory state of a block group, indexes inside are local to the group.
+// Only the descriptor of a group never used is kept, the rest is set up when something is first allocated in it,
+// so opening an image costs as much as the groups in use and not the size of the image.
+struct BlockGroup {
+    GroupDescriptor descriptor;
+    bool loaded = false;
+    std::vector<uint64_t> blockBitmap;
+    // Owners of every block besides the first one, blocks of clones and snapshots have more than one.
+    // Empty while no block of the group is shared.
+    std::vector<uint16_t> shareCounts;
+    ExtentAllocator freeSpace;
+    // Writers allocating in different groups never wait for each other
+    std::mutex lock;
+};
+
+// In memory state of an INode chunk, INode i of the volume is INode i % INODES_PER_CHUNK of chunk i / INODES_PER_CHUNK
+struct INodeChunk {
+    uint64_t firstBlock;
+    std::vector<uint64_t> bitmap;
+    size_t freeINodeAmount;
+};
+
+// Shared regions are held by readers of this and other processes. An allocating region keeps other processes out
+// like an exclusive one, but is shared by the threads of this process creating files.
+enum class LockMode {
+    Shared,
+    Allocating,
+    Exclusive
+};
+
+// Byte-range locks on the image shared with other processes through open file description locks.
+// Threads of one process are counted per region: the first one takes the lock and the last one drops it,
+// so a shared region is never unlocked under a thread still using it.
+class ImageLocks {
+    private:
+        struct Region {
+            size_t holders = 0;
+            LockMode mode = LockMode::Shared;
+            // Set while the first holder waits for the other processes
+            bool acquiring = false;
+            // Threads waiting in acquire(), a region is forgotten once nobody holds or waits for it
+            size_t waiters = 0;
+        };
+
+        int discFile = -1;
+        std::mutex lock;
+        std::condition_variable changed;
+        std::unordered_map<size_t, Region> regions;
+
+        bool setLock(size_t region, short type);
+
+    public:
+        void attach(int file);
+        bool acquire(size_t region, LockMode mode);
+        bool acquire(size_t region, bool exclusive) {
+            return acquire(region, exclusive ? LockMode::Exclusive : LockMode::Shared);
+        }
+        void release(size_t region);
+};
+
+class ImageLockGuard {
+    private:
+        ImageLocks& locks;
+        size_t region;
+        bool locked;
+
+    public:
+        ImageLockGuard(ImageLocks& p_locks, size_t p_region, LockMode mode) : locks(p_locks), region(p_region) {
+            locked = locks.acquire(region, mode);
+        }
+
+        ImageLockGuard(ImageLocks& p_locks, size_t p_region, bool exclusive)
+            : ImageLockGuard(p_locks, p_region, exclusive ? LockMode::Exclusive : LockMode::Shared) {}
+
+        ~ImageLockGuard() {
+            if (locked) {
+                locks.release(region);
+            }
+        }
+
+        ImageLockGuard(const ImageLockGuard&) = delete;
+        ImageLockGuard& operator=(const ImageLockGuard&) = delete;
+
+        bool isLocked() const {
+            return locked;
+        }
+};
+
+// Lets the name index be searched with a std::string_view without building a std::string
+struct NameHash {
+    using is_transparent = void;
+
+    size_t operator()(std::string_view name) const {
+        return std::hash<std::string_view>{}(name);
+    }
+};
+
+enum class VfsError {
+    None = 0,
+    NotFound,
+    AlreadyExists,
+    NoFreeINodes,
+    NoSpace,
+    TooSmall,
+    Corrupted,
+    InvalidHandle,
+    OutOfRange,
+    IoError,
+    HostIoError,
+    TooManyClones,
+    InvalidMembers,
+    ReadOnly,
+    InvalidName,
+    IsDirectory,
+    NotDirectory,
+    DirectoryNotEmpty,
+};
+
+const char* describeError(VfsError error);
+
+enum VfsPhase {
+    PHASE_LOAD,
+    PHASE_LOOKUP,
+    PHASE_ALLOCATION,
+    PHASE_METADATA,
+    PHASE_DATA,
+    PHASE_HOST,
+    PHASE_AMOUNT
+};
+
+const char* describePhase(VfsPhase phase);
+
+// I/O counters and per-phase wall time of a volume, updated with relaxed atomics.
+// Building with -DVFS_NO_STATS removes every update, the counters then stay at zero.
+struct IoCounters {
+    std::atomic<uint64_t> bytesRead = 0;
+    std::atomic<uint64_t> bytesWritten = 0;
+    // Image accesses not starting where the previous one ended
+    std::atomic<uint64_t> seeks = 0;
+    std::atomic<uint64_t> syscalls = 0;
+    // Bitmap bits and chain links visited while looking for free or owned blocks
+    std::atomic<uint64_t> blocksScanned = 0;
+    // fsync and fdatasync calls, one for every member file synced
+    std::atomic<uint64_t> syncs = 0;
+    std::atomic<uint64_t> lastOffset = 0;
+    std::atomic<uint64_t> phaseNanoseconds[PHASE_AMOUNT] = {};
+};
+
+struct IoStatistics {
+    bool enabled;
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint64_t seeks;
+    uint64_t syscalls;
+    uint64_t blocksScanned;
+    uint64_t syncs;
+    uint64_t phaseNanoseconds[PHASE_AMOUNT];
+};
+
+// Adds the wall time of its scope to one phase
+class PhaseTimer {
+    private:
+        IoCounters& counters;
+        VfsPhase phase;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    public:
+        PhaseTimer(IoCounters& p_counters, VfsPhase p_phase) : counters(p_counters), phase(p_phase) {}
+
+        ~PhaseTimer() {
+            auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+            counters.phaseNanoseconds[phase].fetch_add(elapsed.count(), std::memory_order_relaxed);
+        }
+};
+
+#define VFS_CONCAT_INNER(a, b) a##b
+#define VFS_CONCAT(a, b) VFS_CONCAT_INNER(a, b)
+
+#ifdef VFS_NO_STATS
+#define VFS_COUNT(counter, amount) ((void)0)
+#define VFS_ACCESS(offset, size) ((void)0)
+#define VFS_PHASE(phase) ((void)0)
+#else
+#define VFS_COUNT(counter, amount) counters.counter.fetch_add(amount, std::memory_order_relaxed)
+#define VFS_ACCESS(offset, size) countAccess(offset, size)
+#define VFS_PHASE(phase) PhaseTimer VFS_CONCAT(phaseTimer, __LINE__)(counters, phase)
+#endif
+
+// Run of blocks of a file, `fileBlock` is the position of its first block inside the file
+struct FileExtent {
+    size_t fileBlock;
+    size_t start;
+    size_t length;
+};
+
+// Open file of a volume. Its block runs are resolved once on open, so reads and writes
+// go straight to the image without walking the chain or allocating.
+// It holds a lock on its file until closeFile(): shared when opened, exclusive when created.
+struct FileHandle {
+    size_t iNode = 0;
+    size_t size = 0;
+    bool open = false;
+    std::vector<FileExtent> extents;
+    // First block shared with a clone or a snapshot, every later block is shared too
+    size_t sharedBlock = SIZE_MAX;
+    // Bytes past the chain, kept in a fragment block at `tailStart` of the image and never shared
+    size_t tailStart = 0;
+    size_t tailLength = 0;
+};
+
+struct FileInfo {
+    std::string name;
+    size_t size;
+    // Only filled in when requested, counting them walks the chain of the file
+    size_t fragments;
+    bool directory = false;
+};
+
+struct VolumeStatistics {
+    size_t groupAmount;
+    size_t iNodeChunkAmount;
+    size_t iNodeAmount;
+    size_t freeINodeAmount;
+    size_t blockAmount;
+    size_t freeBlockAmount;
+    size_t largestFreeExtent;
+    size_t freeExtents;
+    // Blocks owned by more than one file or snapshot
+    size_t sharedBlockAmount;
+    size_t snapshotAmount;
+    // Directories, the root included, and the blocks of their indexes
+    size_t directoryAmount;
+    size_t directoryBlockAmount;
+    bool tailPacking;
+    size_t memberAmount;
+    size_t fragmentBlockAmount;
+    // Bytes of the fragment blocks taken by tails, counted in whole units
+    size_t fragmentBytesTaken;
+    // Bucket i counts free runs of 2^i to 2^(i+1)-1 blocks
+    std::vector<size_t> freeExtentHistogram;
+};
+
+class TraceWriter;
+struct iovec;
+
+// One host file of an import, `size` and `error` are filled in by the import
+struct ImportEntry {
+    std::string hostPath;
+    std::string name;
+    size_t size = 0;
+    VfsError error = VfsError::None;
+};
+
+enum class ImportOrder {
+    Size,
+    Name
+};
+
+// When the writes of an operation reach the disc: whenever the system writes them back, within
+// SYNC_BATCH_INTERVAL_MS, before the operation returns, or the same with file data synced before
+// the metadata pointing at it is written
+enum class SyncMode {
+    None,
+    Batch,
+    Data,
+    Full
+};
+
+// How a volume opened read-only maps its image. The metadata and the INode chunks are read ahead either way,
+// the data region is read sequentially.
+struct MapOptions {
+    // Faults in the metadata, the INode chunks and the data of every group in use when opening
+    bool populate = false;
+    // Asks for huge pages under the mapping, so reading the data takes fewer faults and TLB misses
+    bool hugePages = false;
+};
+
+struct SnapshotInfo {
+    std::string name;
+    size_t files;
+};
+
+// Findings of a check, built from the chains, chunks and tails alone. Every owner of a block counts once,
+// however often its chain runs through it.
+struct CheckReport {
+    // INodes walked, the ones saved in snapshots included
+    size_t files = 0;
+    size_t blocksInUse = 0;
+    // Blocks owned more often than their share counts allow
+    size_t crossLinkedBlocks = 0;
+    // Chains running into blocks they went through already
+    size_t cycles = 0;
+    // Blocks taken in a bitmap that nothing owns
+    size_t orphanBlocks = 0;
+    // Blocks owned by something but free in their bitmap, a new file could take them
+    size_t unmarkedBlocks = 0;
+    // Chains ending before the size of their file, tails not matching it or lying outside their fragment block
+    size_t sizeMismatches = 0;
+    // Tails sharing units of a fragment block
+    size_t overlappingTails = 0;
+    // Share counts above the owners of their block
+    size_t shareCountMismatches = 0;
+    // Free and shared block amounts of groups and free INodes of the superblock not matching the bitmaps
+    size_t counterMismatches = 0;
+    // Groups whose bitmaps, share counts and counters were written again
+    size_t groupsRepaired = 0;
+};
+
+// Run of blocks of one group with the same amount of owners
+struct CheckRun {
+    size_t start;
+    size_t length;
+    size_t owners;
+};
+
+struct CheckTail {
+    uint64_t block;
+    uint32_t offset;
+    uint32_t length;
+};
+
+// What one thread of a check found: the runs of every file once for each file owning them and the tails
+struct CheckWalk {
+    std::vector<Extent> owned;
+    std::vector<CheckTail> tails;
+    CheckReport report;
+};
+
+struct ReorganizeReport {
+    // Files opened at least once, out of which the hottest were considered
+    size_t hotFiles = 0;
+    size_t filesMoved = 0;
+    size_t blocksMoved = 0;
+    // Files sharing blocks with clones or snapshots, or too large to move
+    size_t filesSkipped = 0;
+    // Files moved out of the way of the hot ones
+    size_t coldFilesMoved = 0;
+    size_t coldBlocksMoved = 0;
+};
+
+// Image opened once and kept in memory. Every change is written through to the image,
+// failures are reported as error codes and nothing is printed.
+// Other processes may use the image at the same time: changes of the metadata take the metadata region
+// exclusively, lookups take it shared and reload the metadata when its generation moved. Files are
+// locked for as long as a handle is open, so data is never freed under a reader.
+class Volume {
+    private:
+        int discFile = -1;
+        // Descriptors of the image files, the first one is discFile
+        std::vector<int> memberFiles;
+        // Mappings of the image files when opened read-only, empty otherwise
+        std::vector<std::span<std::byte>> memberMappings;
+        MapOptions mapOptions;
+        SuperBlock superBlock;
+        std::deque<BlockGroup> groups;
+        // Only the INodes in use, by index
+        std::map<size_t, INode> iNodes;
+        std::vector<INodeChunk> chunks;
+        // Blocks of the chunk index
+        std::vector<Extent> chunkIndexExtents;
+        std::unordered_map<std::string, size_t, NameHash, std::equal_to<>> nameIndex;
+        // Guards the INodes, their chunks and the name index, writers of the namespace take it exclusively
+        mutable std::shared_mutex namespaceLock;
+        // Guards the totals kept in the superblock, held only while updating them
+        mutable std::mutex superBlockLock;
+        mutable IoCounters counters;
+        ImageLocks imageLocks;
+        // Generation of the metadata held in memory
+        std::atomic<size_t> loadedGeneration = 0;
+        // Set while the operations of the volume are recorded to a trace file
+        std::unique_ptr<TraceWriter> trace;
+        // Threads copying one file out of the volume
+        std::atomic<size_t> copyThreads = 1;
+        // Free blocks of all groups, guarded by superBlockLock
+        size_t freeBlockAmount = 0;
+        // Group the last new file of a thread went to, the search for its next one starts there
+        std::atomic<size_t> groupCursors[ALLOCATION_CURSORS] = {};
+        // Room left in the fragment blocks, guarded by namespaceLock
+        FragmentAllocator fragments;
+        // Opens of every file not yet added to the counters on the image
+        std::mutex accessLock;
+        std::unordered_map<size_t, uint64_t> pendingAccesses;
+        std::atomic<SyncMode> syncMode = SyncMode::None;
+        // Writes to the image so far, the ones of file data alone, and how many of both the last sync covered.
+        // A thread whose writes were covered by the sync of another one does not sync again.
+        std::atomic<uint64_t> writeSequence = 0;
+        std::atomic<uint64_t> dataSequence = 0;
+        std::atomic<uint64_t> syncedWrites = 0;
+        std::atomic<uint64_t> syncedData = 0;
+        std::mutex syncLock;
+        // Syncs the image periodically in the batch mode
+        std::thread syncThread;
+        std::mutex syncThreadLock;
+        std::condition_variable syncThreadWake;
+        bool syncThreadStopping = false;
+
+        size_t calculateBitmapWords(size_t bits) const;
+        size_t calculateShareCountSize() const;
+        size_t calculateGroupMetadataSize() const;
+        size_t calculateBlocksAmount(size_t fileSize) const;
+        size_t calculateTailLength(size_t fileSize) const;
+        size_t calculateTailStart(const INode& iNode) const;
+        size_t calculateINodeOffset(size_t index) const;
+        size_t calculateDataBlockOffsetFromIndex(size_t blockIndex) const;
+        void initializeSuperBlock(size_t systemSize);
+
+        void countAccess(size_t offset, size_t size) const;
+        size_t locate(size_t offset, size_t size, size_t& member, size_t& memberOffset) const;
+        bool copyMapped(void* buffer, size_t size, size_t member, size_t memberOffset) const;
+        bool readAt(void* buffer, size_t size, size_t offset) const;
+        bool writeAt(const void* buffer, size_t size, size_t offset, bool metadata = false);
+        bool transferRange(iovec* segments, size_t segmentsAmount, size_t offset, size_t length, bool writing);
+        void countWrite(bool metadata);
+        bool syncImage(bool full);
+        VfsError finishChange(VfsError error);
+        void startSyncThread();
+        void stopSyncThread();
+        void runSyncThread();
+        bool writeSuperBlock();
+        bool writeGroupDescriptor(size_t group);
+        bool writeBitmapWords(size_t bitmapStart, std::vector<uint64_t>& bitmap, size_t first, size_t last);
+        bool writeINode(size_t index);
+        bool writeShareCounts(size_t group, size_t first, size_t last);
+        bool writeRun(size_t block, size_t length, size_t nextBlock);
+        bool linkBlocks(const std::vector<Extent>& extents, size_t lastNextBlock);
+
+        VfsError open(const std::string& path, const MapOptions* mapping);
+        VfsError openMembers(int flags);
+        bool mapMembers();
+        void adviseRange(size_t offset, size_t length, int advice) const;
+        void adviseGroups(const std::vector<GroupDescriptor>& descriptors) const;
+        void adviseChunks(const std::vector<uint64_t>& firstBlocks) const;
+        bool isReadOnly() const;
+        size_t calculateCopyThreads(size_t chunks) const;
+        VfsError loadSuperBlock();
+        VfsError loadGroups();
+        bool loadGroup(size_t group);
+        void updateFreeBlocks(size_t released, size_t taken);
+        VfsError loadINodes();
+        void buildFreeSpace(BlockGroup& group);
+        VfsError refresh();
+        bool beginMetadataChange();
+
+        bool isINodeFree(size_t index) const;
+        bool isDataBlockFree(size_t index) const;
+        uint16_t getShareCount(size_t block) const;
+        size_t getINodeGroup(size_t index) const;
+        size_t calculateChunksNeeded(size_t iNodesAmount) const;
+        size_t findINode(std::string_view name) const;
+        std::atomic<size_t>& getGroupCursor();
+        size_t chooseGroup(size_t blocksAmount);
+        bool allocateChunk(size_t group);
+        size_t takeINode(size_t group);
+        size_t allocateINode(size_t group);
+        bool releaseINode(size_t index);
+        std::vector<Extent> allocateDataBlocks(size_t group, size_t blocksAmount, size_t fromBlock = SIZE_MAX);
+        bool releaseDataBlocks(Extent extent);
+        bool isSharingPossible(const std::vector<Extent>& extents) const;
+        bool shareDataBlocks(const std::vector<Extent>& extents);
+        bool getChainExtents(size_t firstBlock, size_t fileSize, std::vector<Extent>& extents, size_t* sharedBlock = nullptr) const;
+        bool getFileExtents(size_t index, std::vector<Extent>& extents, size_t* sharedBlock = nullptr) const;
+        bool fillHandle(size_t index, FileHandle& handle) const;
+        bool allocateTail(INode& iNode, size_t length, size_t group);
+        bool releaseTail(INode& iNode);
+        bool copyTail(const INode& source, INode& copy, size_t group);
+        VfsError loadFragments();
+        void recordAccess(size_t index);
+        bool writeAccessCounts();
+        void flushAccessCounts();
+        bool relocateChain(size_t index, const std::vector<Extent>& extents, size_t& cursor, size_t& blocksMoved);
+        bool relocateTail(size_t index, FragmentAllocator& hotFragments, size_t zoneEnd, size_t& cursor, bool& moved);
+        size_t findZoneEnd(std::vector<Extent> runs, size_t neededBlocks, size_t& zoneFree);
+        VfsError checkPath(std::string_view name) const;
+        VfsError createParents(std::string_view name, std::unique_lock<std::shared_mutex>& guard, size_t& created);
+        void removeParents(std::string_view name, size_t created);
+        void discardINode(size_t index);
+        VfsError createDirectoryINode(std::string_view path, std::unique_lock<std::shared_mutex>& guard);
+        VfsError createINode(std::string_view name, size_t size, FileHandle& handle, std::unique_lock<std::shared_mutex>& guard, bool directory = false);
+        VfsError removeINode(size_t index);
+        bool isDirectory(size_t index) const;
+        bool transferDirectory(const FileHandle& handle, size_t offset, void* data, size_t size, bool writing);
+        bool findLeaf(const FileHandle& handle, const DirectoryHeader& header, std::string_view name, DirectoryNode& node, std::vector<std::pair<uint64_t, size_t>>& path);
+        size_t findEntry(size_t directory, std::string_view name);
+        bool insertEntry(size_t directory, std::string_view name, size_t target);
+        bool removeEntry(size_t directory, std::string_view name);
+        bool linkEntry(size_t index);
+        bool unlinkEntry(std::string_view name);
+        size_t resolvePath(std::string_view path);
+        VfsError unshareBlocks(FileHandle& handle, size_t lastBlock, size_t* bytesCopied = nullptr);
+        VfsError copySharedBlocks(size_t index, std::vector<Extent>& extents, size_t& sharedBlock, size_t lastBlock);
+        VfsError resizeINode(size_t index, size_t size, size_t* bytesCopied = nullptr);
+        bool allocateINodes(const std::vector<size_t>& preferredGroups, std::vector<size_t>& indexes);
+        VfsError streamImport(const std::vector<ImportEntry*>& files, const std::vector<Extent>& extents, const std::vector<INode>& created);
+        VfsError exportInPlace(int outputFile, size_t start, const std::vector<size_t>& files, const std::vector<size_t>& dataOffsets);
+        VfsError exportInOrder(int outputFile, const std::vector<size_t>& files);
+        bool readSnapshot(size_t index, std::vector<INode>& entries);
+        VfsError transfer(const FileHandle& handle, size_t offset, std::byte* buffer, size_t length, bool writing);
+        VfsError copyFileOut(const FileHandle& handle, int hostFile);
+        // Bodies of the operations changing the image, the public ones apply the sync mode to what they wrote
+        VfsError createFileUnsynced(std::string_view name, size_t size, FileHandle& handle);
+        VfsError removeFileUnsynced(std::string_view name);
+        VfsError writeUnsynced(FileHandle& handle, size_t offset, std::span<const std::byte> data, size_t& bytesWritten, size_t* bytesCopied = nullptr);
+        VfsError copyFileInUnsynced(int hostFile, std::string_view name);
+        VfsError updateFileUnsynced(int hostFile, std::string_view name, size_t& bytesWritten);
+        VfsError importFilesUnsynced(std::vector<ImportEntry>& entries, ImportOrder order);
+        VfsError cloneFileUnsynced(std::string_view source, std::string_view name);
+        VfsError createDirectoryUnsynced(std::string_view path);
+        VfsError removeDirectoryUnsynced(std::string_view path);
+        VfsError createSnapshotUnsynced(std::string_view name);
+        VfsError rollbackSnapshotUnsynced(std::string_view name);
+        VfsError removeSnapshotUnsynced(std::string_view name);
+        VfsError reorganizeUnsynced(size_t limit, ReorganizeReport& report);
+        VfsError checkUnsynced(bool repair, CheckReport& report);
+        void checkChain(uint64_t firstBlock, size_t size, std::vector<Extent>& owned, CheckReport& report) const;
+        void checkFile(const INode& iNode, CheckWalk& walk) const;
+        void expectGroup(size_t group, std::span<const CheckRun> runs, std::vector<uint64_t>& bitmap, std::vector<uint16_t>& shareCounts) const;
+        bool checkGroup(size_t group, std::span<const CheckRun> runs, CheckReport& report) const;
+        bool rebuildGroup(size_t group, std::span<const CheckRun> runs);
+
+    public:
+        Volume() = default;
+        ~Volume();
+        Volume(const Volume&) = delete;
+        Volume& operator=(const Volume&) = delete;
+
+        // A packing volume keeps the tails of all its files in fragment blocks. Given `members`, the image is
+        // striped over `path` and those files, so copies drive all of them at once.
+        static VfsError create(const std::string& path, size_t size, bool tailPacking = false, const std::vector<std::string>& members = {});
+        // Removes every member of a striped volume too
+        static VfsError destroy(const std::string& path);
+
+        VfsError open(const std::string& path);
+        // Maps the image read-only, reads then copy out of the mapping instead of taking a call each.
+        // Every change fails with VfsError::ReadOnly and opens are not counted.
+        VfsError openMapped(const std::string& path, const MapOptions& options = {});
+        void close();
+        bool isOpen() const;
+
+        // Takes an INode and all blocks for `size` bytes at once, the content is then written with write()
+        VfsError createFile(std::string_view name, size_t size, FileHandle& handle);
+        VfsError openFile(std::string_view name, FileHandle& handle);
+        void closeFile(FileHandle& handle);
+        // Waits until every handle of the file is closed, including the ones of this process
+        VfsError removeFile(std::string_view name);
+
+        // Names are paths of directories separated by '/'. Creating a file creates the directories missing on its path.
+        VfsError createDirectory(std::string_view path);
+        // Fails for a directory still holding entries
+        VfsError removeDirectory(std::string_view path);
+        // Entries of a directory in name order, read leaf by leaf from its index without looking at other files.
+        // The path is followed from the root through the index of every directory on it, "" or "/" is the root.
+        VfsError listDirectory(std::string_view path, std::vector<FileInfo>& entries);
+
+        VfsError read(const FileHandle& handle, size_t offset, std::span<std::byte> buffer, size_t& bytesRead);
+        // Blocks shared with clones or snapshots are copied before they are written
+        VfsError write(FileHandle& handle, size_t offset, std::span<const std::byte> data, size_t& bytesWritten);
+
+        // A new file sharing every block of `source`, both get private copies of the blocks they later write.
+        // Waits until every handle of the source is closed.
+        VfsError cloneFile(std::string_view source, std::string_view name);
+        // Saves the INodes of all files and shares their blocks, rolling back brings those files back.
+        // Both wait until every handle of the files is closed.
+        VfsError createSnapshot(std::string_view name);
+        VfsError rollbackSnapshot(std::string_view name);
+        VfsError removeSnapshot(std::string_view name);
+        void listSnapshots(std::vector<SnapshotInfo>& snapshots);
+
+        // Moves the files opened most often, the `limit` hottest or all opened at least once when 0, to the start
+        // of the data region one after another, the hottest first, after moving other files out of the way.
+        // Their tails are packed together the same way, so reading the working set with a cold cache becomes
+        // mostly sequential. Files sharing blocks stay put. Holds the metadata throughout and waits until every
+        // handle of a moved file is closed.
+        VfsError reorganize(size_t limit, ReorganizeReport& report);
+        // Walks the chain of every file, snapshots included, on a thread for every core, or more with setCopyThreads().
+        // Only run records, chunk bitmaps and saved INodes are read. The bitmaps, share counts and counters they imply
+        // are compared with the stored ones and, when `repair` is set, written over them. Files are left as they are.
+        // Holds the metadata throughout, exclusively when repairing.
+        VfsError check(bool repair, CheckReport& report);
+
+        // Streams a host file into a new file of the volume and the other way around
+        VfsError copyFileIn(const std::string& hostPath, std::string_view name);
+        VfsError copyFileOut(std::string_view name, const std::string& hostPath);
+        // Same with host files opened by the caller, the one written is cut to the size of the file.
+        // Both split the file in COPY_BUFFER_SIZE chunks moved by setCopyThreads() threads, at least one for every member.
+        VfsError copyFileIn(int hostFile, std::string_view name);
+        VfsError copyFileOut(std::string_view name, int hostFile);
+        // Brings a stored file up to date with a host file, only blocks that differ are written.
+        // Blocks are compared in place, so data inserted or removed rewrites the rest of the file.
+        // The bytes written count the blocks copied from shared ones and the bytes moved by a resize too.
+        // A file changing its size waits until every handle of it is closed.
+        VfsError updateFile(const std::string& hostPath, std::string_view name, size_t& bytesWritten);
+        VfsError updateFile(int hostFile, std::string_view name, size_t& bytesWritten);
+        // Creates many files at once: they get one run of blocks laid out in the given order, their data
+        // is written as one stream and their INodes in one batch. Entries that cannot be imported get their
+        // own error and are skipped, the call fails when the rest does not fit. Holds the metadata throughout.
+        VfsError importFiles(std::vector<ImportEntry>& entries, ImportOrder order);
+        // Writes every file as a POSIX tar stream, files ordered by where they start on the image.
+        // A seekable output is filled by one sweep over the blocks in image order, a pipe gets the files one by one.
+        VfsError exportArchive(int outputFile, size_t& filesExported);
+
+        // Reporting calls reload the metadata first when another process changed it
+        void listFiles(std::vector<FileInfo>& files, bool countFragments = false);
+        void getStatistics(VolumeStatistics& statistics);
+        // Amount of taken INodes and used blocks in every cell of `scale` entries
+        void getINodeUsage(size_t scale, std::vector<size_t>& usage);
+        void getBlockUsage(size_t scale, std::vector<size_t>& usage);
+        size_t getINodeAmount() const;
+        size_t getBlockAmount() const;
+        size_t getAmountOfFreeDataBlocks() const;
+
+        void getIoStatistics(IoStatistics& statistics) const;
+        void resetIoStatistics();
+
+        // Appends every following operation to a trace file that REPLAY can run again
+        VfsError startTrace(const std::string& path);
+        void stopTrace();
+
+        void setCopyThreads(size_t threads);
+        // Applies to every later operation, closing a volume syncs it in every mode but SyncMode::None
+        void setSyncMode(SyncMode mode);
+};
+
+#endif